@@ -51,19 +51,45 @@
 #include "houselog.h"
 #include "houselog_storage.h"
 
+#include "houselinux_source.h"
 #include "houselinux_cpu.h"
+#include "houselinux_wakeup.h"
 #include "houselinux_memory.h"
 #include "houselinux_storage.h"
 #include "houselinux_diskio.h"
 #include "houselinux_netio.h"
 #include "houselinux_temp.h"
+#include "houselinux_exec.h"
+#include "houselinux_process.h"
+#include "houselinux_perf.h"
+#include "houselinux_cpuidle.h"
+#include "houselinux_irq.h"
+#include "houselinux_vm.h"
+#include "houselinux_biolat.h"
+#include "houselinux_canary.h"
+#include "houselinux_power.h"
+#include "houselinux_probe.h"
+#include "houselinux_plugin_loader.h"
+#include "houselinux_anomaly.h"
+#include "houselinux_alert.h"
+#include "houselinux_sensor.h"
+#include "houselinux_export.h"
+#include "houselinux_recorder.h"
 
 static char HostName[256];
 
 static time_t HouseStartTime = 0;
 
+// The time of the bundle being built, 0 if none: all the parts of the
+// bundle are generated for that same time, and are never cached.
+static time_t HouseBundleTime = 0;
+
 static int HouseMetricsStoreEnabled = 1;
 
+static time_t houselinux_now (void) {
+    return HouseBundleTime ? HouseBundleTime : time(0);
+}
+
 
 // Return a short summary of current metrics.
 // In order to reduce the size, all metrics are expressed in percentages.
@@ -73,7 +99,7 @@ static const char *houselinux_summary (const char *method, const char *uri,
                                       const char *data, int length) {
     static char buffer[65537];
     int cursor;
-    time_t now = time(0);
+    time_t now = houselinux_now ();
 
     cursor = snprintf (buffer, sizeof(buffer),
                        "{\"host\":\"%s\","
@@ -86,6 +112,17 @@ static const char *houselinux_summary (const char *method, const char *uri,
     cursor += houselinux_diskio_summary (buffer+cursor, sizeof(buffer)-cursor);
     cursor += houselinux_netio_summary (buffer+cursor, sizeof(buffer)-cursor);
     cursor += houselinux_temp_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_exec_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_process_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_perf_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_cpuidle_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_irq_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_vm_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_biolat_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_canary_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_power_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_probe_summary (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_plugin_summary (buffer+cursor, sizeof(buffer)-cursor);
     snprintf (buffer+cursor, sizeof(buffer)-cursor, "}}");
     if (uri) echttp_content_type_json ();
     return buffer;
@@ -98,14 +135,14 @@ static const char *houselinux_status (const char *method, const char *uri,
                                       const char *data, int length) {
     static char buffer[65537];
     int cursor;
-    time_t now = time(0);
+    time_t now = houselinux_now ();
 
     // Cache the most recent result for 10 seconds to avoid the cost
     // of recalculating when there are multiple clients.
     // This does not apply to periodic recalculation, as this is
     // the reference for recording metrics.
     static time_t generated = 0;
-    if (uri && ((now - generated) < 10)) {
+    if (uri && (!HouseBundleTime) && ((now - generated) < 10)) {
         echttp_content_type_json ();
         return buffer;
     }
@@ -122,6 +159,17 @@ static const char *houselinux_status (const char *method, const char *uri,
     cursor += houselinux_diskio_status (buffer+cursor, sizeof(buffer)-cursor);
     cursor += houselinux_netio_status (buffer+cursor, sizeof(buffer)-cursor);
     cursor += houselinux_temp_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_exec_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_process_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_perf_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_cpuidle_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_irq_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_vm_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_biolat_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_canary_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_power_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_probe_status (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_plugin_status (buffer+cursor, sizeof(buffer)-cursor);
     snprintf (buffer+cursor, sizeof(buffer)-cursor, "}}");
     if (uri) echttp_content_type_json ();
     return buffer;
@@ -129,12 +177,48 @@ static const char *houselinux_status (const char *method, const char *uri,
 
 // Return the complete metrics, only on request.
 //
+// The size of this report depends on the host (mostly the number of CPUs,
+// disks, interfaces, interrupts..), so the buffer is allocated based on the
+// number of CPUs and grows when the report did not fit. A collector drops
+// its whole section when it runs out of space: a marker near the end of
+// the buffer detects this. If the report still does not fit at the maximum
+// size, it is returned with "truncated":true instead of silently missing
+// some sections.
+//
+#define HOUSE_DETAILS_RESERVE 4096
+#define HOUSE_DETAILS_MAX (16 * 1024 * 1024)
+
+typedef int houselinux_details_part (char *buffer, int size,
+                                     time_t now, time_t since);
+
 static const char *houselinux_details (const char *method, const char *uri,
                                        const char *data, int length) {
-    static char buffer[65537];
+
+    static houselinux_details_part *HouseDetailsParts[] = {
+        houselinux_cpu_details,
+        houselinux_memory_details,
+        houselinux_storage_details,
+        houselinux_diskio_details,
+        houselinux_netio_details,
+        houselinux_temp_details,
+        houselinux_exec_details,
+        houselinux_process_details,
+        houselinux_perf_details,
+        houselinux_cpuidle_details,
+        houselinux_irq_details,
+        houselinux_vm_details,
+        houselinux_biolat_details,
+        houselinux_canary_details,
+        houselinux_power_details,
+        houselinux_probe_details,
+        houselinux_plugin_details,
+        0
+    };
+    static char *buffer = 0;
+    static int size = 0;
+
     const char *sincearg = echttp_parameter_get ("since");
-    int c;
-    time_t now = time(0);
+    time_t now = houselinux_now ();
 
     time_t since = 0;
     if (sincearg) {
@@ -148,19 +232,178 @@ static const char *houselinux_details (const char *method, const char *uri,
         samplestart = HouseStartTime;
         sampleperiod = now - samplestart;
     }
-    c = snprintf (buffer, sizeof(buffer),
-                       "{\"host\":\"%s\",\"timestamp\":%lld,"
-                          "\"Metrics\":{\"start\":%lld,\"period\":%d",
-                       HostName, (long long)now,
-                       (long long)samplestart, sampleperiod);
-
-    c += houselinux_cpu_details (buffer+c, sizeof(buffer)-c, now, since);
-    c += houselinux_memory_details (buffer+c, sizeof(buffer)-c, now, since);
-    c += houselinux_storage_details (buffer+c, sizeof(buffer)-c, now, since);
-    c += houselinux_diskio_details (buffer+c, sizeof(buffer)-c, now, since);
-    c += houselinux_netio_details (buffer+c, sizeof(buffer)-c, now, since);
-    c += houselinux_temp_details (buffer+c, sizeof(buffer)-c, now, since);
-    snprintf (buffer+c, sizeof(buffer)-c, "}}");
+
+    if (!buffer) {
+        long cpus = sysconf (_SC_NPROCESSORS_CONF);
+        if (cpus < 1) cpus = 1;
+        size = 65536 + 2048 * cpus;
+        if (size > HOUSE_DETAILS_MAX) size = HOUSE_DETAILS_MAX;
+        buffer = malloc (size);
+    }
+
+    for (;;) {
+        // The last bytes are kept for the marker and the closing braces.
+        int limit = size - HOUSE_DETAILS_RESERVE;
+        int truncated = 0;
+        int c = snprintf (buffer, limit,
+                          "{\"host\":\"%s\",\"timestamp\":%lld,"
+                             "\"Metrics\":{\"start\":%lld,\"period\":%d",
+                          HostName, (long long)now,
+                          (long long)samplestart, sampleperiod);
+
+        int i;
+        for (i = 0; HouseDetailsParts[i]; ++i) {
+            buffer[limit-2] = 0; // Overwritten if the part did not fit.
+            c += HouseDetailsParts[i] (buffer+c, limit-c, now, since);
+            if ((c >= limit - 2) || buffer[limit-2]) {
+                truncated = 1;
+                break;
+            }
+        }
+        if (truncated && (size < HOUSE_DETAILS_MAX)) {
+            size *= 2;
+            if (size > HOUSE_DETAILS_MAX) size = HOUSE_DETAILS_MAX;
+            buffer = realloc (buffer, size);
+            continue;
+        }
+        if (truncated) {
+            houselog_trace (HOUSE_FAILURE, "details",
+                            "report truncated at %d bytes", c);
+            buffer[c] = 0; // Remove what the failed part left.
+            c += snprintf (buffer+c, size-c, ",\"truncated\":true");
+        }
+        snprintf (buffer+c, size-c, "}}");
+        break;
+    }
+    echttp_content_type_json ();
+    return buffer;
+}
+
+// Return the raw cumulative counters, with the exact time (CLOCK_MONOTONIC,
+// in nanoseconds) of each sample, so that a client can calculate exact
+// rates over any window. The current clock is given as a reference.
+//
+static const char *houselinux_raw (const char *method, const char *uri,
+                                   const char *data, int length) {
+    static char buffer[65537];
+    time_t now = houselinux_now ();
+    struct timespec clock;
+    clock_gettime (CLOCK_MONOTONIC, &clock);
+
+    int cursor = snprintf (buffer, sizeof(buffer),
+                           "{\"host\":\"%s\",\"timestamp\":%lld,"
+                               "\"raw\":{\"clock\":%lld",
+                           HostName, (long long)now,
+                           clock.tv_sec * 1000000000LL + clock.tv_nsec);
+    cursor += houselinux_cpu_raw (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_diskio_raw (buffer+cursor, sizeof(buffer)-cursor);
+    cursor += houselinux_netio_raw (buffer+cursor, sizeof(buffer)-cursor);
+    snprintf (buffer+cursor, sizeof(buffer)-cursor, "}}");
+    echttp_content_type_json ();
+    return buffer;
+}
+
+static const char *houselinux_anomalies (const char *method, const char *uri,
+                                        const char *data, int length) {
+    static char buffer[65537];
+    time_t now = houselinux_now ();
+
+    int cursor = snprintf (buffer, sizeof(buffer),
+                           "{\"host\":\"%s\",\"timestamp\":%lld,",
+                           HostName, (long long)now);
+    cursor += houselinux_anomaly_report (buffer+cursor, sizeof(buffer)-cursor);
+    snprintf (buffer+cursor, sizeof(buffer)-cursor, "}");
+    echttp_content_type_json ();
+    return buffer;
+}
+
+static const char *houselinux_alerts (const char *method, const char *uri,
+                                     const char *data, int length) {
+    static char buffer[65537];
+    time_t now = houselinux_now ();
+
+    int cursor = snprintf (buffer, sizeof(buffer),
+                           "{\"host\":\"%s\",\"timestamp\":%lld,",
+                           HostName, (long long)now);
+    cursor += houselinux_alert_report (buffer+cursor, sizeof(buffer)-cursor);
+    snprintf (buffer+cursor, sizeof(buffer)-cursor, "}");
+    echttp_content_type_json ();
+    return buffer;
+}
+
+// Return the recent history of all series as a table. The table is
+// written to a memory file and transferred from there, as its size
+// depends on the number of series.
+//
+static const char *houselinux_export (const char *method, const char *uri,
+                                      const char *data, int length) {
+
+    const char *format = echttp_parameter_get ("format");
+    if (format && strcmp (format, "csv")) {
+        echttp_error (400, "Unsupported format");
+        return "";
+    }
+    // The same collectors, in the same order, as /metrics/details.
+    // The plugins are not listed: their history is not kept here.
+    houselinux_export_start ();
+    houselinux_cpu_export ();
+    houselinux_memory_export ();
+    houselinux_storage_export ();
+    houselinux_diskio_export ();
+    houselinux_netio_export ();
+    houselinux_temp_export ();
+    houselinux_exec_export ();
+    houselinux_process_export ();
+    houselinux_perf_export ();
+    houselinux_cpuidle_export ();
+    houselinux_irq_export ();
+    houselinux_vm_export ();
+    houselinux_biolat_export ();
+    houselinux_canary_export ();
+    houselinux_power_export ();
+    houselinux_probe_export ();
+
+    int size = 0;
+    int fd = houselinux_export_csv (time(0), &size);
+    if (fd < 0) {
+        echttp_error (503, "Export failed");
+        return "";
+    }
+    echttp_content_type_set ("text/csv");
+    echttp_transfer (fd, size);
+    return "";
+}
+
+// Write the content of the flight recorder to a capture file. This is
+// limited to one capture per recording window, requested or not, since
+// each capture file may be large.
+//
+static const char *houselinux_capture (const char *method, const char *uri,
+                                       const char *data, int length) {
+    static char buffer[4096];
+    time_t now = time(0);
+
+    if (strcmp (method, "POST")) {
+        echttp_error (405, "Method Not Allowed");
+        return "";
+    }
+    if (!houselinux_recorder_enabled ()) {
+        echttp_error (503, "Recorder not enabled");
+        return "";
+    }
+    if (!houselinux_recorder_ready (now)) {
+        echttp_error (429, "Too Many Requests");
+        return "";
+    }
+    if (!houselinux_recorder_trigger ("request", now)) {
+        echttp_error (503, "Capture failed");
+        return "";
+    }
+    int cursor = snprintf (buffer, sizeof(buffer),
+                           "{\"host\":\"%s\",\"timestamp\":%lld,",
+                           HostName, (long long)now);
+    cursor += houselinux_recorder_report (buffer+cursor, sizeof(buffer)-cursor);
+    snprintf (buffer+cursor, sizeof(buffer)-cursor, "}");
     echttp_content_type_json ();
     return buffer;
 }
@@ -218,7 +461,7 @@ static const char *houselinux_info (const char *method, const char *uri,
     static char buffer[65537];
     int cursor;
     char *sep = "";
-    time_t now = time(0);
+    time_t now = houselinux_now ();
 
     cursor = snprintf (buffer, sizeof(buffer),
                        "{\"host\":\"%s\","
@@ -267,6 +510,89 @@ static const char *houselinux_info (const char *method, const char *uri,
     return buffer;
 }
 
+// Return several reports in one response, so that a client gets
+// a consistent snapshot in a single round trip. Each report is the
+// response of the endpoint with the same name, all generated for the same
+// time: the status report is generated again instead of being taken from
+// its cache. A report with no content is listed as null.
+//
+static const char *houselinux_bundle (const char *method, const char *uri,
+                                      const char *data, int length) {
+
+    static const struct {
+        const char *name;
+        echttp_callback *report;
+    } HouseBundleParts[] = {
+        {"summary",   houselinux_summary},
+        {"status",    houselinux_status},
+        {"info",      houselinux_info},
+        {"details",   houselinux_details},
+        {"raw",       houselinux_raw},
+        {"anomalies", houselinux_anomalies},
+        {"alerts",    houselinux_alerts},
+        {0, 0}
+    };
+    static char buffer[7 * 65537];
+    time_t now = time(0);
+
+    const char *parts = echttp_parameter_get ("parts");
+    if (!parts) parts = "info,status";
+
+    // Check the whole list first: unknown or duplicate names are rejected.
+    int selected[sizeof(HouseBundleParts) / sizeof(HouseBundleParts[0])];
+    int count = 0;
+    while (*parts) {
+        const char *end = strchr (parts, ',');
+        int namelength = end ? end - parts : strlen (parts);
+        int i;
+        for (i = 0; HouseBundleParts[i].name; ++i) {
+            const char *name = HouseBundleParts[i].name;
+            if (!strncmp (name, parts, namelength) && !name[namelength]) break;
+        }
+        if (!HouseBundleParts[i].name) {
+            echttp_error (400, "Unknown report");
+            return "";
+        }
+        int j;
+        for (j = 0; j < count; ++j) {
+            if (selected[j] == i) {
+                echttp_error (400, "Duplicate report");
+                return "";
+            }
+        }
+        selected[count++] = i;
+        if (!end) break;
+        parts = end + 1;
+    }
+
+    int cursor = snprintf (buffer, sizeof(buffer),
+                           "{\"host\":\"%s\",\"timestamp\":%lld",
+                           HostName, (long long)now);
+
+    HouseBundleTime = now;
+    int i;
+    for (i = 0; i < count; ++i) {
+        const char *name = HouseBundleParts[selected[i]].name;
+        const char *report =
+            HouseBundleParts[selected[i]].report (method, uri, 0, 0);
+        if ((!report) || (!report[0])) report = "null";
+        cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor,
+                            ",\"%s\":%s", name, report);
+        if (cursor >= sizeof(buffer)) break;
+    }
+    HouseBundleTime = 0;
+
+    // Keep room for the closing brace.
+    if (cursor >= sizeof(buffer) - 1) {
+        houselog_trace (HOUSE_FAILURE, "BUNDLE", "overflow");
+        echttp_error (500, "Response too large");
+        return "";
+    }
+    snprintf (buffer+cursor, sizeof(buffer)-cursor, "}");
+    echttp_content_type_json ();
+    return buffer;
+}
+
 static void houselinux_background (int fd, int mode) {
 
     time_t now = time(0);
@@ -292,17 +618,66 @@ static void houselinux_background (int fd, int mode) {
         }
     }
 
-    houselinux_cpu_background(now);
-    houselinux_memory_background(now);
-    houselinux_storage_background(now);
-    houselinux_diskio_background(now);
-    houselinux_netio_background(now);
-    houselinux_temp_background(now);
+    // When running on battery, the collectors may run less often.
+    houselinux_power_background(now);
+    if (!houselinux_power_throttle (now)) {
+        houselinux_cpu_background(now);
+        houselinux_wakeup_background(now);
+        houselinux_memory_background(now);
+        houselinux_storage_background(now);
+        houselinux_diskio_background(now);
+        houselinux_netio_background(now);
+        houselinux_temp_background(now);
+        houselinux_process_background(now);
+        houselinux_perf_background(now);
+        houselinux_cpuidle_background(now);
+        houselinux_irq_background(now);
+        houselinux_vm_background(now);
+        houselinux_biolat_background(now);
+        houselinux_canary_background(now);
+    }
+    houselinux_probe_background(now);
+    houselinux_exec_background(now);
+    houselinux_plugin_background(now);
+    houselinux_sensor_background(now);
 
     housediscover (now);
     houselog_background (now);
 }
 
+// Run the collectors that use the source module on the content of
+// a capture file, as fast as possible, and print a status report for
+// every 5 minutes of capture.
+//
+static void houselinux_replay (void) {
+
+    time_t now;
+    time_t nextreport = 0;
+    time_t last = 0;
+
+    while ((now = houselinux_recorder_replay_next ())) {
+        houselinux_cpu_background(now);
+        houselinux_memory_background(now);
+        houselinux_diskio_background(now);
+        houselinux_netio_background(now);
+        houselinux_temp_background(now);
+        houselinux_cpuidle_background(now);
+        houselinux_irq_background(now);
+        houselinux_power_background(now);
+
+        if (nextreport == 0) nextreport = now - (now % 300) + 300;
+        if (now >= nextreport) {
+            printf ("{\"replay\":%lld,\"status\":%s}\n",
+                    (long long)now, houselinux_status (0, 0, 0, 0));
+            nextreport += 300;
+        }
+        last = now;
+    }
+    if (last)
+        printf ("{\"replay\":%lld,\"status\":%s}\n",
+                (long long)last, houselinux_status (0, 0, 0, 0));
+}
+
 static void houselinux_protect (const char *method, const char *uri) {
     echttp_cors_protect(method, uri);
 }
@@ -342,17 +717,45 @@ int main (int argc, const char **argv) {
     echttp_cors_allow_method("GET");
     echttp_protect (0, houselinux_protect);
 
+    houselinux_recorder_initialize (argc, argv);
+    houselinux_source_initialize (argc, argv);
+    houselinux_anomaly_initialize (argc, argv);
+    houselinux_alert_initialize (argc, argv);
+    houselinux_sensor_initialize (argc, argv);
     houselinux_cpu_initialize (argc, argv);
+    houselinux_wakeup_initialize (argc, argv);
     houselinux_memory_initialize (argc, argv);
     houselinux_storage_initialize (argc, argv);
     houselinux_diskio_initialize (argc, argv);
     houselinux_netio_initialize (argc, argv);
     houselinux_temp_initialize (argc, argv);
+    houselinux_exec_initialize (argc, argv);
+    houselinux_process_initialize (argc, argv);
+    houselinux_perf_initialize (argc, argv);
+    houselinux_cpuidle_initialize (argc, argv);
+    houselinux_irq_initialize (argc, argv);
+    houselinux_vm_initialize (argc, argv);
+    houselinux_biolat_initialize (argc, argv);
+    houselinux_canary_initialize (argc, argv);
+    houselinux_power_initialize (argc, argv);
+    houselinux_probe_initialize (argc, argv);
+    houselinux_plugin_initialize (argc, argv);
 
     echttp_route_uri ("/metrics/summary", houselinux_summary);
     echttp_route_uri ("/metrics/status", houselinux_status);
     echttp_route_uri ("/metrics/info", houselinux_info);
     echttp_route_uri ("/metrics/details", houselinux_details);
+    echttp_route_uri ("/metrics/raw", houselinux_raw);
+    echttp_route_uri ("/metrics/anomalies", houselinux_anomalies);
+    echttp_route_uri ("/metrics/alerts", houselinux_alerts);
+    echttp_route_uri ("/metrics/export", houselinux_export);
+    echttp_route_uri ("/metrics/capture", houselinux_capture);
+    echttp_route_uri ("/metrics/bundle", houselinux_bundle);
+
+    if (houselinux_recorder_replaying ()) {
+        houselinux_replay ();
+        return 0;
+    }
 
     echttp_background (&houselinux_background);
 
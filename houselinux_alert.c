@@ -0,0 +1,415 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_alert.c - Evaluate alert rules on the metrics series.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_alert_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Each -metrics-alert=RULE option declares
+ *    one rule (see below).
+ *
+ * void houselinux_alert_sample (int series, long long value, time_t now);
+ *
+ *    Evaluate the rules that apply to this series, using the new sample.
+ *    This is called from houselinux_sample().
+ *
+ * int houselinux_alert_report (char *buffer, int size);
+ *
+ *    Populate the list of rules and active alerts in JSON.
+ *
+ * A rule is formatted as "SERIES [pN] OP VALUE[UNIT] [for DURATION]",
+ * for example "storage.free < 5% for 2m", "temp.cpu > 80000 mC" or
+ * "disk.wrwait p90 > 100 ms".
+ *
+ * The series is either the full name of a series, a shell wildcard
+ * pattern, or a short name made of the section and metric names only.
+ * A short name matches all the series with the same first and last
+ * components, e.g. "disk.wrwait" matches "disk.sda.wrwait" and
+ * "disk.sdb.wrwait". Each matching series is evaluated separately.
+ *
+ * The operator is one of <, <=, > or >=. If a unit is specified, the rule
+ * only applies to series with the same unit. The pN option compares the
+ * Nth percentile of the last 60 samples instead of the latest value.
+ * The optional duration (suffix s, m or h) is how long the condition must
+ * hold before the alert is raised.
+ *
+ * An alert is cleared only when the value is back past the threshold by
+ * a margin of 5% (hysteresis). The events for a rule and series are rate
+ * limited to one every 10 minutes: the events suppressed are counted and
+ * reported with the next event. This limit is separate for each series
+ * matched by the same rule, and it never suppresses the CLEARED event
+ * of an alert whose RAISED event was recorded. Raising an alert also
+ * triggers a capture of the flight recorder, if enabled.
+ *
+ * The rules that apply to a series are resolved once, when the series is
+ * first seen. Each sample is then evaluated in constant time, except for
+ * percentile rules.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <time.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_sample.h"
+#include "houselinux_recorder.h"
+#include "houselinux_alert.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_ALERT_RULES      32
+#define HOUSE_ALERT_SERIES    512 // Same as the number of sample series.
+#define HOUSE_ALERT_PER_SERIES  4 // Rules that may apply to the same series.
+#define HOUSE_ALERT_WINDOW     60 // Samples for percentile rules.
+#define HOUSE_ALERT_HYSTERESIS  5 // Percent of the threshold.
+#define HOUSE_ALERT_EVENTS    600 // Minimum interval between events.
+
+struct HouseAlertRule {
+    const char *text;
+    char *pattern;
+    char *section; // For short names: the first and last components.
+    char *metric;
+    char unit[16];
+    int percentile; // 0 if the latest value is used.
+    int above;      // Raise when above (> or >=), otherwise below.
+    int inclusive;  // >= or <=.
+    long long threshold;
+    long long margin;
+    int duration;
+};
+
+static struct HouseAlertRule HouseAlertRules[HOUSE_ALERT_RULES];
+static int HouseAlertRulesCount = 0;
+
+struct HouseAlertState {
+    int rule;
+    time_t pending; // When the condition started to be true.
+    time_t active;  // When the alert was raised, 0 if not active.
+    long long value;
+    time_t lastevent;
+    int suppressed;
+    int logged;     // The RAISED event of the active alert was recorded.
+    long long *window; // Only for percentile rules.
+    int windowcount;
+    int windowcursor;
+};
+
+struct HouseAlertSeries {
+    int resolved;
+    int count;
+    struct HouseAlertState states[HOUSE_ALERT_PER_SERIES];
+};
+
+static struct HouseAlertSeries *HouseAlertSeries = 0;
+
+
+static int houselinux_alert_duration (const char *text) {
+    char *end;
+    long value = strtol (text, &end, 10);
+    switch (*end) {
+        case 'h': value *= 3600; break;
+        case 'm': value *= 60; break;
+    }
+    return (int)value;
+}
+
+static int houselinux_alert_parse (struct HouseAlertRule *rule,
+                                   const char *text) {
+
+    // The rule's text is copied as is to JSON: reject anything suspicious.
+    if (strpbrk (text, "\"\\")) return 0;
+
+    char buffer[256];
+    snprintf (buffer, sizeof(buffer), "%s", text);
+
+    char *tokens[8];
+    int count = 0;
+    char *token = strtok (buffer, " \t");
+    while (token && (count < 8)) {
+        tokens[count++] = token;
+        token = strtok (0, " \t");
+    }
+    if (count < 3) return 0;
+
+    memset (rule, 0, sizeof(*rule));
+    rule->text = text;
+
+    int i = 0;
+    rule->pattern = strdup (tokens[i++]);
+    if (!strpbrk (rule->pattern, "*?[")) {
+        const char *first = strchr (rule->pattern, '.');
+        const char *last = strrchr (rule->pattern, '.');
+        if (first && (first == last)) {
+            rule->section = strndup (rule->pattern, first - rule->pattern);
+            rule->metric = strdup (last + 1);
+        }
+    }
+
+    if ((tokens[i][0] == 'p') && isdigit (tokens[i][1])) {
+        rule->percentile = atoi (tokens[i++] + 1);
+        if ((rule->percentile <= 0) || (rule->percentile > 100)) return 0;
+    }
+    if (i >= count) return 0;
+
+    const char *op = tokens[i++];
+    if (op[0] == '>') rule->above = 1;
+    else if (op[0] != '<') return 0;
+    if (op[1] == '=') rule->inclusive = 1;
+    else if (op[1]) return 0;
+    if (i >= count) return 0;
+
+    char *unit;
+    rule->threshold = strtoll (tokens[i++], &unit, 10);
+    if (!*unit && (i < count) && strcmp (tokens[i], "for")) unit = tokens[i++];
+    if (strlen(unit) >= sizeof(rule->unit)) return 0;
+    strcpy (rule->unit, unit);
+
+    if (i < count) {
+        if (strcmp (tokens[i++], "for") || (i >= count)) return 0;
+        rule->duration = houselinux_alert_duration (tokens[i++]);
+    }
+    if (i < count) return 0; // Unexpected extra.
+
+    rule->margin = (llabs (rule->threshold) * HOUSE_ALERT_HYSTERESIS) / 100;
+    if (rule->margin < 1) rule->margin = 1;
+    return 1;
+}
+
+void houselinux_alert_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        const char *text = 0;
+        if (!echttp_option_match ("-metrics-alert=", argv[i], &text)) continue;
+
+        if (HouseAlertRulesCount >= HOUSE_ALERT_RULES) {
+            houselog_trace (HOUSE_FAILURE, text, "too many alert rules");
+            continue;
+        }
+        if (!houselinux_alert_parse (HouseAlertRules + HouseAlertRulesCount,
+                                     text)) {
+            houselog_trace (HOUSE_FAILURE, text, "invalid alert rule");
+            continue;
+        }
+        HouseAlertRulesCount += 1;
+    }
+    if (HouseAlertRulesCount > 0)
+        HouseAlertSeries = calloc (HOUSE_ALERT_SERIES, sizeof(*HouseAlertSeries));
+}
+
+static int houselinux_alert_match (const struct HouseAlertRule *rule,
+                                   const char *name, const char *unit) {
+
+    if (rule->unit[0] && strcmp (rule->unit, unit)) return 0;
+
+    if (rule->section) {
+        int length = strlen (rule->section);
+        if (strncmp (name, rule->section, length) || (name[length] != '.'))
+            return 0;
+        const char *last = strrchr (name, '.');
+        return !strcmp (last + 1, rule->metric);
+    }
+    return !fnmatch (rule->pattern, name, 0);
+}
+
+// Find which rules apply to this series. This is done once per series.
+//
+static void houselinux_alert_resolve (int series,
+                                      struct HouseAlertSeries *s) {
+
+    const char *name = houselinux_sample_name (series);
+    const char *unit = houselinux_sample_unit (series);
+
+    s->resolved = 1;
+    int i;
+    for (i = 0; i < HouseAlertRulesCount; ++i) {
+        struct HouseAlertRule *rule = HouseAlertRules + i;
+        if (!houselinux_alert_match (rule, name, unit)) continue;
+        if (s->count >= HOUSE_ALERT_PER_SERIES) {
+            houselog_trace (HOUSE_WARNING, name, "too many alert rules");
+            break;
+        }
+        struct HouseAlertState *state = s->states + s->count++;
+        memset (state, 0, sizeof(*state));
+        state->rule = i;
+        if (rule->percentile)
+            state->window = calloc (HOUSE_ALERT_WINDOW, sizeof(long long));
+        DEBUG ("Alert rule \"%s\" applies to %s\n", rule->text, name);
+    }
+}
+
+static int houselinux_alert_compare (const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static long long houselinux_alert_percentile (struct HouseAlertState *state,
+                                              int percentile, long long value) {
+
+    state->window[state->windowcursor] = value;
+    state->windowcursor = (state->windowcursor + 1) % HOUSE_ALERT_WINDOW;
+    if (state->windowcount < HOUSE_ALERT_WINDOW) state->windowcount += 1;
+
+    long long sorted[HOUSE_ALERT_WINDOW];
+    memcpy (sorted, state->window, state->windowcount * sizeof(long long));
+    qsort (sorted, state->windowcount, sizeof(long long),
+           houselinux_alert_compare);
+
+    int index = ((state->windowcount * percentile) + 99) / 100 - 1;
+    if (index < 0) index = 0;
+    return sorted[index];
+}
+
+static int houselinux_alert_triggered (const struct HouseAlertRule *rule,
+                                       long long value) {
+    if (rule->above) {
+        return rule->inclusive ? (value >= rule->threshold)
+                               : (value > rule->threshold);
+    }
+    return rule->inclusive ? (value <= rule->threshold)
+                           : (value < rule->threshold);
+}
+
+static int houselinux_alert_cleared (const struct HouseAlertRule *rule,
+                                     long long value) {
+    if (rule->above) return value < rule->threshold - rule->margin;
+    return value > rule->threshold + rule->margin;
+}
+
+// Record an event, unless rate limited. The limit does not apply if
+// forced, i.e. when the event closes one that was recorded.
+// Return 1 if the event was recorded.
+//
+static int houselinux_alert_event (struct HouseAlertState *state,
+                                   int series, const char *action,
+                                   long long value, time_t now, int forced) {
+
+    const struct HouseAlertRule *rule = HouseAlertRules + state->rule;
+
+    if ((!forced) && (now < state->lastevent + HOUSE_ALERT_EVENTS)) {
+        state->suppressed += 1;
+        return 0;
+    }
+    if (state->suppressed) {
+        houselog_event ("ALERT", houselinux_sample_name (series), action,
+                        "%s (VALUE %lld %s, %d EVENTS SUPPRESSED)",
+                        rule->text, value, houselinux_sample_unit (series),
+                        state->suppressed);
+    } else {
+        houselog_event ("ALERT", houselinux_sample_name (series), action,
+                        "%s (VALUE %lld %s)",
+                        rule->text, value, houselinux_sample_unit (series));
+    }
+    state->lastevent = now;
+    state->suppressed = 0;
+    return 1;
+}
+
+void houselinux_alert_sample (int series, long long value, time_t now) {
+
+    if (!HouseAlertSeries) return; // No rules.
+    if ((series < 0) || (series >= HOUSE_ALERT_SERIES)) return;
+
+    struct HouseAlertSeries *s = HouseAlertSeries + series;
+    if (!s->resolved) houselinux_alert_resolve (series, s);
+
+    int i;
+    for (i = 0; i < s->count; ++i) {
+        struct HouseAlertState *state = s->states + i;
+        struct HouseAlertRule *rule = HouseAlertRules + state->rule;
+
+        long long v = value;
+        if (rule->percentile) {
+            v = houselinux_alert_percentile (state, rule->percentile, value);
+            if (state->windowcount < HOUSE_ALERT_WINDOW / 6) continue;
+        }
+        state->value = v;
+
+        if (state->active) {
+            if (houselinux_alert_cleared (rule, v)) {
+                state->active = state->pending = 0;
+                houselinux_alert_event (state, series, "CLEARED", v, now,
+                                        state->logged);
+                state->logged = 0;
+            }
+        } else if (houselinux_alert_triggered (rule, v)) {
+            if (!state->pending) state->pending = now;
+            if (now - state->pending >= rule->duration) {
+                state->active = now;
+                state->logged =
+                    houselinux_alert_event (state, series, "RAISED", v, now, 0);
+                houselinux_recorder_trigger ("alert", now);
+            }
+        } else {
+            state->pending = 0;
+        }
+    }
+}
+
+int houselinux_alert_report (char *buffer, int size) {
+
+    int cursor = snprintf (buffer, size, "\"alerts\":{\"rules\":[");
+    if (cursor >= size) return 0;
+
+    const char *sep = "";
+    int i;
+    for (i = 0; i < HouseAlertRulesCount; ++i) {
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s\"%s\"", sep, HouseAlertRules[i].text);
+        if (cursor >= size) return 0;
+        sep = ",";
+    }
+
+    cursor += snprintf (buffer+cursor, size-cursor, "],\"active\":[");
+    if (cursor >= size) return 0;
+
+    sep = "";
+    if (HouseAlertSeries) {
+        for (i = 0; i < HOUSE_ALERT_SERIES; ++i) {
+            struct HouseAlertSeries *s = HouseAlertSeries + i;
+            int j;
+            for (j = 0; j < s->count; ++j) {
+                struct HouseAlertState *state = s->states + j;
+                if (!state->active) continue;
+                cursor += snprintf (buffer+cursor, size-cursor,
+                                    "%s{\"rule\":\"%s\",\"series\":\"%s\","
+                                        "\"start\":%lld,\"value\":%lld,"
+                                        "\"unit\":\"%s\"}",
+                                    sep, HouseAlertRules[state->rule].text,
+                                    houselinux_sample_name (i),
+                                    (long long)(state->active), state->value,
+                                    houselinux_sample_unit (i));
+                if (cursor >= size) return 0;
+                sep = ",";
+            }
+        }
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "]}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
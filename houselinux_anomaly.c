@@ -0,0 +1,296 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_anomaly.c - Detect anomalies in the metrics series.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_anomaly_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. The detection is only enabled if the
+ *    -metrics-anomaly option is present.
+ *
+ * void houselinux_anomaly_sample (int series, long long value, time_t now);
+ *
+ *    Process one new sample from the specified series. This is called
+ *    from houselinux_sample().
+ *
+ * int houselinux_anomaly_report (char *buffer, int size);
+ *
+ *    Populate the list of active and recent anomalies in JSON.
+ *
+ * Each series has a baseline made of an exponentially weighted moving
+ * average (EWMA) of its values and of its variance, updated on each sample
+ * in constant time and memory. A sample deviates when it is more than K
+ * standard deviations away from the mean (K is set using the
+ * -metrics-anomaly-sigma=K option, default 4). An anomaly is raised when
+ * a series keeps deviating for a sustained interval (set using the
+ * -metrics-anomaly-sustain=SECONDS option, default 60), and is cleared
+ * once the series is back within K/2 standard deviations. The baseline
+ * is frozen while a series deviates, for up to one hour.
+ *
+ * The -metrics-anomaly-seasonal option adds a time-of-day baseline:
+ * one slower EWMA for each hour of the day. Once an hour's baseline has
+ * enough history, it is used instead of the global one, so that
+ * a recurring daily activity (backups, etc.) is not reported.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_sample.h"
+#include "houselinux_anomaly.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_ANOMALY_MAX      512 // Same as the number of sample series.
+#define HOUSE_ANOMALY_RECENT    16 // Ended anomalies kept for the report.
+#define HOUSE_ANOMALY_WARMUP    30 // Samples before the baseline is valid.
+#define HOUSE_ANOMALY_SEASONAL 100 // Samples before an hour's baseline is valid.
+#define HOUSE_ANOMALY_RELEARN 3600 // Accept a persistent anomaly as normal.
+
+#define HOUSE_ANOMALY_ALPHA    0.01
+#define HOUSE_ANOMALY_SEASONAL_ALPHA (HOUSE_ANOMALY_ALPHA / 10)
+
+struct HouseAnomalyBaseline {
+    double mean;
+    double variance;
+    int count;
+};
+
+struct HouseAnomalySeries {
+    struct HouseAnomalyBaseline global;
+    time_t deviating; // When the series started to deviate, 0 if normal.
+    time_t active;    // When the anomaly was raised, 0 if none.
+    long long value;  // The latest value.
+    long long peak;   // The value furthest from the mean during the anomaly.
+    double expected;  // The mean when the anomaly was raised.
+    double sigma;     // The standard deviation when the anomaly was raised.
+};
+
+struct HouseAnomalySeasons {
+    struct HouseAnomalyBaseline hours[24];
+};
+
+struct HouseAnomalyRecent {
+    int series;
+    time_t start;
+    time_t end;
+    long long peak;
+    double expected;
+};
+
+static struct HouseAnomalySeries *HouseAnomalySeries = 0;
+static struct HouseAnomalySeasons *HouseAnomalySeasons = 0;
+
+static struct HouseAnomalyRecent HouseAnomalyRecent[HOUSE_ANOMALY_RECENT];
+static int HouseAnomalyRecentCursor = 0;
+
+static double HouseAnomalySigma = 4.0;
+static int HouseAnomalySustain = 60;
+
+
+void houselinux_anomaly_initialize (int argc, const char **argv) {
+
+    int i;
+    int enabled = 0;
+    int seasonal = 0;
+    for (i = 1; i < argc; ++i) {
+        const char *value;
+        if (echttp_option_present ("-metrics-anomaly", argv[i])) {
+            enabled = 1;
+        } else if (echttp_option_present ("-metrics-anomaly-seasonal", argv[i])) {
+            seasonal = 1;
+        } else if (echttp_option_match ("-metrics-anomaly-sigma=", argv[i], &value)) {
+            HouseAnomalySigma = atof (value);
+            if (HouseAnomalySigma < 1.0) HouseAnomalySigma = 1.0;
+        } else if (echttp_option_match ("-metrics-anomaly-sustain=", argv[i], &value)) {
+            HouseAnomalySustain = atoi (value);
+            if (HouseAnomalySustain < 0) HouseAnomalySustain = 0;
+        }
+    }
+    if (!enabled) return;
+
+    HouseAnomalySeries = calloc (HOUSE_ANOMALY_MAX, sizeof(*HouseAnomalySeries));
+    if (seasonal)
+        HouseAnomalySeasons =
+            calloc (HOUSE_ANOMALY_MAX, sizeof(*HouseAnomalySeasons));
+}
+
+static void houselinux_anomaly_update (struct HouseAnomalyBaseline *baseline,
+                                       double value, double alpha) {
+
+    if (baseline->count++ == 0) {
+        baseline->mean = value;
+        baseline->variance = 0;
+        return;
+    }
+    // Incremental EWMA of the mean and variance (West, 1979).
+    double delta = value - baseline->mean;
+    double increment = alpha * delta;
+    baseline->mean += increment;
+    baseline->variance = (1 - alpha) * (baseline->variance + delta * increment);
+}
+
+// The standard deviation is given a floor, so that a series that was
+// constant until now does not trigger an anomaly on the smallest change.
+//
+static double houselinux_anomaly_sigma (const struct HouseAnomalyBaseline *b) {
+    double sigma = sqrt (b->variance);
+    double floor = fabs (b->mean) / 100;
+    if (floor < 1.0) floor = 1.0; // The values are integers.
+    return (sigma < floor) ? floor : sigma;
+}
+
+static void houselinux_anomaly_end (int series, struct HouseAnomalySeries *s,
+                                    time_t now) {
+
+    const char *name = houselinux_sample_name (series);
+    houselog_event ("ANOMALY", name, "CLEARED",
+                    "VALUE %lld %s", s->value, houselinux_sample_unit (series));
+
+    struct HouseAnomalyRecent *recent =
+        HouseAnomalyRecent + HouseAnomalyRecentCursor;
+    recent->series = series;
+    recent->start = s->active;
+    recent->end = now;
+    recent->peak = s->peak;
+    recent->expected = s->expected;
+    HouseAnomalyRecentCursor = (HouseAnomalyRecentCursor + 1) % HOUSE_ANOMALY_RECENT;
+
+    s->active = 0;
+}
+
+void houselinux_anomaly_sample (int series, long long value, time_t now) {
+
+    if (!HouseAnomalySeries) return; // Not enabled.
+    if ((series < 0) || (series >= HOUSE_ANOMALY_MAX)) return;
+
+    struct HouseAnomalySeries *s = HouseAnomalySeries + series;
+    s->value = value;
+
+    // Select the baseline: the time of day one, if it has enough history.
+    struct HouseAnomalyBaseline *seasonal = 0;
+    struct HouseAnomalyBaseline *baseline = &(s->global);
+    if (HouseAnomalySeasons) {
+        struct tm local;
+        localtime_r (&now, &local);
+        seasonal = HouseAnomalySeasons[series].hours + local.tm_hour;
+        if (seasonal->count >= HOUSE_ANOMALY_SEASONAL) baseline = seasonal;
+    }
+
+    if (s->global.count >= HOUSE_ANOMALY_WARMUP) {
+        double sigma = houselinux_anomaly_sigma (baseline);
+        double deviation = fabs (value - baseline->mean) / sigma;
+
+        if (s->active) {
+            if (fabs (value - s->expected) > fabs (s->peak - s->expected))
+                s->peak = value;
+            if (deviation < HouseAnomalySigma / 2) {
+                houselinux_anomaly_end (series, s, now);
+                s->deviating = 0;
+            }
+        } else if (deviation > HouseAnomalySigma) {
+            if (!s->deviating) s->deviating = now;
+            if (now - s->deviating >= HouseAnomalySustain) {
+                s->active = s->deviating;
+                s->peak = value;
+                s->expected = baseline->mean;
+                s->sigma = sigma;
+                houselog_event ("ANOMALY", houselinux_sample_name (series),
+                                "DETECTED", "VALUE %lld %s, EXPECTED %.0f +/- %.0f",
+                                value, houselinux_sample_unit (series),
+                                baseline->mean, sigma);
+            }
+        } else {
+            s->deviating = 0;
+        }
+    }
+
+    // The baseline does not learn from deviating values, otherwise
+    // the variance would quickly absorb the anomaly. However a permanent
+    // change of level must eventually become the new normal.
+    //
+    if (s->deviating && (now - s->deviating < HOUSE_ANOMALY_RELEARN)) return;
+
+    houselinux_anomaly_update (&(s->global), value, HOUSE_ANOMALY_ALPHA);
+    if (seasonal)
+        houselinux_anomaly_update (seasonal, value, HOUSE_ANOMALY_SEASONAL_ALPHA);
+}
+
+int houselinux_anomaly_report (char *buffer, int size) {
+
+    int cursor = snprintf (buffer, size,
+                           "\"anomalies\":{\"enabled\":%s,\"sigma\":%.1f,"
+                               "\"sustain\":%d,\"active\":[",
+                           HouseAnomalySeries ? "true" : "false",
+                           HouseAnomalySigma, HouseAnomalySustain);
+    if (cursor >= size) return 0;
+
+    const char *sep = "";
+    int i;
+    if (HouseAnomalySeries) {
+        for (i = 0; i < HOUSE_ANOMALY_MAX; ++i) {
+            struct HouseAnomalySeries *s = HouseAnomalySeries + i;
+            if (!s->active) continue;
+            cursor += snprintf (buffer+cursor, size-cursor,
+                                "%s{\"series\":\"%s\",\"start\":%lld,"
+                                    "\"value\":%lld,\"peak\":%lld,"
+                                    "\"expected\":%.0f,\"sigma\":%.0f,"
+                                    "\"unit\":\"%s\"}",
+                                sep, houselinux_sample_name (i),
+                                (long long)(s->active), s->value, s->peak,
+                                s->expected, s->sigma,
+                                houselinux_sample_unit (i));
+            if (cursor >= size) return 0;
+            sep = ",";
+        }
+    }
+
+    cursor += snprintf (buffer+cursor, size-cursor, "],\"recent\":[");
+    if (cursor >= size) return 0;
+
+    // List the recent anomalies, most recent first.
+    sep = "";
+    for (i = 1; i <= HOUSE_ANOMALY_RECENT; ++i) {
+        int index = (HouseAnomalyRecentCursor + HOUSE_ANOMALY_RECENT - i)
+                        % HOUSE_ANOMALY_RECENT;
+        struct HouseAnomalyRecent *recent = HouseAnomalyRecent + index;
+        if (recent->end == 0) break;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s{\"series\":\"%s\",\"start\":%lld,\"end\":%lld,"
+                                "\"peak\":%lld,\"expected\":%.0f,\"unit\":\"%s\"}",
+                            sep, houselinux_sample_name (recent->series),
+                            (long long)(recent->start), (long long)(recent->end),
+                            recent->peak, recent->expected,
+                            houselinux_sample_unit (recent->series));
+        if (cursor >= size) return 0;
+        sep = ",";
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "]}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
@@ -0,0 +1,132 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_biolat.bpf.c - Measure the latency of block I/O requests.
+ *
+ * This eBPF program records the time when each request is issued to
+ * the device driver, and adds the latency of each completed request to
+ * a log2 histogram, per disk and operation. The user space collector
+ * reads the histograms periodically.
+ *
+ * This uses BTF tracepoints and CO-RE, so that the same object runs on
+ * all kernels that provide BTF information (5.5 and later). The kernel
+ * structures are described by vmlinux.h, generated using bpftool.
+ */
+
+#include "vmlinux.h"
+
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+
+#include "houselinux_biolat_bpf.h"
+
+#define HOUSE_BIOLAT_REQ_OP_MASK 0xff // The operation bits of cmd_flags.
+#define HOUSE_BIOLAT_REQ_OP_READ    0
+#define HOUSE_BIOLAT_REQ_OP_WRITE   1
+
+char LICENSE[] SEC("license") = "GPL";
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 16384);
+    __type(key, struct request *);
+    __type(value, __u64);
+} house_biolat_start SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 4096);
+    __type(key, struct house_biolat_key);
+    __type(value, __u64);
+} house_biolat_hist SEC(".maps");
+
+// Before Linux 5.17, the disk was referenced by the request itself.
+struct request___old {
+    struct gendisk *rq_disk;
+} __attribute__((preserve_access_index));
+
+static __always_inline struct gendisk *house_biolat_disk (struct request *rq) {
+    struct request___old *old = (void *)rq;
+    if (bpf_core_field_exists (old->rq_disk))
+        return BPF_CORE_READ (old, rq_disk);
+    return BPF_CORE_READ (rq, q, disk);
+}
+
+static __always_inline __u16 house_biolat_slot (__u64 value) {
+    __u16 slot = 0;
+    while ((value > 1) && (slot < HOUSE_BIOLAT_SLOTS - 1)) {
+        value >>= 1;
+        slot += 1;
+    }
+    return slot;
+}
+
+static __always_inline int house_biolat_issue (struct request *rq) {
+    __u64 now = bpf_ktime_get_ns ();
+    bpf_map_update_elem (&house_biolat_start, &rq, &now, BPF_ANY);
+    return 0;
+}
+
+// The queue argument was removed from block_rq_issue in Linux 5.11.
+// The prototype of the tracepoint is checked, not the kernel version,
+// since some distributions backport such changes to older kernels.
+typedef void (*btf_trace_block_rq_issue___new)(void *, struct request *);
+
+SEC("tp_btf/block_rq_issue")
+int house_biolat_rq_issue (__u64 *ctx) {
+    if (bpf_core_type_matches (btf_trace_block_rq_issue___new))
+        return house_biolat_issue ((struct request *)ctx[0]);
+    return house_biolat_issue ((struct request *)ctx[1]);
+}
+
+SEC("tp_btf/block_rq_complete")
+int BPF_PROG(house_biolat_rq_complete,
+             struct request *rq, int error, unsigned int nr_bytes) {
+
+    __u64 *start = bpf_map_lookup_elem (&house_biolat_start, &rq);
+    if (!start) return 0; // Issued before this program was attached.
+
+    __u64 latency = (bpf_ktime_get_ns () - *start) / 1000; // Microseconds.
+    bpf_map_delete_elem (&house_biolat_start, &rq);
+
+    unsigned int op = BPF_CORE_READ (rq, cmd_flags) & HOUSE_BIOLAT_REQ_OP_MASK;
+    if ((op != HOUSE_BIOLAT_REQ_OP_READ) && (op != HOUSE_BIOLAT_REQ_OP_WRITE))
+        return 0; // Flush, discard, etc.
+
+    struct gendisk *disk = house_biolat_disk (rq);
+    if (!disk) return 0;
+
+    struct house_biolat_key key = {};
+    key.dev = ((__u32)BPF_CORE_READ (disk, major) << 20)
+                  | (__u32)BPF_CORE_READ (disk, first_minor);
+    key.op = (op == HOUSE_BIOLAT_REQ_OP_READ) ? HOUSE_BIOLAT_READ
+                                              : HOUSE_BIOLAT_WRITE;
+    key.slot = house_biolat_slot (latency);
+
+    __u64 *count = bpf_map_lookup_elem (&house_biolat_hist, &key);
+    if (!count) {
+        __u64 zero = 0;
+        bpf_map_update_elem (&house_biolat_hist, &key, &zero, BPF_NOEXIST);
+        count = bpf_map_lookup_elem (&house_biolat_hist, &key);
+        if (!count) return 0;
+    }
+    __sync_fetch_and_add (count, 1);
+    return 0;
+}
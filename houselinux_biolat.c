@@ -0,0 +1,381 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_biolat.c - Collect the distribution of block I/O latencies.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_biolat_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. This collector is only enabled when
+ *    the -metrics-biolat option is present.
+ *
+ * void houselinux_biolat_background (time_t now);
+ *
+ *    The periodic function that manages the collect of metrics.
+ *
+ * int houselinux_biolat_summary (char *buffer, int size);
+ *
+ *    A function that populates a short summary of the latencies in JSON.
+ *
+ * int houselinux_biolat_status (char *buffer, int size);
+ *
+ *    A function that populates a status overview of the latencies in JSON.
+ *
+ * int houselinux_biolat_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    A function that populates a full detail report of the latencies in JSON.
+ *
+ * void houselinux_biolat_export (void);
+ *
+ *    List the recent history of the block I/O latencies for /metrics/export.
+ *
+ * The disk module only reports the average latency, calculated from
+ * /proc/diskstats. This collector uses an eBPF program attached to the
+ * block_rq_issue and block_rq_complete tracepoints to build a log2
+ * histogram of the latency of every request, per disk. The histograms
+ * are read on each sample, and the median and 99th percentile of the
+ * requests completed during the sample period are reported.
+ *
+ * This requires building with BPF=1 (see the Makefile), a kernel with
+ * BTF information, and root privileges or CAP_BPF. If any of this is
+ * missing, this collector disables itself and the average latencies from
+ * the disk module remain available.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_export.h"
+#include "houselinux_biolat.h"
+
+#ifdef HOUSE_BPF
+#include <linux/types.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "houselinux_biolat_bpf.h"
+#include "houselinux_biolat.skel.h"
+#endif
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#ifdef HOUSE_BPF
+
+#define HOUSE_BIOLAT_PERIOD    5 // Sample the histograms every 5 seconds.
+#define HOUSE_BIOLAT_SPAN     60 // MUST KEEP A 5 MINUTES HISTORY.
+#define HOUSE_BIOLAT_DISKS    32
+
+static const char *HouseBiolatOps[] = {"rd", "wr"};
+
+struct HouseBiolatDisk {
+    __u32 dev;
+    char name[32];
+    unsigned long long current[2][HOUSE_BIOLAT_SLOTS];
+    unsigned long long previous[2][HOUSE_BIOLAT_SLOTS];
+    time_t timestamps[HOUSE_BIOLAT_SPAN];
+    long long p50[2][HOUSE_BIOLAT_SPAN];
+    long long p99[2][HOUSE_BIOLAT_SPAN];
+};
+
+static struct HouseBiolatDisk HouseBiolatDisks[HOUSE_BIOLAT_DISKS];
+static int HouseBiolatDisksCount = 0;
+
+static struct houselinux_biolat_bpf *HouseBiolatProgram = 0;
+
+#endif // HOUSE_BPF
+
+
+void houselinux_biolat_initialize (int argc, const char **argv) {
+
+    int i;
+    int enabled = 0;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-metrics-biolat", argv[i])) enabled = 1;
+    }
+    if (!enabled) return;
+
+#ifdef HOUSE_BPF
+    HouseBiolatProgram = houselinux_biolat_bpf__open_and_load ();
+    if (!HouseBiolatProgram) {
+        houselog_trace (HOUSE_WARNING, "biolat",
+                        "cannot load the eBPF program: %s", strerror(errno));
+        return;
+    }
+    if (houselinux_biolat_bpf__attach (HouseBiolatProgram)) {
+        houselog_trace (HOUSE_WARNING, "biolat",
+                        "cannot attach the eBPF program: %s", strerror(errno));
+        houselinux_biolat_bpf__destroy (HouseBiolatProgram);
+        HouseBiolatProgram = 0;
+        return;
+    }
+    DEBUG ("eBPF block I/O latency enabled\n");
+#else
+    houselog_trace (HOUSE_WARNING, "biolat", "built without eBPF support");
+#endif
+}
+
+#ifdef HOUSE_BPF
+
+// Find the disk's name from its device number, as the kernel does not
+// provide it in the request.
+//
+static void houselinux_biolat_name (struct HouseBiolatDisk *disk) {
+
+    char path[128];
+    snprintf (path, sizeof(path), "/sys/dev/block/%u:%u/uevent",
+              disk->dev >> 20, disk->dev & ((1U << 20) - 1));
+    snprintf (disk->name, sizeof(disk->name), "%u:%u",
+              disk->dev >> 20, disk->dev & ((1U << 20) - 1));
+
+    FILE *f = fopen (path, "r");
+    if (!f) return;
+    char line[256];
+    while (fgets (line, sizeof(line), f)) {
+        if (strncmp (line, "DEVNAME=", 8)) continue;
+        char *eol = strchr (line, '\n');
+        if (eol) *eol = 0;
+        snprintf (disk->name, sizeof(disk->name), "%.31s", line + 8);
+        break;
+    }
+    fclose (f);
+}
+
+static struct HouseBiolatDisk *houselinux_biolat_disk (__u32 dev) {
+
+    int i;
+    for (i = 0; i < HouseBiolatDisksCount; ++i) {
+        if (HouseBiolatDisks[i].dev == dev) return HouseBiolatDisks + i;
+    }
+    if (HouseBiolatDisksCount >= HOUSE_BIOLAT_DISKS) return 0;
+
+    struct HouseBiolatDisk *disk = HouseBiolatDisks + HouseBiolatDisksCount++;
+    memset (disk, 0, sizeof(*disk));
+    disk->dev = dev;
+    houselinux_biolat_name (disk);
+    DEBUG ("New eBPF disk %s\n", disk->name);
+    return disk;
+}
+
+// Return the upper bound (in microseconds) of the slot that holds
+// the specified percentile, or 0 if there was no request.
+//
+static long long houselinux_biolat_percentile (const unsigned long long *count,
+                                               int percentile) {
+    unsigned long long total = 0;
+    int slot;
+    for (slot = 0; slot < HOUSE_BIOLAT_SLOTS; ++slot) total += count[slot];
+    if (total == 0) return 0;
+
+    unsigned long long rank = (total * percentile + 99) / 100;
+    unsigned long long cumulated = 0;
+    for (slot = 0; slot < HOUSE_BIOLAT_SLOTS - 1; ++slot) {
+        cumulated += count[slot];
+        if (cumulated >= rank) break;
+    }
+    return 1LL << (slot + 1);
+}
+
+static void houselinux_biolat_sample (time_t now) {
+
+    int i;
+    for (i = 0; i < HouseBiolatDisksCount; ++i)
+        memset (HouseBiolatDisks[i].current, 0,
+                sizeof(HouseBiolatDisks[i].current));
+
+    // The histograms are cumulative: read all the buckets.
+    int fd = bpf_map__fd (HouseBiolatProgram->maps.house_biolat_hist);
+    struct house_biolat_key key;
+    struct house_biolat_key next;
+    void *cursor = 0;
+    while (bpf_map_get_next_key (fd, cursor, &next) == 0) {
+        __u64 count;
+        key = next;
+        cursor = &key;
+        if (bpf_map_lookup_elem (fd, &key, &count)) continue;
+        if ((key.op > HOUSE_BIOLAT_WRITE) || (key.slot >= HOUSE_BIOLAT_SLOTS))
+            continue;
+        struct HouseBiolatDisk *disk = houselinux_biolat_disk (key.dev);
+        if (disk) disk->current[key.op][key.slot] = count;
+    }
+
+    int index = (now / HOUSE_BIOLAT_PERIOD) % HOUSE_BIOLAT_SPAN;
+
+    for (i = 0; i < HouseBiolatDisksCount; ++i) {
+        struct HouseBiolatDisk *disk = HouseBiolatDisks + i;
+        int op;
+        for (op = HOUSE_BIOLAT_READ; op <= HOUSE_BIOLAT_WRITE; ++op) {
+            unsigned long long delta[HOUSE_BIOLAT_SLOTS];
+            int slot;
+            for (slot = 0; slot < HOUSE_BIOLAT_SLOTS; ++slot) {
+                delta[slot] = disk->current[op][slot] - disk->previous[op][slot];
+                if (disk->current[op][slot] < disk->previous[op][slot])
+                    delta[slot] = 0;
+            }
+            disk->p50[op][index] = houselinux_biolat_percentile (delta, 50);
+            disk->p99[op][index] = houselinux_biolat_percentile (delta, 99);
+
+            char name[96];
+            snprintf (name, sizeof(name),
+                      "biolat.%s.%sp99", disk->name, HouseBiolatOps[op]);
+            houselinux_sample (name, disk->p99[op][index], "us", now);
+        }
+        disk->timestamps[index] = now;
+        memcpy (disk->previous, disk->current, sizeof(disk->previous));
+    }
+}
+
+static int houselinux_biolat_report (char *buffer, int size,
+                                     time_t now, time_t since, int full) {
+
+    if (!HouseBiolatProgram) return 0;
+
+    int cursor = snprintf (buffer, size, ",\"biolat\":{");
+    if (cursor >= size) return 0;
+    int start = cursor;
+
+    const char *sep = "";
+    int i;
+    for (i = 0; i < HouseBiolatDisksCount; ++i) {
+        struct HouseBiolatDisk *disk = HouseBiolatDisks + i;
+        int startdev = cursor;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s\"%s\":", sep, disk->name);
+        if (cursor >= size) return 0;
+        int startdisk = cursor;
+
+        int op;
+        for (op = HOUSE_BIOLAT_READ; op <= HOUSE_BIOLAT_WRITE; ++op) {
+            char name[16];
+            if (full) {
+                snprintf (name, sizeof(name), "%sp50", HouseBiolatOps[op]);
+                if (now) {
+                    cursor += houselinux_reduce_details_json
+                                  (buffer+cursor, size-cursor, since,
+                                   name, "us", now,
+                                   HOUSE_BIOLAT_PERIOD, HOUSE_BIOLAT_SPAN,
+                                   disk->timestamps, disk->p50[op]);
+                } else {
+                    cursor += houselinux_reduce_recent_json
+                                  (buffer+cursor, size-cursor, name,
+                                   disk->timestamps,
+                                   disk->p50[op], HOUSE_BIOLAT_SPAN, "us");
+                }
+                if (cursor >= size) return 0;
+            }
+            snprintf (name, sizeof(name), "%sp99", HouseBiolatOps[op]);
+            if (now) {
+                cursor += houselinux_reduce_details_json
+                              (buffer+cursor, size-cursor, since,
+                               name, "us", now,
+                               HOUSE_BIOLAT_PERIOD, HOUSE_BIOLAT_SPAN,
+                               disk->timestamps, disk->p99[op]);
+            } else {
+                cursor += houselinux_reduce_recent_json
+                              (buffer+cursor, size-cursor, name,
+                               disk->timestamps,
+                               disk->p99[op], HOUSE_BIOLAT_SPAN, "us");
+            }
+            if (cursor >= size) return 0;
+        }
+        if (cursor == startdisk) {
+            cursor = startdev; // No data to report for this disk.
+            continue;
+        }
+        buffer[startdisk] = '{'; // Overwrite the ','.
+        cursor += snprintf (buffer+cursor, size-cursor, "}");
+        if (cursor >= size) return 0;
+        sep = ",";
+    }
+    if (cursor == start) return 0; // No data to report.
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+#endif // HOUSE_BPF
+
+int houselinux_biolat_summary (char *buffer, int size) {
+#ifdef HOUSE_BPF
+    return houselinux_biolat_report (buffer, size, 0, 0, 0);
+#else
+    return 0;
+#endif
+}
+
+int houselinux_biolat_status (char *buffer, int size) {
+#ifdef HOUSE_BPF
+    return houselinux_biolat_report (buffer, size, 0, 0, 1);
+#else
+    return 0;
+#endif
+}
+
+int houselinux_biolat_details (char *buffer, int size,
+                               time_t now, time_t since) {
+#ifdef HOUSE_BPF
+    return houselinux_biolat_report (buffer, size, now, since, 1);
+#else
+    return 0;
+#endif
+}
+
+void houselinux_biolat_export (void) {
+#ifdef HOUSE_BPF
+    if (!HouseBiolatProgram) return;
+
+    int i;
+    for (i = 0; i < HouseBiolatDisksCount; ++i) {
+        struct HouseBiolatDisk *disk = HouseBiolatDisks + i;
+        int op;
+        for (op = HOUSE_BIOLAT_READ; op <= HOUSE_BIOLAT_WRITE; ++op) {
+            char name[64];
+            snprintf (name, sizeof(name),
+                      "biolat.%s.%sp50", disk->name, HouseBiolatOps[op]);
+            houselinux_export_series (name, "us", HOUSE_BIOLAT_SPAN,
+                                      disk->timestamps, disk->p50[op]);
+            snprintf (name, sizeof(name),
+                      "biolat.%s.%sp99", disk->name, HouseBiolatOps[op]);
+            houselinux_export_series (name, "us", HOUSE_BIOLAT_SPAN,
+                                      disk->timestamps, disk->p99[op]);
+        }
+    }
+#endif
+}
+
+void houselinux_biolat_background (time_t now) {
+#ifdef HOUSE_BPF
+    static time_t NextBiolatCollect = 0;
+
+    if (!HouseBiolatProgram) return;
+
+    if (now < NextBiolatCollect) return;
+    NextBiolatCollect = now + HOUSE_BIOLAT_PERIOD;
+
+    houselinux_biolat_sample (now);
+#endif
+}
@@ -0,0 +1,35 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_biolat_bpf.h - Data shared with the block I/O latency program.
+ *
+ * This file is included by both the eBPF program and the user space
+ * collector. The histogram map is keyed by device, operation and slot:
+ * slot N counts the requests that completed in [2^N, 2^(N+1)[ microseconds.
+ */
+#define HOUSE_BIOLAT_SLOTS 32
+
+#define HOUSE_BIOLAT_READ  0
+#define HOUSE_BIOLAT_WRITE 1
+
+struct house_biolat_key {
+    __u32 dev; // The kernel's MKDEV(major, minor), i.e. (major << 20) | minor.
+    __u16 op;
+    __u16 slot;
+};
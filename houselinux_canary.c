@@ -0,0 +1,296 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_canary.c - Measure the latency of synchronous writes.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_canary_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Each -metrics-canary=PATH option declares
+ *    one directory where synchronous writes are measured. The
+ *    -metrics-canary-budget=MB option limits the volume written per day,
+ *    for each directory (default: 16 MB).
+ *
+ * void houselinux_canary_background (time_t now);
+ *
+ *    The periodic function that manages the collect of metrics.
+ *
+ * int houselinux_canary_summary (char *buffer, int size);
+ *
+ *    A function that populates a short summary of the write latencies in JSON.
+ *
+ * int houselinux_canary_status (char *buffer, int size);
+ *
+ *    A function that populates a status overview of the write latencies in JSON.
+ *
+ * int houselinux_canary_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    A function that populates a full detail report of the write latencies in JSON.
+ *
+ * void houselinux_canary_export (void);
+ *
+ *    List the recent history of the canary latencies for /metrics/export.
+ *
+ * A small file (one 4 KB block) is created in each directory and kept
+ * open with O_DSYNC. Each sample overwrites the same block, so that the
+ * write returns only once the data is on the storage. This measures the
+ * latency that applications calling fsync() experience, including
+ * stalls that the diskstats averages hide.
+ *
+ * The write is synchronous and delays the HouseLinux event loop by the
+ * same amount, which is why this is only done on the selected
+ * directories. Once the daily write budget of a directory is spent,
+ * that directory is not sampled until the next day (UTC).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_export.h"
+#include "houselinux_canary.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_CANARY_PERIOD 30 // Sample every 30 seconds.
+#define HOUSE_CANARY_SPAN   10 // MUST KEEP A 5 MINUTES HISTORY.
+#define HOUSE_CANARY_MAX     8
+#define HOUSE_CANARY_BLOCK 4096
+#define HOUSE_CANARY_BUDGET 16 // MB per day, above the 11.5 MB used.
+
+#define HOUSE_CANARY_FILE ".houselinux-canary"
+
+struct HouseCanaryTarget {
+    const char *path;
+    int fd;
+    int failed;        // Avoid repeating the same trace.
+    long long written; // Bytes written today.
+    time_t day;
+    time_t timestamps[HOUSE_CANARY_SPAN];
+    long long sync[HOUSE_CANARY_SPAN];
+};
+
+static struct HouseCanaryTarget HouseCanaryTargets[HOUSE_CANARY_MAX];
+static int HouseCanaryTargetsCount = 0;
+
+static long long HouseCanaryBudget = HOUSE_CANARY_BUDGET * 1024 * 1024;
+
+static char HouseCanaryBlock[HOUSE_CANARY_BLOCK];
+
+
+void houselinux_canary_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        const char *text = 0;
+        if (echttp_option_match ("-metrics-canary-budget=", argv[i], &text)) {
+            HouseCanaryBudget = atoll (text) * 1024 * 1024;
+            continue;
+        }
+        if (!echttp_option_match ("-metrics-canary=", argv[i], &text)) continue;
+
+        // The path is copied as is to JSON: reject anything suspicious.
+        if ((text[0] != '/') || strpbrk (text, "\"\\")) {
+            houselog_trace (HOUSE_FAILURE, text, "invalid canary path");
+            continue;
+        }
+        if (HouseCanaryTargetsCount >= HOUSE_CANARY_MAX) {
+            houselog_trace (HOUSE_FAILURE, text, "too many canaries");
+            continue;
+        }
+        struct HouseCanaryTarget *target =
+            HouseCanaryTargets + HouseCanaryTargetsCount++;
+        target->path = text;
+        target->fd = -1;
+    }
+}
+
+static int houselinux_canary_report (char *buffer, int size,
+                                     time_t now, time_t since) {
+
+    if (HouseCanaryTargetsCount <= 0) return 0;
+
+    int cursor = snprintf (buffer, size, ",\"canary\":{");
+    if (cursor >= size) return 0;
+    int start = cursor;
+
+    const char *sep = "";
+    int i;
+    for (i = 0; i < HouseCanaryTargetsCount; ++i) {
+        struct HouseCanaryTarget *target = HouseCanaryTargets + i;
+        int starttarget = cursor;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s\"%s\":", sep, target->path);
+        if (cursor >= size) return 0;
+        int startmetrics = cursor;
+
+        if (now) {
+            cursor += houselinux_reduce_details_json
+                          (buffer+cursor, size-cursor, since,
+                           "sync", "us", now,
+                           HOUSE_CANARY_PERIOD, HOUSE_CANARY_SPAN,
+                           target->timestamps, target->sync);
+        } else {
+            cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                     "sync",
+                                                     target->timestamps,
+                                                     target->sync,
+                                                     HOUSE_CANARY_SPAN, "us");
+        }
+        if (cursor >= size) return 0;
+
+        if (cursor == startmetrics) {
+            cursor = starttarget; // No data to report for this target.
+            continue;
+        }
+        buffer[startmetrics] = '{'; // Overwrite the ','.
+        cursor += snprintf (buffer+cursor, size-cursor, "}");
+        if (cursor >= size) return 0;
+        sep = ",";
+    }
+    if (cursor == start) return 0; // No data to report.
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+int houselinux_canary_summary (char *buffer, int size) {
+    return houselinux_canary_report (buffer, size, 0, 0);
+}
+
+int houselinux_canary_status (char *buffer, int size) {
+    return houselinux_canary_report (buffer, size, 0, 0);
+}
+
+int houselinux_canary_details (char *buffer, int size,
+                               time_t now, time_t since) {
+    return houselinux_canary_report (buffer, size, now, since);
+}
+
+void houselinux_canary_export (void) {
+
+    int i;
+    for (i = 0; i < HouseCanaryTargetsCount; ++i) {
+        struct HouseCanaryTarget *target = HouseCanaryTargets + i;
+        char name[512];
+        snprintf (name, sizeof(name), "canary.%s.sync", target->path);
+        houselinux_export_series (name, "us", HOUSE_CANARY_SPAN,
+                                  target->timestamps, target->sync);
+    }
+}
+
+static void houselinux_canary_failed (struct HouseCanaryTarget *target,
+                                      const char *action) {
+    if (!target->failed) {
+        houselog_trace (HOUSE_FAILURE, target->path,
+                        "cannot %s canary: %s", action, strerror(errno));
+        target->failed = 1;
+    }
+    if (target->fd >= 0) close (target->fd);
+    target->fd = -1;
+}
+
+static int houselinux_canary_open (struct HouseCanaryTarget *target) {
+
+    char name[512];
+    snprintf (name, sizeof(name), "%s/" HOUSE_CANARY_FILE, target->path);
+    target->fd = open (name, O_RDWR | O_CREAT | O_DSYNC | O_CLOEXEC, 0644);
+    if (target->fd < 0) {
+        houselinux_canary_failed (target, "open");
+        return 0;
+    }
+    // Make sure the block is allocated, so that the samples only
+    // overwrite data and do not change the file's size.
+    if (pwrite (target->fd, HouseCanaryBlock,
+                HOUSE_CANARY_BLOCK, 0) != HOUSE_CANARY_BLOCK) {
+        houselinux_canary_failed (target, "write");
+        return 0;
+    }
+    target->written += HOUSE_CANARY_BLOCK;
+    DEBUG ("Canary %s opened\n", name);
+    return 1;
+}
+
+static long long houselinux_canary_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void houselinux_canary_sample (struct HouseCanaryTarget *target,
+                                      time_t now, int index) {
+
+    target->sync[index] = 0;
+
+    time_t day = now / 86400;
+    if (day != target->day) {
+        target->day = day;
+        target->written = 0;
+    }
+    if (target->written + HOUSE_CANARY_BLOCK > HouseCanaryBudget) return;
+
+    if (target->fd < 0) {
+        if (!houselinux_canary_open (target)) return;
+    }
+
+    // Change the content, in case the storage skips identical writes.
+    memcpy (HouseCanaryBlock, &now, sizeof(now));
+
+    long long start = houselinux_canary_clock ();
+    int written = pwrite (target->fd, HouseCanaryBlock, HOUSE_CANARY_BLOCK, 0);
+    long long elapsed = houselinux_canary_clock () - start;
+    if (written != HOUSE_CANARY_BLOCK) {
+        houselinux_canary_failed (target, "write");
+        return;
+    }
+    target->failed = 0;
+    target->written += HOUSE_CANARY_BLOCK;
+    target->sync[index] = elapsed;
+    target->timestamps[index] = now;
+
+    char name[512];
+    snprintf (name, sizeof(name), "canary.%s.sync", target->path);
+    houselinux_sample (name, elapsed, "us", now);
+}
+
+void houselinux_canary_background (time_t now) {
+
+    static time_t NextCanaryCollect = 0;
+
+    if (HouseCanaryTargetsCount <= 0) return;
+
+    if (now < NextCanaryCollect) return;
+    NextCanaryCollect = now + HOUSE_CANARY_PERIOD;
+
+    int index = (now / HOUSE_CANARY_PERIOD) % HOUSE_CANARY_SPAN;
+
+    int i;
+    for (i = 0; i < HouseCanaryTargetsCount; ++i)
+        houselinux_canary_sample (HouseCanaryTargets + i, now, index);
+}
@@ -40,6 +40,15 @@
  * int houselinux_cpu_details (char *buffer, int size, time_t now, time_t since);
  *
  *    A function that populates a detailed report of the CPU usage in JSON.
+ *
+ * void houselinux_cpu_export (void);
+ *
+ *    List the recent history of the CPU usage for /metrics/export.
+ *
+ * int houselinux_cpu_raw (char *buffer, int size);
+ *
+ *    A function that populates the latest raw cumulative CPU times in JSON,
+ *    with the CLOCK_MONOTONIC time (nanoseconds) when these were sampled.
  */
 
 #include <string.h>
@@ -51,6 +60,11 @@
 
 #include "houselog.h"
 #include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_source.h"
+#include "houselinux_parse.h"
+#include "houselinux_wakeup.h"
+#include "houselinux_export.h"
 #include "houselinux_cpu.h"
 
 #define HOUSE_CPU_PERIOD  5 // Sample CPU metrics every 5 seconds.
@@ -68,9 +82,18 @@ struct HouseCpuMetrics {
 
 static struct HouseCpuMetrics HouseCpuLatest;
 
+static long long HouseCpuPrevious[16];
+static long long HouseCpuPreviousClock = 0; // CLOCK_MONOTONIC, nanoseconds.
+
+static int HouseCpuStatSource = -1;
+static int HouseCpuLoadSource = -1;
+
 
 void houselinux_cpu_initialize (int argc, const char **argv) {
-    // TBD
+    HouseCpuStatSource =
+        houselinux_source_register ("/proc/stat", HOUSE_CPU_PERIOD);
+    HouseCpuLoadSource =
+        houselinux_source_register ("/proc/loadavg", HOUSE_CPU_PERIOD);
 }
 
 int houselinux_cpu_status (char *buffer, int size) {
@@ -81,22 +104,28 @@ int houselinux_cpu_status (char *buffer, int size) {
     if (cursor >= size) return 0;
 
     int start = cursor;
-    cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                      "busy",
-                                      HouseCpuLatest.busy,
-                                      HOUSE_CPU_SPAN, "%");
+    cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                             "busy",
+                                             HouseCpuLatest.timestamp,
+                                             HouseCpuLatest.busy,
+                                             HOUSE_CPU_SPAN, "%");
+    if (cursor >= size) return 0;
+
+    cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                             "iowait",
+                                             HouseCpuLatest.timestamp,
+                                             HouseCpuLatest.iowait,
+                                             HOUSE_CPU_SPAN, "%");
     if (cursor >= size) return 0;
 
-    cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                      "iowait",
-                                      HouseCpuLatest.iowait,
-                                      HOUSE_CPU_SPAN, "%");
+    cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                             "steal",
+                                             HouseCpuLatest.timestamp,
+                                             HouseCpuLatest.steal,
+                                             HOUSE_CPU_SPAN, "%");
     if (cursor >= size) return 0;
 
-    cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                      "steal",
-                                      HouseCpuLatest.steal,
-                                      HOUSE_CPU_SPAN, "%");
+    cursor += houselinux_wakeup_report (buffer+cursor, size-cursor);
     if (cursor >= size) return 0;
 
     if ((HouseCpuLatest.load1 > 0) ||
@@ -151,6 +180,9 @@ int houselinux_cpu_details (char *buffer, int size, time_t now, time_t since) {
                                               HouseCpuLatest.steal);
     if (cursor >= size) return 0;
 
+    cursor += houselinux_wakeup_report (buffer+cursor, size-cursor);
+    if (cursor >= size) return 0;
+
     if ((HouseCpuLatest.load1 > 0) ||
         (HouseCpuLatest.load5 > 0) ||
         (HouseCpuLatest.load15 > 0)) {
@@ -170,13 +202,37 @@ int houselinux_cpu_details (char *buffer, int size, time_t now, time_t since) {
     return cursor;
 }
 
-static void houselinux_cpu_load (struct HouseCpuMetrics *latest) {
+void houselinux_cpu_export (void) {
+    houselinux_export_series ("cpu.busy", "%", HOUSE_CPU_SPAN,
+                              HouseCpuLatest.timestamp, HouseCpuLatest.busy);
+    houselinux_export_series ("cpu.iowait", "%", HOUSE_CPU_SPAN,
+                              HouseCpuLatest.timestamp, HouseCpuLatest.iowait);
+    houselinux_export_series ("cpu.steal", "%", HOUSE_CPU_SPAN,
+                              HouseCpuLatest.timestamp, HouseCpuLatest.steal);
+}
+
+int houselinux_cpu_raw (char *buffer, int size) {
+
+    if (!HouseCpuPreviousClock) return 0; // Not sampled yet.
+
+    int cursor = snprintf (buffer, size,
+                           ",\"cpu\":{\"clock\":%lld,\"hz\":%ld,"
+                               "\"user\":%lld,\"nice\":%lld,"
+                               "\"system\":%lld,\"idle\":%lld,"
+                               "\"iowait\":%lld,\"irq\":%lld,"
+                               "\"softirq\":%lld,\"steal\":%lld}",
+                           HouseCpuPreviousClock, sysconf (_SC_CLK_TCK),
+                           HouseCpuPrevious[0], HouseCpuPrevious[1],
+                           HouseCpuPrevious[2], HouseCpuPrevious[3],
+                           HouseCpuPrevious[4], HouseCpuPrevious[5],
+                           HouseCpuPrevious[6], HouseCpuPrevious[7]);
+    if (cursor >= size) return 0;
+    return cursor;
+}
 
-    char buffer[80];
-    FILE *f = fopen ("/proc/loadavg", "r");
-    if (!f) return;
+static void houselinux_cpu_load (struct HouseCpuMetrics *latest, time_t now) {
 
-    char *line = fgets (buffer, sizeof(buffer), f);
+    char *line = houselinux_source_get (HouseCpuLoadSource, now);
     if (line) {
         float v[3];
         int count = sscanf (line, "%f %f %f ", &v[0], &v[1], &v[2]);
@@ -186,27 +242,23 @@ static void houselinux_cpu_load (struct HouseCpuMetrics *latest) {
             latest->load15 = (long long)(v[2] * 100);
         }
     }
-    fclose (f);
 }
 
-static void houselinux_cpu_stat (struct HouseCpuMetrics *latest, int index) {
-
-    static long long Previous[16];
+static void houselinux_cpu_stat (struct HouseCpuMetrics *latest,
+                                 int index, time_t now) {
 
     if (latest) {
         // Reset all the metrics, in case these are not accessible;
         latest->busy[index] = latest->iowait[index] = 0;
     }
 
-    char buffer[80];
-    FILE *f = fopen ("/proc/stat", "r");
-    if (!f) return;
+    char *cursor = houselinux_source_get (HouseCpuStatSource, now);
+    if (!cursor) return;
 
     long long value[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
-    while (!feof (f)) {
-        char *line = fgets (buffer, sizeof(buffer), f);
-        if (!line) break;
+    char *line;
+    while ((line = houselinux_source_line (&cursor))) {
 
         // This is an optimization: the only line with a space at that position
         // is the aggregated CPU numbers line. This eliminate the other lines
@@ -218,12 +270,7 @@ static void houselinux_cpu_stat (struct HouseCpuMetrics *latest, int index) {
         // At this point, this can only be the "cpu" line.
         line += 3;
 
-        int i;
-        for (i = 0; i < 16; ++i) {
-            for (line += 1; *line > ' '; ++line) ; // Skip previous item.
-            if (line[0] < ' ') break; // end of line.
-            value[i] = atoll(line);
-        }
+        int i = houselinux_parse_numbers (&line, value, 16);
         if (i > 10) printf ("WARNING: %d items (> 10) in /proc/stat.\n", i);
         if (i < 10) printf ("WARNING: %d items (< 10) in /proc/stat.\n", i);
 
@@ -243,24 +290,28 @@ static void houselinux_cpu_stat (struct HouseCpuMetrics *latest, int index) {
         if (latest) {
             // Exclude guests, apparently already counted in 0 and 1?
             long long total = 0;
-            for (i = 7; i >= 0; --i) total += value[i] - Previous[i];
+            for (i = 7; i >= 0; --i) total += value[i] - HouseCpuPrevious[i];
 
             if (total <= 0) {
                 latest->busy[index] = 0;
                 latest->iowait[index] = 0;
             } else {
-                long long steal = value[7] - Previous[7];
-                long long iowait = value[4] - Previous[4];
-                long long idle = (value[3] - Previous[3]) + iowait;
+                long long steal = value[7] - HouseCpuPrevious[7];
+                long long iowait = value[4] - HouseCpuPrevious[4];
+                long long idle = (value[3] - HouseCpuPrevious[3]) + iowait;
                 latest->busy[index] = (100 * (total - idle)) / total;
                 latest->iowait[index] = (100 * iowait) / total;
                 latest->steal[index] = (100 * steal) / total;
             }
+            houselinux_sample ("cpu.busy", latest->busy[index], "%", now);
+            houselinux_sample ("cpu.iowait", latest->iowait[index], "%", now);
+            houselinux_sample ("cpu.steal", latest->steal[index], "%", now);
         }
-        memcpy (Previous, value, sizeof(Previous)); // Baseline for next time.
+        // Baseline for next time.
+        memcpy (HouseCpuPrevious, value, sizeof(HouseCpuPrevious));
+        HouseCpuPreviousClock = houselinux_source_clock (HouseCpuStatSource);
         break; // We got all that we were looking for.
     }
-    fclose (f);
 }
 
 void houselinux_cpu_background (time_t now) {
@@ -272,11 +323,11 @@ void houselinux_cpu_background (time_t now) {
     NextCpuCollect = now + HOUSE_CPU_PERIOD;
 
     if (firsttime) {
-        houselinux_cpu_stat (0, 0); // Just setup the first baseline.
+        houselinux_cpu_stat (0, 0, now); // Just setup the first baseline.
     } else {
         int index = (now / HOUSE_CPU_PERIOD) % HOUSE_CPU_SPAN;
-        houselinux_cpu_stat (&HouseCpuLatest, index);
-        houselinux_cpu_load (&HouseCpuLatest);
+        houselinux_cpu_stat (&HouseCpuLatest, index, now);
+        houselinux_cpu_load (&HouseCpuLatest, now);
         HouseCpuLatest.timestamp[index] = now;
     }
 }
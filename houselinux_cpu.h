@@ -25,4 +25,6 @@ void houselinux_cpu_background (time_t now);
 int houselinux_cpu_summary (char *buffer, int size);
 int houselinux_cpu_status (char *buffer, int size);
 int houselinux_cpu_details (char *buffer, int size, time_t now, time_t since);
+void houselinux_cpu_export (void);
+int houselinux_cpu_raw (char *buffer, int size);
 
@@ -0,0 +1,427 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_cpuidle.c - Collect CPU idle state residency.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_cpuidle_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. The per-core breakdown is enabled using
+ *    the -metrics-cpuidle-cores option.
+ *
+ * void houselinux_cpuidle_background (time_t now);
+ *
+ *    The periodic function that manages the collect of metrics.
+ *
+ * int houselinux_cpuidle_summary (char *buffer, int size);
+ *
+ *    A function that populates a short summary of the idle states in JSON.
+ *
+ * int houselinux_cpuidle_status (char *buffer, int size);
+ *
+ *    A function that populates a status overview of the idle states in JSON.
+ *
+ * int houselinux_cpuidle_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    A function that populates a full detail report of the idle states
+ *    in JSON.
+ *
+ * void houselinux_cpuidle_export (void);
+ *
+ *    List the recent history of the CPU idle states for /metrics/export.
+ *
+ * The idle states are listed in /sys/devices/system/cpu/cpuN/cpuidle.
+ * For each state, the kernel provides the cumulative time spent in that
+ * state (in microseconds) and the number of times the state was entered.
+ * The residency is the percentage of the time spent in that state, and
+ * is aggregated across all cores (i.e. 100% means that all cores spent
+ * the whole period in that state).
+ *
+ * This collector is silently disabled if cpuidle is not supported (e.g.
+ * in most VMs).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_reduce.h"
+#include "houselinux_source.h"
+#include "houselinux_sample.h"
+#include "houselinux_export.h"
+#include "houselinux_cpuidle.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_CPUIDLE_PERIOD    5 // Sample idle states every 5 seconds.
+#define HOUSE_CPUIDLE_SPAN     60 // MUST KEEP A 5 MINUTES HISTORY.
+#define HOUSE_CPUIDLE_STATES   12
+
+#define HOUSE_CPUIDLE_ROOT "/sys/devices/system/cpu"
+
+struct HouseCpuIdleState {
+    char name[16];
+    long long residency[HOUSE_CPUIDLE_SPAN];
+    long long rate[HOUSE_CPUIDLE_SPAN];
+};
+
+static struct HouseCpuIdleState HouseCpuIdleStates[HOUSE_CPUIDLE_STATES];
+static int HouseCpuIdleStatesCount = 0;
+
+struct HouseCpuIdleCore {
+    int cpu;
+    int count;
+    int baseline; // Are the previous values valid?
+    int time[HOUSE_CPUIDLE_STATES];  // Source handles.
+    int usage[HOUSE_CPUIDLE_STATES]; // Source handles.
+    long long previoustime[HOUSE_CPUIDLE_STATES];
+    long long previoususage[HOUSE_CPUIDLE_STATES];
+    long long (*residency)[HOUSE_CPUIDLE_SPAN]; // Only if per-core.
+};
+
+static struct HouseCpuIdleCore *HouseCpuIdleCores = 0;
+static int HouseCpuIdleCoresCount = 0;
+
+static int HouseCpuIdlePerCore = 0;
+
+static time_t HouseCpuIdleTimestamps[HOUSE_CPUIDLE_SPAN];
+static struct timespec HouseCpuIdlePrevious = {0, 0};
+
+
+static int houselinux_cpuidle_compare (const void *a, const void *b) {
+    return ((const struct HouseCpuIdleCore *)a)->cpu
+               - ((const struct HouseCpuIdleCore *)b)->cpu;
+}
+
+static void houselinux_cpuidle_name (int state, const char *path) {
+
+    if (HouseCpuIdleStates[state].name[0]) return; // Already known.
+
+    char name[128] = {0};
+    FILE *f = fopen (path, "r");
+    if (f) {
+        if (!fgets (name, sizeof(name), f)) name[0] = 0;
+        fclose (f);
+    }
+    char *eol = strchr (name, '\n');
+    if (eol) *eol = 0;
+    if ((!name[0]) || strchr (name, '"') || strchr (name, '\\')
+        || (strlen(name) >= sizeof(HouseCpuIdleStates[0].name))) {
+        snprintf (name, sizeof(name), "state%d", state);
+    }
+    strcpy (HouseCpuIdleStates[state].name, name);
+}
+
+static void houselinux_cpuidle_core (int cpu) {
+
+    struct HouseCpuIdleCore *core = HouseCpuIdleCores + HouseCpuIdleCoresCount;
+    core->cpu = cpu;
+    core->count = 0;
+
+    int state;
+    for (state = 0; state < HOUSE_CPUIDLE_STATES; ++state) {
+        char path[256];
+        snprintf (path, sizeof(path),
+                  HOUSE_CPUIDLE_ROOT "/cpu%d/cpuidle/state%d/time", cpu, state);
+        int time = houselinux_source_register (path, HOUSE_CPUIDLE_PERIOD);
+        if (time < 0) break;
+        snprintf (path, sizeof(path),
+                  HOUSE_CPUIDLE_ROOT "/cpu%d/cpuidle/state%d/usage", cpu, state);
+        int usage = houselinux_source_register (path, HOUSE_CPUIDLE_PERIOD);
+        if (usage < 0) break;
+        snprintf (path, sizeof(path),
+                  HOUSE_CPUIDLE_ROOT "/cpu%d/cpuidle/state%d/name", cpu, state);
+        houselinux_cpuidle_name (state, path);
+        core->time[state] = time;
+        core->usage[state] = usage;
+        core->count += 1;
+    }
+    if (core->count <= 0) return;
+
+    if (core->count > HouseCpuIdleStatesCount)
+        HouseCpuIdleStatesCount = core->count;
+    if (HouseCpuIdlePerCore)
+        core->residency =
+            calloc (HOUSE_CPUIDLE_STATES, sizeof(core->residency[0]));
+    HouseCpuIdleCoresCount += 1;
+}
+
+void houselinux_cpuidle_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-metrics-cpuidle-cores", argv[i]))
+            HouseCpuIdlePerCore = 1;
+    }
+
+    DIR *dir = opendir (HOUSE_CPUIDLE_ROOT);
+    if (!dir) return;
+
+    int size = 0;
+    struct dirent *entry;
+    while ((entry = readdir (dir))) {
+        if (strncmp (entry->d_name, "cpu", 3)) continue;
+        if (!isdigit (entry->d_name[3])) continue; // cpufreq, cpuidle, etc.
+        if (HouseCpuIdleCoresCount >= size) {
+            size += 16;
+            HouseCpuIdleCores =
+                realloc (HouseCpuIdleCores,
+                         size * sizeof(struct HouseCpuIdleCore));
+        }
+        memset (HouseCpuIdleCores + HouseCpuIdleCoresCount,
+                0, sizeof(struct HouseCpuIdleCore));
+        houselinux_cpuidle_core (atoi (entry->d_name + 3));
+    }
+    closedir (dir);
+
+    if (HouseCpuIdleCoresCount > 1)
+        qsort (HouseCpuIdleCores, HouseCpuIdleCoresCount,
+               sizeof(struct HouseCpuIdleCore), houselinux_cpuidle_compare);
+
+    DEBUG ("cpuidle: %d cores, %d states\n",
+           HouseCpuIdleCoresCount, HouseCpuIdleStatesCount);
+}
+
+static long long houselinux_cpuidle_read (int source, time_t now) {
+    const char *data = houselinux_source_get (source, now);
+    if (!data) return -1;
+    return atoll (data);
+}
+
+static int houselinux_cpuidle_report (char *buffer, int size,
+                                      time_t now, time_t since) {
+    int i;
+    int cursor = 0;
+    int start = 0;
+    const char *sep = "";
+
+    if (HouseCpuIdleCoresCount <= 0) return 0;
+
+    cursor = snprintf (buffer, size, ",\"cpuidle\":{");
+    if (cursor >= size) return 0;
+    start = cursor;
+
+    for (i = 0; i < HouseCpuIdleStatesCount; ++i) {
+        struct HouseCpuIdleState *state = HouseCpuIdleStates + i;
+        int startstate = cursor;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s\"%s\":", sep, state->name);
+        if (cursor >= size) return 0;
+        int startmetrics = cursor;
+
+        if (now) {
+            cursor += houselinux_reduce_details_json
+                          (buffer+cursor, size-cursor, since,
+                           "residency", "%", now,
+                           HOUSE_CPUIDLE_PERIOD, HOUSE_CPUIDLE_SPAN,
+                           HouseCpuIdleTimestamps, state->residency);
+            if (cursor >= size) return 0;
+            cursor += houselinux_reduce_details_json
+                          (buffer+cursor, size-cursor, since,
+                           "rate", "/s", now,
+                           HOUSE_CPUIDLE_PERIOD, HOUSE_CPUIDLE_SPAN,
+                           HouseCpuIdleTimestamps, state->rate);
+        } else {
+            cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                     "residency",
+                                                     HouseCpuIdleTimestamps,
+                                                     state->residency,
+                                                     HOUSE_CPUIDLE_SPAN, "%");
+            if (cursor >= size) return 0;
+            cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                     "rate",
+                                                     HouseCpuIdleTimestamps,
+                                                     state->rate,
+                                                     HOUSE_CPUIDLE_SPAN, "/s");
+        }
+        if (cursor >= size) return 0;
+
+        if (cursor == startmetrics) {
+            cursor = startstate; // No data to report for this state.
+            continue;
+        }
+        buffer[startmetrics] = '{'; // Overwrite the ','.
+        cursor += snprintf (buffer+cursor, size-cursor, "}");
+        sep = ",";
+    }
+    if (cursor == start) return 0; // No data to report for any state.
+
+    if (HouseCpuIdlePerCore) {
+        cursor += snprintf (buffer+cursor, size-cursor, ",\"cores\":{");
+        if (cursor >= size) return 0;
+        sep = "";
+        for (i = 0; i < HouseCpuIdleCoresCount; ++i) {
+            struct HouseCpuIdleCore *core = HouseCpuIdleCores + i;
+            int startcore = cursor;
+            cursor += snprintf (buffer+cursor, size-cursor,
+                                "%s\"cpu%d\":", sep, core->cpu);
+            if (cursor >= size) return 0;
+            int startmetrics = cursor;
+            int s;
+            for (s = 0; s < core->count; ++s) {
+                if (now) {
+                    cursor += houselinux_reduce_details_json
+                                  (buffer+cursor, size-cursor, since,
+                                   HouseCpuIdleStates[s].name, "%", now,
+                                   HOUSE_CPUIDLE_PERIOD, HOUSE_CPUIDLE_SPAN,
+                                   HouseCpuIdleTimestamps, core->residency[s]);
+                } else {
+                    cursor += houselinux_reduce_recent_json
+                                  (buffer+cursor, size-cursor,
+                                   HouseCpuIdleStates[s].name,
+                                   HouseCpuIdleTimestamps,
+                                   core->residency[s], HOUSE_CPUIDLE_SPAN, "%");
+                }
+                if (cursor >= size) return 0;
+            }
+            if (cursor == startmetrics) {
+                cursor = startcore; // No data to report for this core.
+                continue;
+            }
+            buffer[startmetrics] = '{'; // Overwrite the ','.
+            cursor += snprintf (buffer+cursor, size-cursor, "}");
+            sep = ",";
+        }
+        cursor += snprintf (buffer+cursor, size-cursor, "}");
+    }
+
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+int houselinux_cpuidle_status (char *buffer, int size) {
+    return houselinux_cpuidle_report (buffer, size, 0, 0);
+}
+
+int houselinux_cpuidle_summary (char *buffer, int size) {
+    return houselinux_cpuidle_status (buffer, size); // Already the shortest.
+}
+
+int houselinux_cpuidle_details (char *buffer, int size,
+                                time_t now, time_t since) {
+    return houselinux_cpuidle_report (buffer, size, now, since);
+}
+
+void houselinux_cpuidle_export (void) {
+
+    if (HouseCpuIdleCoresCount <= 0) return;
+
+    char name[128];
+    int i;
+    for (i = 0; i < HouseCpuIdleStatesCount; ++i) {
+        struct HouseCpuIdleState *state = HouseCpuIdleStates + i;
+        snprintf (name, sizeof(name), "cpuidle.%.15s.residency", state->name);
+        houselinux_export_series (name, "%", HOUSE_CPUIDLE_SPAN,
+                                  HouseCpuIdleTimestamps, state->residency);
+        snprintf (name, sizeof(name), "cpuidle.%.15s.rate", state->name);
+        houselinux_export_series (name, "/s", HOUSE_CPUIDLE_SPAN,
+                                  HouseCpuIdleTimestamps, state->rate);
+    }
+    if (!HouseCpuIdlePerCore) return;
+
+    for (i = 0; i < HouseCpuIdleCoresCount; ++i) {
+        struct HouseCpuIdleCore *core = HouseCpuIdleCores + i;
+        int s;
+        for (s = 0; s < core->count; ++s) {
+            snprintf (name, sizeof(name), "cpuidle.cores.cpu%d.%.15s",
+                      core->cpu, HouseCpuIdleStates[s].name);
+            houselinux_export_series (name, "%", HOUSE_CPUIDLE_SPAN,
+                                      HouseCpuIdleTimestamps,
+                                      core->residency[s]);
+        }
+    }
+}
+
+void houselinux_cpuidle_background (time_t now) {
+
+    static time_t NextCpuIdleCollect = 0;
+
+    if (HouseCpuIdleCoresCount <= 0) return;
+
+    if (now < NextCpuIdleCollect) return;
+    NextCpuIdleCollect = now + HOUSE_CPUIDLE_PERIOD;
+
+    // Use the actual elapsed time, as the background calls may be late.
+    struct timespec current;
+    clock_gettime (CLOCK_MONOTONIC, &current);
+    long long elapsed = // Microseconds, as the cpuidle time.
+        (current.tv_sec - HouseCpuIdlePrevious.tv_sec) * 1000000LL
+            + (current.tv_nsec - HouseCpuIdlePrevious.tv_nsec) / 1000;
+    int valid = (HouseCpuIdlePrevious.tv_sec > 0) && (elapsed > 0);
+    HouseCpuIdlePrevious = current;
+
+    int index = (now / HOUSE_CPUIDLE_PERIOD) % HOUSE_CPUIDLE_SPAN;
+
+    long long time[HOUSE_CPUIDLE_STATES];
+    long long usage[HOUSE_CPUIDLE_STATES];
+    memset (time, 0, sizeof(time));
+    memset (usage, 0, sizeof(usage));
+    int cores = 0;
+
+    int i;
+    for (i = 0; i < HouseCpuIdleCoresCount; ++i) {
+        struct HouseCpuIdleCore *core = HouseCpuIdleCores + i;
+        int s;
+        int counted = 0;
+        for (s = 0; s < core->count; ++s) {
+            long long t = houselinux_cpuidle_read (core->time[s], now);
+            long long u = houselinux_cpuidle_read (core->usage[s], now);
+            if ((t < 0) || (u < 0)) continue; // Core offline?
+            if (valid && core->baseline) {
+                long long deltatime = t - core->previoustime[s];
+                long long deltausage = u - core->previoususage[s];
+                if (deltatime < 0) deltatime = 0;
+                if (deltausage < 0) deltausage = 0;
+                time[s] += deltatime;
+                usage[s] += deltausage;
+                counted = 1;
+                if (core->residency)
+                    core->residency[s][index] = (100 * deltatime) / elapsed;
+            }
+            core->previoustime[s] = t;
+            core->previoususage[s] = u;
+        }
+        core->baseline = 1;
+        cores += counted;
+    }
+    if (cores <= 0) return;
+
+    char name[128];
+    for (i = 0; i < HouseCpuIdleStatesCount; ++i) {
+        struct HouseCpuIdleState *state = HouseCpuIdleStates + i;
+        state->residency[index] = (100 * time[i]) / (elapsed * cores);
+        state->rate[index] = (usage[i] * 1000000 + elapsed / 2) / elapsed;
+
+        snprintf (name, sizeof(name), "cpuidle.%.15s.residency", state->name);
+        houselinux_sample (name, state->residency[index], "%", now);
+        snprintf (name, sizeof(name), "cpuidle.%.15s.rate", state->name);
+        houselinux_sample (name, state->rate[index], "/s", now);
+    }
+    HouseCpuIdleTimestamps[index] = now;
+}
+
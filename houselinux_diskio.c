@@ -40,6 +40,27 @@
  * int houselinux_diskio_details (char *buffer, int size, time_t now, time_t since);
  *
  *    A function that populates a full detail report of the disk IO in JSON.
+ *
+ * void houselinux_diskio_export (void);
+ *
+ *    List the recent history of the disk I/O for /metrics/export.
+ *
+ * int houselinux_diskio_track (int major, int minor, const char *device);
+ *
+ *    Make sure that the specified block device is tracked, even if it is
+ *    a partition. Devices tracked only through this function are not
+ *    listed in the disk section. Return a device index, or -1.
+ *
+ * int houselinux_diskio_raw (char *buffer, int size);
+ *
+ *    A function that populates the latest raw cumulative counters in JSON,
+ *    with the CLOCK_MONOTONIC time (nanoseconds) when these were sampled.
+ *
+ * int houselinux_diskio_report (char *buffer, int size, int device,
+ *                               time_t now, time_t since);
+ *
+ *    A function that populates the IO rates of the specified device in JSON.
+ *    This is a status overview if now is 0, a full detail report otherwise.
  */
 
 #include <string.h>
@@ -51,6 +72,10 @@
 
 #include "houselog.h"
 #include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_source.h"
+#include "houselinux_parse.h"
+#include "houselinux_export.h"
 #include "houselinux_diskio.h"
 
 #define HOUSE_DISKIO_PERIOD  5 // Sample CPU metrics every 5 seconds.
@@ -60,18 +85,23 @@ struct HouseDiskIOMetrics {
     int major;
     int minor;
     char device[16];
+    int hidden;   // Tracked on behalf of another module.
+    int baseline; // Is previous valid?
     time_t timestamps[HOUSE_DISKIO_SPAN];
     long long rdrate[HOUSE_DISKIO_SPAN];
     long long wrrate[HOUSE_DISKIO_SPAN];
     long long rdwait[HOUSE_DISKIO_SPAN];
     long long wrwait[HOUSE_DISKIO_SPAN];
     long long previous[17];
+    long long previousclock; // CLOCK_MONOTONIC, nanoseconds.
 };
 
 static struct HouseDiskIOMetrics *HouseDiskIOLatest = 0;
 static int                        HouseDiskIOLatestSize = 0;
 static int                        HouseDiskIOLatestCount = 0;
 
+static int HouseDiskIOSource = -1;
+
 
 static int houselinux_diskio_find (int minor, int major) {
     int i;
@@ -90,6 +120,8 @@ static int houselinux_diskio_add (int minor, int major, const char *device) {
             realloc (HouseDiskIOLatest,
                      HouseDiskIOLatestSize*sizeof(struct HouseDiskIOMetrics));
     }
+    memset (HouseDiskIOLatest + HouseDiskIOLatestCount, 0,
+            sizeof(struct HouseDiskIOMetrics));
     HouseDiskIOLatest[HouseDiskIOLatestCount].major = major;
     HouseDiskIOLatest[HouseDiskIOLatestCount].minor = minor;
     snprintf (HouseDiskIOLatest[HouseDiskIOLatestCount].device,
@@ -98,45 +130,30 @@ static int houselinux_diskio_add (int minor, int major, const char *device) {
     return HouseDiskIOLatestCount++;
 }
 
-static char *skipspace (char *line) {
-    while (*line == ' ') line += 1;
-    return line;
-}
-
-static char *skipvalue (char *line) {
-    while (*line > ' ') line += 1;
-    return skipspace (line);
-}
-
 void houselinux_diskio_initialize (int argc, const char **argv) {
 
     // Allocate enough space for the disk devices present on this machine
     // and set the initial "previous" values.
 
-    char buffer[1024];
-    FILE *f = fopen ("/proc/diskstats", "r");
-    if (!f) return;
+    HouseDiskIOSource =
+        houselinux_source_register ("/proc/diskstats", HOUSE_DISKIO_PERIOD);
+
+    char *cursor = houselinux_source_get (HouseDiskIOSource, time(0));
+    if (!cursor) return;
 
-    while (!feof (f)) {
-        char *line = fgets (buffer, sizeof(buffer), f);
-        if (!line) break;
+    char *line;
+    while ((line = houselinux_source_line (&cursor))) {
 
-        int i;
-        int major;
-        int minor;
-        char *device;
+        long long id[2];
         long long value[17];
 
-        line = skipspace (line);
-        major = atoi (line);
-        line = skipvalue (line);
-        minor = atoi (line);
-        line = skipvalue (line);
-        device = line;
-        for (i = 0; i < 17; ++i) {
-            line = skipvalue (line);
-            value[i] = atoll (line);
-        }
+        if (houselinux_parse_numbers (&line, id, 2) < 2) continue;
+        int major = (int)(id[0]);
+        int minor = (int)(id[1]);
+        char *device = line;
+        line = houselinux_parse_skip (line);
+        memset (value, 0, sizeof(value));
+        houselinux_parse_numbers (&line, value, 17);
 
         // Backtrack and terminate the device string.
         line = device;
@@ -160,8 +177,85 @@ void houselinux_diskio_initialize (int argc, const char **argv) {
         int index = houselinux_diskio_add (major, minor, device);
         struct HouseDiskIOMetrics *metrics = HouseDiskIOLatest + index;
         memcpy (metrics->previous, value, sizeof(metrics->previous));
+        metrics->previousclock = houselinux_source_clock (HouseDiskIOSource);
+        metrics->baseline = 1;
     }
-    fclose (f);
+}
+
+int houselinux_diskio_track (int major, int minor, const char *device) {
+
+    int index = houselinux_diskio_find (major, minor);
+    if (index >= 0) return index;
+
+    index = houselinux_diskio_add (major, minor, device);
+    HouseDiskIOLatest[index].hidden = 1;
+    return index;
+}
+
+int houselinux_diskio_report (char *buffer, int size, int device,
+                              time_t now, time_t since) {
+
+    if ((device < 0) || (device >= HouseDiskIOLatestCount)) return 0;
+    struct HouseDiskIOMetrics *metrics = HouseDiskIOLatest + device;
+
+    int cursor = 0;
+    if (now) {
+        cursor += houselinux_reduce_details_json (buffer+cursor, size-cursor,
+                                        since, "rdrate", "r/s", now,
+                                        HOUSE_DISKIO_PERIOD, HOUSE_DISKIO_SPAN,
+                                        metrics->timestamps, metrics->rdrate);
+        if (cursor >= size) return 0;
+
+        cursor += houselinux_reduce_details_json (buffer+cursor, size-cursor,
+                                        since, "wrrate", "w/s", now,
+                                        HOUSE_DISKIO_PERIOD, HOUSE_DISKIO_SPAN,
+                                        metrics->timestamps, metrics->wrrate);
+    } else {
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "rdrate",
+                                                 metrics->timestamps,
+                                                 metrics->rdrate,
+                                                 HOUSE_DISKIO_SPAN, "r/s");
+        if (cursor >= size) return 0;
+
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "wrrate",
+                                                 metrics->timestamps,
+                                                 metrics->wrrate,
+                                                 HOUSE_DISKIO_SPAN, "w/s");
+    }
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+int houselinux_diskio_raw (char *buffer, int size) {
+
+    int i;
+    const char *sep = "";
+
+    int cursor = snprintf (buffer, size, ",\"disk\":{");
+    if (cursor >= size) return 0;
+    int start = cursor;
+
+    for (i = 0; i < HouseDiskIOLatestCount; ++i) {
+        struct HouseDiskIOMetrics *metrics = HouseDiskIOLatest + i;
+        if (metrics->hidden || !metrics->baseline) continue;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s\"%s\":{\"clock\":%lld,"
+                                "\"rdcount\":%lld,\"rdsectors\":%lld,"
+                                "\"rdtime\":%lld,\"wrcount\":%lld,"
+                                "\"wrsectors\":%lld,\"wrtime\":%lld}",
+                            sep, metrics->device, metrics->previousclock,
+                            metrics->previous[0], metrics->previous[2],
+                            metrics->previous[3], metrics->previous[4],
+                            metrics->previous[6], metrics->previous[7]);
+        if (cursor >= size) return 0;
+        sep = ",";
+    }
+    if (cursor == start) return 0; // No device to report.
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
 }
 
 int houselinux_diskio_status (char *buffer, int size) {
@@ -177,6 +271,7 @@ int houselinux_diskio_status (char *buffer, int size) {
     start = cursor;
 
     for (i = 0; i < HouseDiskIOLatestCount; ++i) {
+        if (HouseDiskIOLatest[i].hidden) continue;
         startdev = cursor;
         cursor += snprintf (buffer+cursor, size-cursor,
                             "%s\"%s\":",
@@ -184,28 +279,32 @@ int houselinux_diskio_status (char *buffer, int size) {
         if (cursor >= size) break;
         int startmetrics = cursor;
 
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "rdrate",
-                                          HouseDiskIOLatest[i].rdrate,
-                                          HOUSE_DISKIO_SPAN, "r/s");
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "rdrate",
+                                                 HouseDiskIOLatest[i].timestamps,
+                                                 HouseDiskIOLatest[i].rdrate,
+                                                 HOUSE_DISKIO_SPAN, "r/s");
         if (cursor >= size) break;
 
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "rdwait",
-                                          HouseDiskIOLatest[i].rdwait,
-                                          HOUSE_DISKIO_SPAN, "ms");
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "rdwait",
+                                                 HouseDiskIOLatest[i].timestamps,
+                                                 HouseDiskIOLatest[i].rdwait,
+                                                 HOUSE_DISKIO_SPAN, "ms");
         if (cursor >= size) break;
 
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "wrrate",
-                                          HouseDiskIOLatest[i].wrrate,
-                                          HOUSE_DISKIO_SPAN, "w/s");
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "wrrate",
+                                                 HouseDiskIOLatest[i].timestamps,
+                                                 HouseDiskIOLatest[i].wrrate,
+                                                 HOUSE_DISKIO_SPAN, "w/s");
         if (cursor >= size) break;
 
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "wrwait",
-                                          HouseDiskIOLatest[i].wrwait,
-                                          HOUSE_DISKIO_SPAN, "ms");
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "wrwait",
+                                                 HouseDiskIOLatest[i].timestamps,
+                                                 HouseDiskIOLatest[i].wrwait,
+                                                 HOUSE_DISKIO_SPAN, "ms");
         if (cursor >= size) break;
 
         if (cursor == startmetrics) {
@@ -239,6 +338,7 @@ int houselinux_diskio_details (char *buffer, int size, time_t now, time_t since)
     start = cursor;
 
     for (i = 0; i < HouseDiskIOLatestCount; ++i) {
+        if (HouseDiskIOLatest[i].hidden) continue;
         startdev = cursor;
         cursor += snprintf (buffer+cursor, size-cursor,
                             "%s\"%s\":",
@@ -288,38 +388,65 @@ int houselinux_diskio_details (char *buffer, int size, time_t now, time_t since)
     return cursor;
 }
 
+void houselinux_diskio_export (void) {
+
+    int i;
+    for (i = 0; i < HouseDiskIOLatestCount; ++i) {
+        struct HouseDiskIOMetrics *metrics = HouseDiskIOLatest + i;
+        char name[64];
+        snprintf (name, sizeof(name), "disk.%s.rdrate", metrics->device);
+        houselinux_export_series (name, "r/s", HOUSE_DISKIO_SPAN,
+                                  metrics->timestamps, metrics->rdrate);
+        snprintf (name, sizeof(name), "disk.%s.rdwait", metrics->device);
+        houselinux_export_series (name, "ms", HOUSE_DISKIO_SPAN,
+                                  metrics->timestamps, metrics->rdwait);
+        snprintf (name, sizeof(name), "disk.%s.wrrate", metrics->device);
+        houselinux_export_series (name, "w/s", HOUSE_DISKIO_SPAN,
+                                  metrics->timestamps, metrics->wrrate);
+        snprintf (name, sizeof(name), "disk.%s.wrwait", metrics->device);
+        houselinux_export_series (name, "ms", HOUSE_DISKIO_SPAN,
+                                  metrics->timestamps, metrics->wrwait);
+    }
+}
+
 static void houselinux_diskio_stat (struct HouseDiskIOMetrics *latest,
                                     int index, time_t now) {
 
-    char buffer[1024];
-    FILE *f = fopen ("/proc/diskstats", "r");
-    if (!f) return;
+    char *cursor = houselinux_source_get (HouseDiskIOSource, now);
+    if (!cursor) return;
 
-    while (!feof (f)) {
-        char *line = fgets (buffer, sizeof(buffer), f);
-        if (!line) break;
+    long long clock = houselinux_source_clock (HouseDiskIOSource);
 
-        int i;
-        int major;
-        int minor;
+    char *line;
+    while ((line = houselinux_source_line (&cursor))) {
 
-        line = skipspace (line);
-        major = atoi (line);
-        line = skipvalue (line);
-        minor = atoi (line);
+        long long id[2];
+        if (houselinux_parse_numbers (&line, id, 2) < 2) continue;
 
-        int devindex = houselinux_diskio_find (major, minor);
+        int devindex = houselinux_diskio_find ((int)(id[0]), (int)(id[1]));
         if (devindex < 0) continue;
 
         long long value[17];
         struct HouseDiskIOMetrics *metrics = latest + devindex;
 
-        line = skipvalue (line); // ignore the device name, a constant.
-        for (i = 0; i < 8; ++i) { // WE DOE NOT USE ITEMS BEYOND 7 FOR NOW.
-            line = skipvalue (line);
-            value[i] = atoll (line);
+        line = houselinux_parse_skip (line); // ignore the device name, a constant.
+        memset (value, 0, sizeof(value));
+        // WE DOE NOT USE ITEMS BEYOND 7 FOR NOW.
+        houselinux_parse_numbers (&line, value, 8);
+
+        if (!metrics->baseline) { // Newly tracked device.
+            memcpy (metrics->previous, value, sizeof(metrics->previous));
+            metrics->previousclock = clock;
+            metrics->baseline = 1;
+            continue;
         }
 
+        // Use the actual interval between the two reads, in microseconds,
+        // as the background calls may be late. The rates are rounded, as
+        // published: /metrics/raw gives the exact counters and times.
+        long long elapsed = (clock - metrics->previousclock) / 1000;
+        if (elapsed <= 0) continue;
+
         // The values collected are:
         //  0: reads completed successfully
 		//  1: reads merged
@@ -340,7 +467,7 @@ static void houselinux_diskio_stat (struct HouseDiskIOMetrics *latest,
         // 16: time spent flushing
 
         long long count = value[0] - metrics->previous[0];
-        metrics->rdrate[index] = count / HOUSE_DISKIO_PERIOD;
+        metrics->rdrate[index] = (count * 1000000 + elapsed / 2) / elapsed;
 
         long long wait = value[3] - metrics->previous[3];
         if (count <= 0)
@@ -349,7 +476,7 @@ static void houselinux_diskio_stat (struct HouseDiskIOMetrics *latest,
             metrics->rdwait[index] = wait / count;
 
         count = value[4] - metrics->previous[4];
-        metrics->wrrate[index] = count / HOUSE_DISKIO_PERIOD;
+        metrics->wrrate[index] = (count * 1000000 + elapsed / 2) / elapsed;
 
         wait = value[7] - metrics->previous[7];
         if (count <= 0)
@@ -359,10 +486,20 @@ static void houselinux_diskio_stat (struct HouseDiskIOMetrics *latest,
 
         metrics->timestamps[index] = now;
 
+        char name[64];
+        snprintf (name, sizeof(name), "disk.%s.rdrate", metrics->device);
+        houselinux_sample (name, metrics->rdrate[index], "r/s", now);
+        snprintf (name, sizeof(name), "disk.%s.rdwait", metrics->device);
+        houselinux_sample (name, metrics->rdwait[index], "ms", now);
+        snprintf (name, sizeof(name), "disk.%s.wrrate", metrics->device);
+        houselinux_sample (name, metrics->wrrate[index], "w/s", now);
+        snprintf (name, sizeof(name), "disk.%s.wrwait", metrics->device);
+        houselinux_sample (name, metrics->wrwait[index], "ms", now);
+
         // Keep a baseline for next time.
         memcpy (metrics->previous, value, sizeof(metrics->previous));
+        metrics->previousclock = clock;
     }
-    fclose (f);
 }
 
 void houselinux_diskio_background (time_t now) {
@@ -25,4 +25,9 @@ void houselinux_diskio_background (time_t now);
 int houselinux_diskio_summary (char *buffer, int size);
 int houselinux_diskio_status (char *buffer, int size);
 int houselinux_diskio_details (char *buffer, int size, time_t now, time_t since);
+void houselinux_diskio_export (void);
+int houselinux_diskio_raw (char *buffer, int size);
 
+int houselinux_diskio_track (int major, int minor, const char *device);
+int houselinux_diskio_report (char *buffer, int size, int device,
+                              time_t now, time_t since);
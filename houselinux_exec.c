@@ -0,0 +1,501 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_exec.c - Collect metrics from external helper processes.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_exec_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Each -metrics-exec=COMMAND option declares
+ *    one helper.
+ *
+ * void houselinux_exec_background (time_t now);
+ *
+ *    The periodic function that manages the helpers and requests metrics.
+ *
+ * int houselinux_exec_summary (char *buffer, int size);
+ *
+ *    A function that populates a short summary of the external metrics.
+ *
+ * int houselinux_exec_status (char *buffer, int size);
+ *
+ *    A function that populates a status overview of the external metrics.
+ *
+ * int houselinux_exec_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    A function that populates a full detail report of the external metrics.
+ *
+ * void houselinux_exec_export (void);
+ *
+ *    List the recent history of the helper metrics for /metrics/export.
+ *
+ * PROTOCOL:
+ *
+ * A helper is started once and kept running. On each collection period,
+ * the line "sample TIMESTAMP" is written to the helper's standard input.
+ * The helper answers on its standard output by first echoing that same
+ * line, then one line per metric, formatted as "name value [unit]", and
+ * ends its answer with an empty line. The value must be an integer.
+ *
+ * The answer is read asynchronously from the echttp loop. An answer that
+ * is not complete after a few seconds is ignored, and a helper that
+ * misses too many requests in a row is restarted. The echoed timestamp
+ * identifies which request is answered: the lines of a late answer to an
+ * older request are discarded. The history slot of a request is cleared
+ * when the request is sent, so that a request without an answer leaves
+ * no value, rather than the value from 5 minutes earlier.
+ *
+ * A metric name belongs to the first helper that reported it: the same
+ * name reported by another helper is ignored, and an event is recorded.
+ *
+ * A helper is stopped using SIGTERM, followed by SIGKILL if it is still
+ * running after a few seconds. Every stopped helper process is tracked
+ * until it has been reaped.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_export.h"
+#include "houselinux_exec.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_EXEC_MAX      4
+#define HOUSE_EXEC_PERIOD   5 // Request metrics every 5 seconds.
+#define HOUSE_EXEC_SPAN    60 // MUST KEEP A 5 MINUTES HISTORY.
+#define HOUSE_EXEC_TIMEOUT  3 // Seconds before an answer is considered lost.
+#define HOUSE_EXEC_MISSED  12 // Restart a helper after 1 minute of silence.
+#define HOUSE_EXEC_RESTART 60 // Wait one minute before restarting a helper.
+#define HOUSE_EXEC_GRACE    5 // Seconds before a stopped helper is killed.
+
+#define HOUSE_EXEC_NAME    32
+#define HOUSE_EXEC_UNIT    16
+
+struct HouseExecMetrics {
+    char name[HOUSE_EXEC_NAME];
+    char unit[HOUSE_EXEC_UNIT];
+    int helper;   // The helper that owns this name.
+    int conflict; // Avoid repeating the same event.
+    time_t timestamps[HOUSE_EXEC_SPAN];
+    long long values[HOUSE_EXEC_SPAN];
+};
+
+static struct HouseExecMetrics *HouseExecLatest = 0;
+static int                      HouseExecLatestSize = 0;
+static int                      HouseExecLatestCount = 0;
+
+struct HouseExecHelper {
+    const char *command;
+    pid_t pid;
+    int input;          // The helper's standard input.
+    int output;         // The helper's standard output.
+    time_t restart;
+    time_t requested;   // 0 if no answer is pending.
+    time_t answering;   // The request being answered, 0 if none or stale.
+    int index;          // Where to store the pending answer.
+    int missed;
+    int received;
+    char buffer[1024];
+};
+
+static struct HouseExecHelper HouseExecHelpers[HOUSE_EXEC_MAX];
+static int                    HouseExecHelpersCount = 0;
+
+// The helper processes that were stopped, until they have been reaped.
+struct HouseExecStopped {
+    pid_t pid;
+    time_t deadline; // When to send SIGKILL, 0 if already sent.
+};
+
+static struct HouseExecStopped *HouseExecStoppedList = 0;
+static int                      HouseExecStoppedSize = 0;
+static int                      HouseExecStoppedCount = 0;
+
+
+// Return the metric with this name, or null if that name belongs
+// to another helper.
+//
+static struct HouseExecMetrics *houselinux_exec_find (int helper,
+                                                      const char *name,
+                                                      const char *unit) {
+    int i;
+    for (i = 0; i < HouseExecLatestCount; ++i) {
+        struct HouseExecMetrics *metrics = HouseExecLatest + i;
+        if (strcmp (metrics->name, name)) continue;
+        if (metrics->helper == helper) return metrics;
+        if (!metrics->conflict) {
+            houselog_event ("EXEC", HouseExecHelpers[helper].command,
+                            "DUPLICATE", "METRIC %s ALREADY FROM %s",
+                            name, HouseExecHelpers[metrics->helper].command);
+            metrics->conflict = 1;
+        }
+        return 0;
+    }
+
+    if (HouseExecLatestCount >= HouseExecLatestSize) {
+        HouseExecLatestSize += 16;
+        HouseExecLatest =
+            realloc (HouseExecLatest,
+                     HouseExecLatestSize*sizeof(struct HouseExecMetrics));
+    }
+    struct HouseExecMetrics *metrics = HouseExecLatest + HouseExecLatestCount;
+    memset (metrics, 0, sizeof(struct HouseExecMetrics));
+    strcpy (metrics->name, name); // Length already checked.
+    strcpy (metrics->unit, unit);
+    metrics->helper = helper;
+    HouseExecLatestCount += 1;
+    return metrics;
+}
+
+void houselinux_exec_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        const char *command = 0;
+        if (echttp_option_match ("-metrics-exec=", argv[i], &command)) {
+            if (HouseExecHelpersCount >= HOUSE_EXEC_MAX) {
+                houselog_trace (HOUSE_FAILURE, command, "too many helpers");
+                continue;
+            }
+            struct HouseExecHelper *helper =
+                HouseExecHelpers + HouseExecHelpersCount++;
+            helper->command = command;
+            helper->input = helper->output = -1;
+        }
+    }
+}
+
+static void houselinux_exec_stop (struct HouseExecHelper *helper,
+                                  time_t now, const char *reason) {
+
+    if (helper->pid <= 0) return;
+
+    echttp_forget (helper->output);
+    close (helper->output);
+    close (helper->input);
+    helper->input = helper->output = -1;
+
+    kill (helper->pid, SIGTERM);
+
+    // Reaped later, or killed if it ignores SIGTERM: see background.
+    if (HouseExecStoppedCount >= HouseExecStoppedSize) {
+        HouseExecStoppedSize += 4;
+        HouseExecStoppedList =
+            realloc (HouseExecStoppedList,
+                     HouseExecStoppedSize * sizeof(struct HouseExecStopped));
+    }
+    HouseExecStoppedList[HouseExecStoppedCount].pid = helper->pid;
+    HouseExecStoppedList[HouseExecStoppedCount].deadline =
+        now + HOUSE_EXEC_GRACE;
+    HouseExecStoppedCount += 1;
+    helper->pid = 0;
+
+    helper->requested = 0;
+    helper->answering = 0;
+    helper->received = 0;
+    helper->missed = 0;
+    helper->restart = now + HOUSE_EXEC_RESTART;
+
+    houselog_event ("EXEC", helper->command, "STOPPED", "%s", reason);
+}
+
+static void houselinux_exec_line (struct HouseExecHelper *helper, char *line) {
+
+    if (line[0] == 0) { // End of this answer.
+        if (helper->answering) {
+            helper->requested = 0;
+            helper->missed = 0;
+        }
+        helper->answering = 0;
+        return;
+    }
+    if (!strncmp (line, "sample ", 7)) { // Start of an answer.
+        time_t answered = (time_t) atoll (line + 7);
+        if (helper->requested && (answered == helper->requested))
+            helper->answering = answered;
+        else
+            helper->answering = 0; // Late answer, already given up.
+        return;
+    }
+    if (!helper->answering) return; // Not an answer to the pending request.
+
+    char *name = line;
+    char *value = strchr (name, ' ');
+    if (!value) return;
+    *(value++) = 0;
+    while (*value == ' ') value += 1;
+
+    const char *unit = "";
+    char *sep = strchr (value, ' ');
+    if (sep) {
+        *(sep++) = 0;
+        while (*sep == ' ') sep += 1;
+        unit = sep;
+    }
+
+    // These strings are copied as is to JSON: reject anything suspicious.
+    if (strpbrk (name, "\"\\") || strpbrk (unit, "\"\\")) return;
+    if ((strlen (name) >= HOUSE_EXEC_NAME) ||
+        (strlen (unit) >= HOUSE_EXEC_UNIT)) return;
+
+    struct HouseExecMetrics *metrics =
+        houselinux_exec_find (helper - HouseExecHelpers, name, unit);
+    if (!metrics) return;
+    metrics->values[helper->index] = atoll (value);
+    metrics->timestamps[helper->index] = helper->answering;
+
+    char series[HOUSE_EXEC_NAME + 8];
+    snprintf (series, sizeof(series), "exec.%.*s", HOUSE_EXEC_NAME, name);
+    houselinux_sample (series, metrics->values[helper->index],
+                       unit, helper->answering);
+}
+
+static void houselinux_exec_receive (int fd, int mode) {
+
+    int i;
+    for (i = 0; i < HouseExecHelpersCount; ++i) {
+        if (HouseExecHelpers[i].output == fd) break;
+    }
+    if (i >= HouseExecHelpersCount) return; // Not for us?
+    struct HouseExecHelper *helper = HouseExecHelpers + i;
+
+    int length = read (fd, helper->buffer + helper->received,
+                       sizeof(helper->buffer) - helper->received - 1);
+    if (length <= 0) {
+        if ((length < 0) && (errno == EAGAIN)) return;
+        houselinux_exec_stop (helper, time(0), "TERMINATED");
+        return;
+    }
+    helper->received += length;
+    helper->buffer[helper->received] = 0;
+
+    char *line = helper->buffer;
+    char *eol;
+    while ((eol = strchr (line, '\n'))) {
+        *eol = 0;
+        if ((eol > line) && (eol[-1] == '\r')) eol[-1] = 0;
+        houselinux_exec_line (helper, line);
+        line = eol + 1;
+    }
+
+    // Keep any incomplete line for later.
+    helper->received -= (line - helper->buffer);
+    if (helper->received >= sizeof(helper->buffer) - 1) {
+        helper->received = 0; // Line too long: ignore it.
+    } else if (helper->received > 0) {
+        memmove (helper->buffer, line, helper->received);
+    }
+}
+
+static void houselinux_exec_start (struct HouseExecHelper *helper, time_t now) {
+
+    int request[2];
+    int answer[2];
+
+    helper->restart = now + HOUSE_EXEC_RESTART; // In case of failure.
+
+    if (pipe2 (request, O_CLOEXEC)) return;
+    if (pipe2 (answer, O_CLOEXEC)) {
+        close (request[0]);
+        close (request[1]);
+        return;
+    }
+
+    pid_t pid = fork ();
+    if (pid < 0) {
+        houselog_trace (HOUSE_FAILURE, helper->command,
+                        "fork failed: %s", strerror(errno));
+        close (request[0]);
+        close (request[1]);
+        close (answer[0]);
+        close (answer[1]);
+        return;
+    }
+    if (pid == 0) {
+        dup2 (request[0], 0);
+        dup2 (answer[1], 1);
+        signal (SIGPIPE, SIG_DFL);
+        execl ("/bin/sh", "sh", "-c", helper->command, (char *)0);
+        _exit (127);
+    }
+    close (request[0]);
+    close (answer[1]);
+
+    helper->pid = pid;
+    helper->input = request[1];
+    helper->output = answer[0];
+    helper->requested = 0;
+    helper->received = 0;
+    helper->missed = 0;
+
+    // The daemon must never block on a slow helper.
+    fcntl (helper->input, F_SETFL, O_NONBLOCK);
+    fcntl (helper->output, F_SETFL, O_NONBLOCK);
+    echttp_listen (helper->output, 1, houselinux_exec_receive, 0);
+
+    DEBUG ("Started helper %s (pid %d)\n", helper->command, pid);
+    houselog_event ("EXEC", helper->command, "STARTED", "PID %d", pid);
+}
+
+static int houselinux_exec_report (char *buffer, int size,
+                                   time_t now, time_t since) {
+    int i;
+    int cursor = 0;
+
+    cursor = snprintf (buffer, size, ",\"exec\":");
+    if (cursor >= size) return 0;
+    int start = cursor;
+
+    for (i = 0; i < HouseExecLatestCount; ++i) {
+        struct HouseExecMetrics *metrics = HouseExecLatest + i;
+        if (now) {
+            cursor += houselinux_reduce_details_json
+                          (buffer+cursor, size-cursor, since,
+                           metrics->name, metrics->unit, now,
+                           HOUSE_EXEC_PERIOD, HOUSE_EXEC_SPAN,
+                           metrics->timestamps, metrics->values);
+        } else {
+            cursor += houselinux_reduce_recent_json
+                          (buffer+cursor, size-cursor, metrics->name,
+                           metrics->timestamps, metrics->values,
+                           HOUSE_EXEC_SPAN, metrics->unit);
+        }
+        if (cursor >= size) return 0;
+    }
+    if (cursor <= start) return 0; // No data to report.
+
+    buffer[start] = '{';
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+
+    return cursor;
+}
+
+int houselinux_exec_status (char *buffer, int size) {
+    return houselinux_exec_report (buffer, size, 0, 0);
+}
+
+int houselinux_exec_summary (char *buffer, int size) {
+    return houselinux_exec_status (buffer, size); // Already the shortest.
+}
+
+int houselinux_exec_details (char *buffer, int size, time_t now, time_t since) {
+    return houselinux_exec_report (buffer, size, now, since);
+}
+
+void houselinux_exec_export (void) {
+
+    int i;
+    for (i = 0; i < HouseExecLatestCount; ++i) {
+        struct HouseExecMetrics *metrics = HouseExecLatest + i;
+        char name[HOUSE_EXEC_NAME + 8];
+        snprintf (name, sizeof(name), "exec.%s", metrics->name);
+        houselinux_export_series (name, metrics->unit, HOUSE_EXEC_SPAN,
+                                  metrics->timestamps, metrics->values);
+    }
+}
+
+static void houselinux_exec_reap (time_t now) {
+
+    int i;
+    for (i = HouseExecStoppedCount - 1; i >= 0; --i) {
+        struct HouseExecStopped *stopped = HouseExecStoppedList + i;
+        if (waitpid (stopped->pid, 0, WNOHANG) != 0) {
+            *stopped = HouseExecStoppedList[--HouseExecStoppedCount];
+            continue;
+        }
+        if (stopped->deadline && (now >= stopped->deadline)) {
+            kill (stopped->pid, SIGKILL);
+            stopped->deadline = 0;
+        }
+    }
+}
+
+void houselinux_exec_background (time_t now) {
+
+    static time_t NextExecRequest = 0;
+
+    houselinux_exec_reap (now);
+
+    int i;
+    for (i = 0; i < HouseExecHelpersCount; ++i) {
+        struct HouseExecHelper *helper = HouseExecHelpers + i;
+
+        if (helper->pid <= 0) {
+            if (now >= helper->restart) houselinux_exec_start (helper, now);
+            continue;
+        }
+        if (helper->requested &&
+            (now >= helper->requested + HOUSE_EXEC_TIMEOUT)) {
+            helper->requested = 0; // Give up on this answer.
+            helper->answering = 0;
+            if (++helper->missed >= HOUSE_EXEC_MISSED)
+                houselinux_exec_stop (helper, now, "NOT RESPONDING");
+        }
+    }
+
+    if (now < NextExecRequest) return;
+    NextExecRequest = now + HOUSE_EXEC_PERIOD;
+
+    int index = (now / HOUSE_EXEC_PERIOD) % HOUSE_EXEC_SPAN;
+
+    // This slot is only valid once it has been filled by an answer.
+    for (i = 0; i < HouseExecLatestCount; ++i) {
+        HouseExecLatest[i].timestamps[index] = 0;
+        HouseExecLatest[i].values[index] = 0;
+    }
+
+    for (i = 0; i < HouseExecHelpersCount; ++i) {
+        struct HouseExecHelper *helper = HouseExecHelpers + i;
+        if (helper->pid <= 0) continue;
+        if (helper->requested) continue; // Still waiting.
+
+        char request[64];
+        int length = snprintf (request, sizeof(request),
+                               "sample %lld\n", (long long)now);
+        if (write (helper->input, request, length) != length) {
+            if (errno != EAGAIN) {
+                houselinux_exec_stop (helper, now, "BROKEN PIPE");
+            } else if (++helper->missed >= HOUSE_EXEC_MISSED) {
+                houselinux_exec_stop (helper, now, "NOT READING");
+            }
+            continue;
+        }
+        helper->requested = now;
+        helper->index = index;
+    }
+}
+
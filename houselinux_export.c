@@ -0,0 +1,260 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_export.c - Export the recent history of all series as a table.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_export_start (void);
+ *
+ *    Start a new export: forget the series listed in the previous one.
+ *
+ * void houselinux_export_series (const char *name, const char *unit,
+ *                                int count, const time_t *timestamps,
+ *                                const long long *values);
+ *
+ *    Add one series to the export. This is called by each collector's
+ *    _export function, with the history that the collector keeps for its
+ *    reports: the arrays are used as is, not copied, and must not change
+ *    until houselinux_export_csv() returns. A slot is only used if its
+ *    timestamp is within the last 5 minutes.
+ *
+ * int houselinux_export_csv (time_t now, int *size);
+ *
+ *    Write the history of the listed series as CSV to a memory file.
+ *    Return the file descriptor, positioned at the start of the data,
+ *    or -1 on failure. The caller owns the descriptor.
+ *
+ * The table has one row per sample time and one column per series, after
+ * the timestamp column. A cell is empty when that series had no sample at
+ * that time (the series have different sampling periods). The history
+ * covers the last 5 minutes, the same as the reports.
+ *
+ * The slots of each series are first sorted by time, so that the table
+ * is then generated in a single pass. The table is written to the memory
+ * file in chunks of 64 KB: the memory file holds the whole table until it
+ * has been transferred, but the daemon's own memory use does not depend
+ * on the size of the table.
+ */
+
+#define _GNU_SOURCE // For memfd_create.
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "houselinux_export.h"
+
+#define HOUSE_EXPORT_WINDOW 300 // Seconds.
+
+#define HOUSE_EXPORT_CHUNK 65536
+
+struct HouseExportColumn {
+    char name[128];
+    char unit[16];
+    int count;
+    const time_t *timestamps;
+    const long long *values;
+    int first;  // In HouseExportOrder.
+    int length; // Number of slots within the window.
+    int cursor; // Next slot to output, from first to first + length.
+};
+
+static struct HouseExportColumn *HouseExportColumns = 0;
+static int HouseExportColumnsCount = 0;
+static int HouseExportColumnsSize = 0;
+
+// The slots of all the series, in time order for each series.
+static int *HouseExportOrder = 0;
+static int HouseExportOrderSize = 0;
+
+
+void houselinux_export_start (void) {
+    HouseExportColumnsCount = 0;
+}
+
+void houselinux_export_series (const char *name, const char *unit,
+                               int count, const time_t *timestamps,
+                               const long long *values) {
+
+    if (HouseExportColumnsCount >= HouseExportColumnsSize) {
+        HouseExportColumnsSize += 64;
+        HouseExportColumns =
+            realloc (HouseExportColumns,
+                     HouseExportColumnsSize * sizeof(*HouseExportColumns));
+    }
+    struct HouseExportColumn *column =
+        HouseExportColumns + HouseExportColumnsCount++;
+    snprintf (column->name, sizeof(column->name), "%s", name);
+    snprintf (column->unit, sizeof(column->unit), "%s", unit);
+    column->count = count;
+    column->timestamps = timestamps;
+    column->values = values;
+}
+
+// List the slots of this series that are within the window, in time
+// order (simple insertion sort: the rings are already nearly sorted).
+// A slot with the same time as the previous one is ignored.
+//
+static void houselinux_export_sort (struct HouseExportColumn *column,
+                                    int first, time_t oldest, time_t now) {
+
+    int *order = HouseExportOrder + first;
+    int length = 0;
+    int i;
+    for (i = 0; i < column->count; ++i) {
+        time_t t = column->timestamps[i];
+        if ((t <= oldest) || (t > now)) continue;
+        int j = length;
+        while ((j > 0) && (column->timestamps[order[j-1]] > t)) j -= 1;
+        if ((j > 0) && (column->timestamps[order[j-1]] == t)) continue;
+        memmove (order + j + 1, order + j, (length - j) * sizeof(int));
+        order[j] = i;
+        length += 1;
+    }
+    column->first = first;
+    column->length = length;
+    column->cursor = first;
+}
+
+struct HouseExportOutput {
+    int fd;
+    int length;
+    int size;
+    int failed;
+    char buffer[HOUSE_EXPORT_CHUNK];
+};
+
+static void houselinux_export_flush (struct HouseExportOutput *out) {
+    if (out->length <= 0) return;
+    if (write (out->fd, out->buffer, out->length) != out->length)
+        out->failed = 1;
+    out->size += out->length;
+    out->length = 0;
+}
+
+static void houselinux_export_write (struct HouseExportOutput *out,
+                                     const char *format, ...)
+                                     __attribute__((format(printf, 2, 3)));
+
+static void houselinux_export_write (struct HouseExportOutput *out,
+                                     const char *format, ...) {
+    va_list args;
+    for (;;) {
+        va_start (args, format);
+        int available = sizeof(out->buffer) - out->length;
+        int length = vsnprintf (out->buffer + out->length,
+                                available, format, args);
+        va_end (args);
+        if (length < available) {
+            out->length += length;
+            return;
+        }
+        if (out->length == 0) return; // Too long for the buffer: skip.
+        houselinux_export_flush (out);
+    }
+}
+
+// A CSV header field, quoted in case the name contains a comma.
+//
+static void houselinux_export_name (struct HouseExportOutput *out,
+                                    const char *name, const char *unit) {
+    houselinux_export_write (out, ",\"");
+    for (; *name; ++name) {
+        if (*name == '"') houselinux_export_write (out, "\"\"");
+        else houselinux_export_write (out, "%c", *name);
+    }
+    if (unit[0]) houselinux_export_write (out, " (%s)", unit);
+    houselinux_export_write (out, "\"");
+}
+
+int houselinux_export_csv (time_t now, int *size) {
+
+    static struct HouseExportOutput Output;
+    static char Used[HOUSE_EXPORT_WINDOW + 1];
+
+    struct HouseExportOutput *out = &Output;
+    out->fd = memfd_create ("houselinux-export", MFD_CLOEXEC);
+    if (out->fd < 0) return -1;
+    out->length = out->size = out->failed = 0;
+
+    time_t oldest = now - HOUSE_EXPORT_WINDOW;
+    memset (Used, 0, sizeof(Used));
+
+    int i;
+    int total = 0;
+    for (i = 0; i < HouseExportColumnsCount; ++i)
+        total += HouseExportColumns[i].count;
+    if (total > HouseExportOrderSize) {
+        HouseExportOrderSize = total;
+        HouseExportOrder =
+            realloc (HouseExportOrder, total * sizeof(*HouseExportOrder));
+    }
+
+    // Sort the slots of each series, and find which times have a sample.
+    // A series without any sample in the window is not listed.
+    houselinux_export_write (out, "\"timestamp\"");
+    int first = 0;
+    for (i = 0; i < HouseExportColumnsCount; ++i) {
+        struct HouseExportColumn *column = HouseExportColumns + i;
+        houselinux_export_sort (column, first, oldest, now);
+        if (column->length <= 0) continue;
+        first += column->length;
+        houselinux_export_name (out, column->name, column->unit);
+        int j;
+        for (j = column->first; j < first; ++j)
+            Used[column->timestamps[HouseExportOrder[j]] - oldest] = 1;
+    }
+    houselinux_export_write (out, "\n");
+
+    // Each series' cursor only moves forward: one pass over the data.
+    int row;
+    for (row = 1; row <= HOUSE_EXPORT_WINDOW; ++row) {
+        if (!Used[row]) continue;
+        time_t t = oldest + row;
+        houselinux_export_write (out, "%lld", (long long)t);
+
+        for (i = 0; i < HouseExportColumnsCount; ++i) {
+            struct HouseExportColumn *column = HouseExportColumns + i;
+            if (column->length <= 0) continue;
+            int slot = -1;
+            if (column->cursor < column->first + column->length)
+                slot = HouseExportOrder[column->cursor];
+            if ((slot >= 0) && (column->timestamps[slot] == t)) {
+                houselinux_export_write (out, ",%lld", column->values[slot]);
+                column->cursor += 1;
+            } else {
+                houselinux_export_write (out, ",");
+            }
+        }
+        houselinux_export_write (out, "\n");
+    }
+    houselinux_export_flush (out);
+
+    if (out->failed || (lseek (out->fd, 0, SEEK_SET) < 0)) {
+        close (out->fd);
+        return -1;
+    }
+    *size = out->size;
+    return out->fd;
+}
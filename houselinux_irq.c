@@ -0,0 +1,520 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_irq.c - Collect interrupt distribution metrics.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_irq_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void houselinux_irq_background (time_t now);
+ *
+ *    The periodic function that manages the collect of metrics.
+ *
+ * int houselinux_irq_summary (char *buffer, int size);
+ *
+ *    A function that populates a short summary of the interrupts in JSON.
+ *
+ * int houselinux_irq_status (char *buffer, int size);
+ *
+ *    A function that populates a status overview of the interrupts in JSON.
+ *
+ * int houselinux_irq_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    A function that populates a full detail report of the interrupts
+ *    in JSON.
+ *
+ * void houselinux_irq_export (void);
+ *
+ *    List the recent history of the interrupts for /metrics/export.
+ *
+ * /proc/interrupts is a matrix of counters: one row per interrupt source,
+ * one column per online CPU. This module only needs the sum of each row
+ * (the rate of each interrupt) and the sum of each column (the rate of
+ * interrupts on each CPU), so the matrix itself is never stored.
+ *
+ * The layout of the file (the list of rows and the number of columns)
+ * is cached. On each sample, the row labels are only compared with
+ * the cached ones, and the layout is re-derived only if the set of
+ * interrupts or CPUs has changed. The interrupt names (extracted from the
+ * end of each row) are decoded only when the layout is re-derived.
+ *
+ * The ERR and MIS rows hold a single system-wide counter, not one counter
+ * per CPU: these are not included in any CPU's rate, and are reported
+ * separately as cumulative counts (errors and missed).
+ *
+ * The imbalance index is the highest per-CPU rate divided by the average
+ * rate, in percent: 100% means a perfect balance, while N x 100% (N being
+ * the number of CPUs) means that all interrupts go to the same CPU.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_source.h"
+#include "houselinux_parse.h"
+#include "houselinux_export.h"
+#include "houselinux_irq.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_IRQ_PERIOD    5 // Sample interrupts every 5 seconds.
+#define HOUSE_IRQ_SPAN     60 // MUST KEEP A 5 MINUTES HISTORY.
+#define HOUSE_IRQ_TOP       5 // How many interrupt sources are reported.
+
+struct HouseIrqRow {
+    char label[16];  // The text before the ':' (may be truncated).
+    int labellength; // The actual length of the label.
+    char name[48];   // The label and the device name, if any.
+    long long previous;
+    long long rate[HOUSE_IRQ_SPAN];
+    long long total; // Sum of the rates, used to find the top interrupts.
+};
+
+static struct HouseIrqRow *HouseIrqRows = 0;
+static long long *HouseIrqSums = 0; // The latest sum for each row.
+static int HouseIrqRowsCount = 0;
+static int HouseIrqRowsSize = 0;
+
+struct HouseIrqCpu {
+    int cpu;
+    long long current;
+    long long previous;
+    long long rate[HOUSE_IRQ_SPAN];
+};
+
+static struct HouseIrqCpu *HouseIrqCpus = 0;
+static int HouseIrqCpusCount = 0;
+
+static time_t HouseIrqTimestamps[HOUSE_IRQ_SPAN];
+static long long HouseIrqTotal[HOUSE_IRQ_SPAN];
+static long long HouseIrqImbalance[HOUSE_IRQ_SPAN];
+
+static long long HouseIrqErrors = -1; // ERR row, -1 if not present.
+static long long HouseIrqMissed = -1; // MIS row, -1 if not present.
+
+static int HouseIrqBaseline = 0; // Are the previous values valid?
+static struct timespec HouseIrqPrevious = {0, 0};
+
+static int HouseIrqSource = -1;
+
+
+void houselinux_irq_initialize (int argc, const char **argv) {
+    HouseIrqSource =
+        houselinux_source_register ("/proc/interrupts", HOUSE_IRQ_PERIOD);
+}
+
+// Parse up to count columns of decimal numbers, adding each value to
+// its CPU's current count. Return the sum of the values parsed, with
+// cursor pointing after the last column.
+//
+static long long houselinux_irq_columns (char **cursor, int count) {
+
+    long long sum = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        long long value;
+        if (!houselinux_parse_number (cursor, &value)) break; // Description.
+        HouseIrqCpus[i].current += value;
+        sum += value;
+    }
+    return sum;
+}
+
+// Return 1 if this row has a single system-wide counter (ERR, MIS).
+//
+static int houselinux_irq_single (const char *label, int length) {
+    if (length != 3) return 0;
+    return (!strncmp (label, "ERR", 3)) || (!strncmp (label, "MIS", 3));
+}
+
+// Decode the header line, i.e. the list of online CPUs.
+// Return 1 if the list of CPUs has changed.
+//
+static int houselinux_irq_header (const char *line) {
+
+    int count = 0;
+    int same = 1;
+    const char *p;
+    for (p = line; (p = strstr (p, "CPU")); p += 3) {
+        if ((count >= HouseIrqCpusCount)
+                || (HouseIrqCpus[count].cpu != atoi (p + 3))) same = 0;
+        count += 1;
+    }
+    if (same && (count == HouseIrqCpusCount)) return 0; // No change.
+
+    HouseIrqCpus = realloc (HouseIrqCpus, count * sizeof(struct HouseIrqCpu));
+    memset (HouseIrqCpus, 0, count * sizeof(struct HouseIrqCpu));
+    HouseIrqCpusCount = count;
+
+    count = 0;
+    for (p = line; (p = strstr (p, "CPU")); p += 3)
+        HouseIrqCpus[count++].cpu = atoi (p + 3);
+    DEBUG ("IRQ: %d CPUs\n", HouseIrqCpusCount);
+    return 1;
+}
+
+// Extract the name to report for this row: the interrupt number alone is
+// not meaningful, so the device name (last word of the line) is added.
+//
+static void houselinux_irq_name (struct HouseIrqRow *row,
+                                 const char *description) {
+
+    if (!isdigit (row->label[0])) {
+        snprintf (row->name, sizeof(row->name), "%s", row->label);
+        return;
+    }
+    const char *end = description + strlen (description);
+    while ((end > description) && isspace (end[-1])) end -= 1;
+    const char *start = end;
+    while ((start > description) && !isspace (start[-1])) start -= 1;
+
+    int length = end - start;
+    if (length > (int)sizeof(row->name) - 20) length = sizeof(row->name) - 20;
+    snprintf (row->name, sizeof(row->name), "%s:%.*s",
+              row->label, length, start);
+
+    char *s;
+    for (s = row->name; *s; ++s) {
+        if ((*s == '"') || (*s == '\\')) *s = '_';
+    }
+}
+
+static void houselinux_irq_layout (int row, const char *label, int length,
+                                   const char *description) {
+
+    if (row >= HouseIrqRowsSize) {
+        HouseIrqRowsSize += 64;
+        HouseIrqRows = realloc (HouseIrqRows,
+                                HouseIrqRowsSize * sizeof(struct HouseIrqRow));
+        HouseIrqSums = realloc (HouseIrqSums,
+                                HouseIrqRowsSize * sizeof(long long));
+    }
+    struct HouseIrqRow *r = HouseIrqRows + row;
+    memset (r, 0, sizeof(*r));
+    r->labellength = length;
+    if (length >= sizeof(r->label)) length = sizeof(r->label) - 1;
+    memcpy (r->label, label, length);
+    r->label[length] = 0;
+    houselinux_irq_name (r, description);
+}
+
+// Find the interrupts with the highest rates (simple insertion sort).
+//
+static int houselinux_irq_select (int *top) {
+
+    int count = 0;
+    int i;
+    for (i = 0; i < HouseIrqRowsCount; ++i) {
+        struct HouseIrqRow *r = HouseIrqRows + i;
+        if (houselinux_irq_single (r->label, r->labellength)) continue;
+        long long total = r->total;
+        if (total <= 0) continue;
+        int j = (count < HOUSE_IRQ_TOP) ? count++ : HOUSE_IRQ_TOP;
+        while ((j > 0) && (HouseIrqRows[top[j-1]].total < total)) {
+            if (j < HOUSE_IRQ_TOP) top[j] = top[j-1];
+            j -= 1;
+        }
+        if (j < HOUSE_IRQ_TOP) top[j] = i;
+    }
+    return count;
+}
+
+static int houselinux_irq_top (char *buffer, int size,
+                               time_t now, time_t since) {
+
+    int top[HOUSE_IRQ_TOP];
+    int i;
+
+    int count = houselinux_irq_select (top);
+    if (count <= 0) return 0;
+
+    int cursor = snprintf (buffer, size, ",\"top\":");
+    if (cursor >= size) return 0;
+    int start = cursor;
+    for (i = 0; i < count; ++i) {
+        struct HouseIrqRow *row = HouseIrqRows + top[i];
+        if (now) {
+            cursor += houselinux_reduce_details_json
+                          (buffer+cursor, size-cursor, since,
+                           row->name, "/s", now,
+                           HOUSE_IRQ_PERIOD, HOUSE_IRQ_SPAN,
+                           HouseIrqTimestamps, row->rate);
+        } else {
+            cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                     row->name,
+                                                     HouseIrqTimestamps,
+                                                     row->rate,
+                                                     HOUSE_IRQ_SPAN, "/s");
+        }
+        if (cursor >= size) return 0;
+    }
+    if (cursor == start) return 0;
+    buffer[start] = '{'; // Overwrite the ','.
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+static int houselinux_irq_cpus (char *buffer, int size,
+                                time_t now, time_t since) {
+
+    int cursor = snprintf (buffer, size, ",\"cpus\":");
+    if (cursor >= size) return 0;
+    int start = cursor;
+    int i;
+    for (i = 0; i < HouseIrqCpusCount; ++i) {
+        char name[16];
+        snprintf (name, sizeof(name), "cpu%d", HouseIrqCpus[i].cpu);
+        if (now) {
+            cursor += houselinux_reduce_details_json
+                          (buffer+cursor, size-cursor, since,
+                           name, "/s", now,
+                           HOUSE_IRQ_PERIOD, HOUSE_IRQ_SPAN,
+                           HouseIrqTimestamps, HouseIrqCpus[i].rate);
+        } else {
+            cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                     name,
+                                                     HouseIrqTimestamps,
+                                                     HouseIrqCpus[i].rate,
+                                                     HOUSE_IRQ_SPAN, "/s");
+        }
+        if (cursor >= size) return 0;
+    }
+    if (cursor == start) return 0;
+    buffer[start] = '{'; // Overwrite the ','.
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+static int houselinux_irq_report (char *buffer, int size,
+                                  time_t now, time_t since, int full) {
+
+    if (HouseIrqCpusCount <= 0) return 0;
+
+    int cursor = snprintf (buffer, size, ",\"irq\":");
+    if (cursor >= size) return 0;
+    int start = cursor;
+
+    if (now) {
+        cursor += houselinux_reduce_details_json
+                      (buffer+cursor, size-cursor, since,
+                       "rate", "/s", now, HOUSE_IRQ_PERIOD, HOUSE_IRQ_SPAN,
+                       HouseIrqTimestamps, HouseIrqTotal);
+        if (cursor >= size) return 0;
+        cursor += houselinux_reduce_details_json
+                      (buffer+cursor, size-cursor, since,
+                       "imbalance", "%", now, HOUSE_IRQ_PERIOD, HOUSE_IRQ_SPAN,
+                       HouseIrqTimestamps, HouseIrqImbalance);
+    } else {
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "rate",
+                                                 HouseIrqTimestamps,
+                                                 HouseIrqTotal,
+                                                 HOUSE_IRQ_SPAN, "/s");
+        if (cursor >= size) return 0;
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "imbalance",
+                                                 HouseIrqTimestamps,
+                                                 HouseIrqImbalance,
+                                                 HOUSE_IRQ_SPAN, "%");
+    }
+    if (cursor >= size) return 0;
+    if (cursor == start) return 0; // No data to report.
+
+    if (full) {
+        if (HouseIrqErrors >= 0) {
+            cursor += snprintf (buffer+cursor, size-cursor,
+                                ",\"errors\":[%lld,\"count\"]", HouseIrqErrors);
+            if (cursor >= size) return 0;
+        }
+        if (HouseIrqMissed >= 0) {
+            cursor += snprintf (buffer+cursor, size-cursor,
+                                ",\"missed\":[%lld,\"count\"]", HouseIrqMissed);
+            if (cursor >= size) return 0;
+        }
+        cursor += houselinux_irq_top (buffer+cursor, size-cursor, now, since);
+        if (cursor >= size) return 0;
+        cursor += houselinux_irq_cpus (buffer+cursor, size-cursor, now, since);
+        if (cursor >= size) return 0;
+    }
+    buffer[start] = '{'; // Overwrite the ','.
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+int houselinux_irq_summary (char *buffer, int size) {
+    return houselinux_irq_report (buffer, size, 0, 0, 0);
+}
+
+int houselinux_irq_status (char *buffer, int size) {
+    return houselinux_irq_report (buffer, size, 0, 0, 1);
+}
+
+int houselinux_irq_details (char *buffer, int size,
+                            time_t now, time_t since) {
+    return houselinux_irq_report (buffer, size, now, since, 1);
+}
+
+void houselinux_irq_export (void) {
+
+    if (HouseIrqCpusCount <= 0) return;
+
+    houselinux_export_series ("irq.rate", "/s", HOUSE_IRQ_SPAN,
+                              HouseIrqTimestamps, HouseIrqTotal);
+    houselinux_export_series ("irq.imbalance", "%", HOUSE_IRQ_SPAN,
+                              HouseIrqTimestamps, HouseIrqImbalance);
+
+    char name[80];
+    int top[HOUSE_IRQ_TOP];
+    int count = houselinux_irq_select (top);
+    int i;
+    for (i = 0; i < count; ++i) {
+        struct HouseIrqRow *row = HouseIrqRows + top[i];
+        snprintf (name, sizeof(name), "irq.top.%s", row->name);
+        houselinux_export_series (name, "/s", HOUSE_IRQ_SPAN,
+                                  HouseIrqTimestamps, row->rate);
+    }
+    for (i = 0; i < HouseIrqCpusCount; ++i) {
+        snprintf (name, sizeof(name), "irq.cpus.cpu%d", HouseIrqCpus[i].cpu);
+        houselinux_export_series (name, "/s", HOUSE_IRQ_SPAN,
+                                  HouseIrqTimestamps, HouseIrqCpus[i].rate);
+    }
+}
+
+static void houselinux_irq_sample (time_t now) {
+
+    char *cursor = houselinux_source_get (HouseIrqSource, now);
+    if (!cursor) return;
+
+    char *line = houselinux_source_line (&cursor);
+    if (!line) return;
+    if (houselinux_irq_header (line)) HouseIrqBaseline = 0;
+
+    int i;
+    for (i = 0; i < HouseIrqCpusCount; ++i) HouseIrqCpus[i].current = 0;
+
+    int row = 0;
+    int changed = !HouseIrqBaseline;
+
+    while ((line = houselinux_source_line (&cursor))) {
+        while (*line == ' ') line += 1;
+        char *colon = strchr (line, ':');
+        if (!colon) continue;
+        int length = colon - line;
+
+        if ((!changed) && ((row >= HouseIrqRowsCount)
+                || (length != HouseIrqRows[row].labellength)
+                || memcmp (line, HouseIrqRows[row].label,
+                           strlen (HouseIrqRows[row].label)))) {
+            DEBUG ("IRQ layout changed at row %d\n", row);
+            changed = 1;
+        }
+        char *p = colon + 1;
+        long long sum = 0;
+        if (houselinux_irq_single (line, length)) {
+            houselinux_parse_number (&p, &sum);
+            if (line[0] == 'E') HouseIrqErrors = sum;
+            else HouseIrqMissed = sum;
+        } else {
+            sum = houselinux_irq_columns (&p, HouseIrqCpusCount);
+        }
+        if (changed) houselinux_irq_layout (row, line, length, p);
+        HouseIrqSums[row++] = sum;
+    }
+    if (row != HouseIrqRowsCount) changed = 1;
+
+    struct timespec current;
+    clock_gettime (CLOCK_MONOTONIC, &current);
+    long long elapsed = // Milliseconds.
+        (current.tv_sec - HouseIrqPrevious.tv_sec) * 1000LL
+            + (current.tv_nsec - HouseIrqPrevious.tv_nsec) / 1000000;
+    HouseIrqPrevious = current;
+
+    if (changed) {
+        // The rows have been re-derived: restart with a new baseline.
+        // The history of the previous layout is not valid anymore.
+        memset (HouseIrqTimestamps, 0, sizeof(HouseIrqTimestamps));
+        HouseIrqRowsCount = row;
+        for (i = 0; i < HouseIrqRowsCount; ++i)
+            HouseIrqRows[i].previous = HouseIrqSums[i];
+        for (i = 0; i < HouseIrqCpusCount; ++i)
+            HouseIrqCpus[i].previous = HouseIrqCpus[i].current;
+        HouseIrqBaseline = 1;
+        return;
+    }
+    if (elapsed <= 0) return;
+
+    int index = (now / HOUSE_IRQ_PERIOD) % HOUSE_IRQ_SPAN;
+
+    for (i = 0; i < HouseIrqRowsCount; ++i) {
+        struct HouseIrqRow *r = HouseIrqRows + i;
+        long long delta = HouseIrqSums[i] - r->previous;
+        if (delta < 0) delta = 0;
+        r->total -= r->rate[index];
+        r->rate[index] = (delta * 1000 + elapsed / 2) / elapsed;
+        r->total += r->rate[index];
+        r->previous = HouseIrqSums[i];
+    }
+
+    long long total = 0;
+    long long highest = 0;
+    for (i = 0; i < HouseIrqCpusCount; ++i) {
+        struct HouseIrqCpu *c = HouseIrqCpus + i;
+        long long delta = c->current - c->previous;
+        if (delta < 0) delta = 0;
+        c->rate[index] = (delta * 1000 + elapsed / 2) / elapsed;
+        c->previous = c->current;
+        total += c->rate[index];
+        if (c->rate[index] > highest) highest = c->rate[index];
+    }
+    HouseIrqTotal[index] = total;
+    HouseIrqImbalance[index] =
+        (total > 0) ? (100 * highest * HouseIrqCpusCount) / total : 0;
+    HouseIrqTimestamps[index] = now;
+
+    houselinux_sample ("irq.rate", HouseIrqTotal[index], "/s", now);
+    houselinux_sample ("irq.imbalance", HouseIrqImbalance[index], "%", now);
+}
+
+void houselinux_irq_background (time_t now) {
+
+    static time_t NextIrqCollect = 0;
+
+    if (HouseIrqSource < 0) return;
+
+    if (now < NextIrqCollect) return;
+    NextIrqCollect = now + HOUSE_IRQ_PERIOD;
+
+    houselinux_irq_sample (now);
+}
+
@@ -40,6 +40,10 @@
  *
  * int houselinux_memory_details (char *buffer, int size, time_t now, time_t since);
  *    A function that populates a full detail report of the memory usage in JSON.
+ *
+ * void houselinux_memory_export (void);
+ *
+ *    List the recent history of the memory usage for /metrics/export.
  */
 
 #include <string.h>
@@ -59,6 +63,9 @@
 
 #include "houselog.h"
 #include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_source.h"
+#include "houselinux_export.h"
 #include "houselinux_memory.h"
 
 #define DEBUG if (echttp_isdebug()) printf
@@ -84,9 +91,12 @@ struct HouseMemoryMetrics {
 
 static struct HouseMemoryMetrics HouseMemoryLatest;
 
+static int HouseMemorySource = -1;
+
 
 void houselinux_memory_initialize (int argc, const char **argv) {
-    // TBD
+    HouseMemorySource =
+        houselinux_source_register ("/proc/meminfo", HOUSE_MEMORY_PERIOD);
 }
 
 int houselinux_memory_summary (char *buffer, int size) {
@@ -103,25 +113,31 @@ int houselinux_memory_summary (char *buffer, int size) {
     houselinux_reduce_percentage (HouseMemoryLatest.memtotal, HOUSE_MEMORY_SPAN,
                                   HouseMemoryLatest.memavailable, percentage);
 
-    cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                      "available", percentage,
-                                      HOUSE_MEMORY_SPAN, "%");
+    cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                             "available",
+                                             HouseMemoryLatest.timestamps,
+                                             percentage,
+                                             HOUSE_MEMORY_SPAN, "%");
 
     houselinux_reduce_percentage (HouseMemoryLatest.memtotal, HOUSE_MEMORY_SPAN,
                                   HouseMemoryLatest.memdirty, percentage);
 
-    cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                      "dirty", percentage,
-                                      HOUSE_MEMORY_SPAN, "%");
+    cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                             "dirty",
+                                             HouseMemoryLatest.timestamps,
+                                             percentage,
+                                             HOUSE_MEMORY_SPAN, "%");
 
     if (HouseMemoryLatest.swaptotal > 0) {
         houselinux_reduce_percentage (HouseMemoryLatest.swaptotal,
                                       HOUSE_MEMORY_SPAN,
                                       HouseMemoryLatest.swapped, percentage);
 
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "swapped", percentage,
-                                          HOUSE_MEMORY_SPAN, "%");
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "swapped",
+                                                 HouseMemoryLatest.timestamps,
+                                                 percentage,
+                                                 HOUSE_MEMORY_SPAN, "%");
         if (cursor >= size) return 0;
     }
     buffer[start] = '{'; // Overwrite the first ','.
@@ -141,15 +157,17 @@ int houselinux_memory_status (char *buffer, int size) {
                        HouseMemoryLatest.memtotal);
     if (cursor >= size) return 0;
 
-    cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                      "available",
-                                      HouseMemoryLatest.memavailable,
-                                      HOUSE_MEMORY_SPAN, "MB");
+    cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                             "available",
+                                             HouseMemoryLatest.timestamps,
+                                             HouseMemoryLatest.memavailable,
+                                             HOUSE_MEMORY_SPAN, "MB");
 
-    cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                      "dirty",
-                                      HouseMemoryLatest.memdirty,
-                                      HOUSE_MEMORY_SPAN, "MB");
+    cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                             "dirty",
+                                             HouseMemoryLatest.timestamps,
+                                             HouseMemoryLatest.memdirty,
+                                             HOUSE_MEMORY_SPAN, "MB");
 
     if (HouseMemoryLatest.swaptotal > 0) {
         cursor += snprintf (buffer+cursor, size-cursor,
@@ -157,10 +175,11 @@ int houselinux_memory_status (char *buffer, int size) {
                             HouseMemoryLatest.swaptotal);
         if (cursor >= size) return 0;
 
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "swapped",
-                                          HouseMemoryLatest.swapped,
-                                          HOUSE_MEMORY_SPAN, "MB");
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "swapped",
+                                                 HouseMemoryLatest.timestamps,
+                                                 HouseMemoryLatest.swapped,
+                                                 HOUSE_MEMORY_SPAN, "MB");
         if (cursor >= size) return 0;
     }
     cursor += snprintf (buffer+cursor, size-cursor, "}");
@@ -211,21 +230,37 @@ int houselinux_memory_details (char *buffer, int size,
     return cursor;
 }
 
-static void houselinux_memory_meminfo (struct HouseMemoryMetrics *latest, int index) {
+void houselinux_memory_export (void) {
+
+    if (HouseMemoryLatest.memtotal <= 0) return;
+
+    houselinux_export_series ("memory.available", "MB", HOUSE_MEMORY_SPAN,
+                              HouseMemoryLatest.timestamps,
+                              HouseMemoryLatest.memavailable);
+    houselinux_export_series ("memory.dirty", "MB", HOUSE_MEMORY_SPAN,
+                              HouseMemoryLatest.timestamps,
+                              HouseMemoryLatest.memdirty);
+    if (HouseMemoryLatest.swaptotal > 0) {
+        houselinux_export_series ("memory.swapped", "MB", HOUSE_MEMORY_SPAN,
+                                  HouseMemoryLatest.timestamps,
+                                  HouseMemoryLatest.swapped);
+    }
+}
+
+static void houselinux_memory_meminfo (struct HouseMemoryMetrics *latest,
+                                       int index, time_t now) {
 
     // First reset all the metrics, in case these are not accessible;
     latest->memavailable[index] = latest->memdirty[index] = 0;
     latest->swaptotal = latest->swapped[index] = 0;
 
-    char buffer[80];
-    FILE *f = fopen ("/proc/meminfo", "r");
-    if (!f) return;
+    char *cursor = houselinux_source_get (HouseMemorySource, now);
+    if (!cursor) return;
 
     long long swapfree = 0;
 
-    while (!feof (f)) {
-        char *line = fgets (buffer, sizeof(buffer), f);
-        if (!line) break;
+    char *line;
+    while ((line = houselinux_source_line (&cursor))) {
 
         // This is an accelerator, checking if the 2nd character matches
         // anything of interest. UPDATE THE STRINGS IF NEW ITEMS ARE RECOVERED.
@@ -265,7 +300,9 @@ static void houselinux_memory_meminfo (struct HouseMemoryMetrics *latest, int in
     if (latest->swaptotal > 0)
         latest->swapped[index] = latest->swaptotal - swapfree;
 
-    fclose (f);
+    houselinux_sample ("memory.available", latest->memavailable[index], "MB", now);
+    houselinux_sample ("memory.dirty", latest->memdirty[index], "MB", now);
+    houselinux_sample ("memory.swapped", latest->swapped[index], "MB", now);
 }
 
 void houselinux_memory_background (time_t now) {
@@ -277,7 +314,7 @@ void houselinux_memory_background (time_t now) {
 
     int index = (now / HOUSE_MEMORY_PERIOD) % HOUSE_MEMORY_SPAN;
 
-    houselinux_memory_meminfo (&HouseMemoryLatest, index);
+    houselinux_memory_meminfo (&HouseMemoryLatest, index, now);
     HouseMemoryLatest.timestamps[index] = now;
 }
 
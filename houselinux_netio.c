@@ -40,6 +40,15 @@
  * int houselinux_netio_details (char *buffer, int size, time_t now, time_t since);
  *
  *    A function that populates a detailed report of the network IO in JSON.
+ *
+ * void houselinux_netio_export (void);
+ *
+ *    List the recent history of the network I/O for /metrics/export.
+ *
+ * int houselinux_netio_raw (char *buffer, int size);
+ *
+ *    A function that populates the latest raw cumulative counters in JSON,
+ *    with the CLOCK_MONOTONIC time (nanoseconds) when these were sampled.
  */
 
 #include <string.h>
@@ -51,6 +60,10 @@
 
 #include "houselog.h"
 #include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_source.h"
+#include "houselinux_parse.h"
+#include "houselinux_export.h"
 #include "houselinux_netio.h"
 
 #define HOUSE_NETIO_PERIOD  5 // Sample CPU metrics every 5 seconds.
@@ -62,12 +75,15 @@ struct HouseNetIOMetrics {
     long long rxrate[HOUSE_NETIO_SPAN];
     long long txrate[HOUSE_NETIO_SPAN];
     long long previous[16];
+    long long previousclock; // CLOCK_MONOTONIC, nanoseconds.
 };
 
 static struct HouseNetIOMetrics *HouseNetIOLatest = 0;
 static int                        HouseNetIOLatestSize = 0;
 static int                        HouseNetIOLatestCount = 0;
 
+static int HouseNetIOSource = -1;
+
 
 static int houselinux_netio_find (const char *device) {
     int i;
@@ -85,45 +101,37 @@ static int houselinux_netio_add (const char *device) {
             realloc (HouseNetIOLatest,
                      HouseNetIOLatestSize*sizeof(struct HouseNetIOMetrics));
     }
+    memset (HouseNetIOLatest + HouseNetIOLatestCount, 0,
+            sizeof(struct HouseNetIOMetrics));
     snprintf (HouseNetIOLatest[HouseNetIOLatestCount].device,
               sizeof(HouseNetIOLatest[0].device), "%s", device);
 
     return HouseNetIOLatestCount++;
 }
 
-static char *skipspace (char *line) {
-    while (*line == ' ') line += 1;
-    return line;
-}
-
-static char *skipvalue (char *line) {
-    while (*line > ' ') line += 1;
-    return skipspace (line);
-}
-
 void houselinux_netio_initialize (int argc, const char **argv) {
 
     // Allocate enough space for the net devices present on this machine
     // and set the initial "previous" values.
 
-    char buffer[1024];
-    FILE *f = fopen ("/proc/net/dev", "r");
-    if (!f) return;
+    HouseNetIOSource =
+        houselinux_source_register ("/proc/net/dev", HOUSE_NETIO_PERIOD);
+
+    char *cursor = houselinux_source_get (HouseNetIOSource, time(0));
+    if (!cursor) return;
 
     // Ignore the first two lines (titles)
     //
-    fgets (buffer, sizeof(buffer), f);
-    fgets (buffer, sizeof(buffer), f);
+    houselinux_source_line (&cursor);
+    houselinux_source_line (&cursor);
 
-    while (!feof (f)) {
-        char *line = fgets (buffer, sizeof(buffer), f);
-        if (!line) break;
+    char *line;
+    while ((line = houselinux_source_line (&cursor))) {
 
-        int i;
         char *device;
         long long value[16];
 
-        line = skipspace (line);
+        while (*line == ' ') line += 1;
         device = line;
         char *sep = strchr (line, ':');
         if (!sep) continue;
@@ -131,16 +139,41 @@ void houselinux_netio_initialize (int argc, const char **argv) {
         if (!strcmp (device, "lo")) continue; // Ignore the loopback.
 
         line = sep + 1;
-        for (i = 0; i < 16; ++i) {
-            line = skipvalue (line);
-            value[i] = atoll (line);
-        }
+        memset (value, 0, sizeof(value));
+        houselinux_parse_numbers (&line, value, 16);
 
         int index = houselinux_netio_add (device);
         struct HouseNetIOMetrics *metrics = HouseNetIOLatest + index;
         memcpy (metrics->previous, value, sizeof(metrics->previous));
+        metrics->previousclock = houselinux_source_clock (HouseNetIOSource);
     }
-    fclose (f);
+}
+
+int houselinux_netio_raw (char *buffer, int size) {
+
+    int i;
+    const char *sep = "";
+
+    int cursor = snprintf (buffer, size, ",\"net\":{");
+    if (cursor >= size) return 0;
+    int start = cursor;
+
+    for (i = 0; i < HouseNetIOLatestCount; ++i) {
+        struct HouseNetIOMetrics *metrics = HouseNetIOLatest + i;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s\"%s\":{\"clock\":%lld,"
+                                "\"rxbytes\":%lld,\"rxpackets\":%lld,"
+                                "\"txbytes\":%lld,\"txpackets\":%lld}",
+                            sep, metrics->device, metrics->previousclock,
+                            metrics->previous[0], metrics->previous[1],
+                            metrics->previous[8], metrics->previous[9]);
+        if (cursor >= size) return 0;
+        sep = ",";
+    }
+    if (cursor == start) return 0; // No device to report.
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
 }
 
 int houselinux_netio_status (char *buffer, int size) {
@@ -163,16 +196,18 @@ int houselinux_netio_status (char *buffer, int size) {
         if (cursor >= size) break;
         int startmetrics = cursor;
 
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "rxrate",
-                                          HouseNetIOLatest[i].rxrate,
-                                          HOUSE_NETIO_SPAN, "KB/s");
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "rxrate",
+                                                 HouseNetIOLatest[i].timestamps,
+                                                 HouseNetIOLatest[i].rxrate,
+                                                 HOUSE_NETIO_SPAN, "KB/s");
         if (cursor >= size) break;
 
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "txrate",
-                                          HouseNetIOLatest[i].txrate,
-                                          HOUSE_NETIO_SPAN, "KB/s");
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "txrate",
+                                                 HouseNetIOLatest[i].timestamps,
+                                                 HouseNetIOLatest[i].txrate,
+                                                 HOUSE_NETIO_SPAN, "KB/s");
         if (cursor >= size) break;
 
         if (cursor == startmetrics) {
@@ -240,25 +275,38 @@ int houselinux_netio_details (char *buffer, int size,
     return cursor;
 }
 
+void houselinux_netio_export (void) {
+
+    int i;
+    for (i = 0; i < HouseNetIOLatestCount; ++i) {
+        struct HouseNetIOMetrics *metrics = HouseNetIOLatest + i;
+        char name[64];
+        snprintf (name, sizeof(name), "net.%s.rxrate", metrics->device);
+        houselinux_export_series (name, "KB/s", HOUSE_NETIO_SPAN,
+                                  metrics->timestamps, metrics->rxrate);
+        snprintf (name, sizeof(name), "net.%s.txrate", metrics->device);
+        houselinux_export_series (name, "KB/s", HOUSE_NETIO_SPAN,
+                                  metrics->timestamps, metrics->txrate);
+    }
+}
+
 static void houselinux_netio_stat (struct HouseNetIOMetrics *latest,
                                    int index, time_t now) {
 
-    char buffer[1024];
-    FILE *f = fopen ("/proc/net/dev", "r");
-    if (!f) return;
+    char *cursor = houselinux_source_get (HouseNetIOSource, now);
+    if (!cursor) return;
 
     // Ignore the first two lines (titles)
     //
-    fgets (buffer, sizeof(buffer), f);
-    fgets (buffer, sizeof(buffer), f);
+    houselinux_source_line (&cursor);
+    houselinux_source_line (&cursor);
 
-    while (!feof (f)) {
-        char *line = fgets (buffer, sizeof(buffer), f);
-        if (!line) break;
+    long long clock = houselinux_source_clock (HouseNetIOSource);
 
-        int i;
+    char *line;
+    while ((line = houselinux_source_line (&cursor))) {
 
-        line = skipspace (line);
+        while (*line == ' ') line += 1;
         char *device = line;
         char *sep = strchr (line, ':');
         if (!sep) continue;
@@ -271,10 +319,9 @@ static void houselinux_netio_stat (struct HouseNetIOMetrics *latest,
         struct HouseNetIOMetrics *metrics = latest + devindex;
 
         line = sep + 1;
-        for (i = 0; i < 9; ++i) { // WE DOE NOT USE ITEMS BEYOND 8 FOR NOW.
-            line = skipvalue (line);
-            value[i] = atoll (line);
-        }
+        memset (value, 0, sizeof(value));
+        // WE DOE NOT USE ITEMS BEYOND 9 FOR NOW.
+        houselinux_parse_numbers (&line, value, 10);
 
         // The values collected are:
         //  0: Received bytes
@@ -294,18 +341,32 @@ static void houselinux_netio_stat (struct HouseNetIOMetrics *latest,
         // 14: Carrier (failures?)
         // 15: Transmit compressed(?)
 
+        // Use the actual interval between the two reads, in microseconds,
+        // as the background calls may be late. The rates are rounded, as
+        // published: /metrics/raw gives the exact counters and times.
+        long long elapsed = (clock - metrics->previousclock) / 1000;
+        if (elapsed <= 0) continue;
+
         long long count = value[0] - metrics->previous[0];
-        metrics->rxrate[index] = (count / 1024) / HOUSE_NETIO_PERIOD;
+        metrics->rxrate[index] =
+            (count * 1000000 + elapsed * 512) / (elapsed * 1024);
 
         count = value[8] - metrics->previous[8];
-        metrics->txrate[index] = (count / 1024) / HOUSE_NETIO_PERIOD;
+        metrics->txrate[index] =
+            (count * 1000000 + elapsed * 512) / (elapsed * 1024);
 
         metrics->timestamps[index] = now;
 
+        char name[64];
+        snprintf (name, sizeof(name), "net.%s.rxrate", metrics->device);
+        houselinux_sample (name, metrics->rxrate[index], "KB/s", now);
+        snprintf (name, sizeof(name), "net.%s.txrate", metrics->device);
+        houselinux_sample (name, metrics->txrate[index], "KB/s", now);
+
         // Keep a baseline for next time.
         memcpy (metrics->previous, value, sizeof(metrics->previous));
+        metrics->previousclock = clock;
     }
-    fclose (f);
 }
 
 void houselinux_netio_background (time_t now) {
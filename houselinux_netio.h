@@ -25,4 +25,6 @@ void houselinux_netio_background (time_t now);
 int houselinux_netio_summary (char *buffer, int size);
 int houselinux_netio_status (char *buffer, int size);
 int houselinux_netio_details (char *buffer, int size, time_t now, time_t since);
+void houselinux_netio_export (void);
+int houselinux_netio_raw (char *buffer, int size);
 
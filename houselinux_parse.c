@@ -0,0 +1,162 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_parse.c - Decode the fields of /proc files.
+ *
+ * SYNOPSYS:
+ *
+ * char *houselinux_parse_skip (char *cursor);
+ *
+ *    Skip the current field and the spaces that follow. Return a pointer
+ *    to the next field, or to the end of the line.
+ *
+ * int houselinux_parse_number (char **cursor, long long *value);
+ *
+ *    Skip spaces and decode the decimal integer field that follows.
+ *    Return 1 and move the cursor to the next field on success. If the
+ *    field is not a number, return 0 and leave the cursor on that field.
+ *
+ * int houselinux_parse_numbers (char **cursor, long long *values, int count);
+ *
+ *    Decode up to count consecutive decimal integer fields. Return the
+ *    number of fields decoded, with the cursor on the first field that
+ *    was not decoded.
+ *
+ * The fields are separated by spaces or tabs. The digits are decoded
+ * eight at a time, using 64 bit integer operations (SWAR: SIMD Within
+ * A Register). This requires that up to 7 bytes past the end of the
+ * string are readable: the buffers of the source module are padded for
+ * that purpose (HOUSE_SOURCE_PADDING). On big endian hosts, or if built
+ * with -DHOUSE_PARSE_SCALAR, a plain loop is used instead.
+ *
+ * "make test" checks both versions against atoll(), and "make bench"
+ * compares them with the previous atoll() based loops on a generated
+ * /proc/diskstats with 1000 devices (see the tools directory).
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "houselinux_parse.h"
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#ifndef HOUSE_PARSE_SCALAR
+#define HOUSE_PARSE_SWAR 1
+#endif
+#endif
+
+#define HOUSE_PARSE_ONES  0x0101010101010101ULL
+#define HOUSE_PARSE_HIGHS 0x8080808080808080ULL
+
+static inline int houselinux_parse_space (char c) {
+    return (c == ' ') || (c == '\t');
+}
+
+#ifdef HOUSE_PARSE_SWAR
+// Return how many of the 8 characters (0 to 8) are digits, starting
+// from the first one (the lowest byte).
+//
+static inline int houselinux_parse_digits (uint64_t chunk) {
+
+    // A byte is a digit if its high nibble is 3 and its low nibble is
+    // less than 10, i.e. adding 6 does not change the high nibble.
+    // A carry from one byte only affects the bytes after it, and
+    // these do not matter once a non digit was found.
+    uint64_t bad = ((chunk & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL)
+                 | (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL)
+                        ^ 0x3030303030303030ULL);
+
+    // Set the high bit of each byte that is not zero.
+    bad = (((bad & ~HOUSE_PARSE_HIGHS) + ~HOUSE_PARSE_HIGHS) | bad)
+              & HOUSE_PARSE_HIGHS;
+    if (!bad) return 8;
+    return __builtin_ctzll (bad) / 8;
+}
+
+// Convert 8 digit characters to their value (Lemire, 2022).
+// The unused leading characters must be 0 or '0'.
+//
+static inline uint64_t houselinux_parse_eight (uint64_t chunk) {
+    chunk = ((chunk & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    chunk = ((chunk & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    return ((chunk & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
+#endif
+
+char *houselinux_parse_skip (char *cursor) {
+    while (*cursor && (*cursor != '\n') && !houselinux_parse_space (*cursor))
+        cursor += 1;
+    while (houselinux_parse_space (*cursor)) cursor += 1;
+    return cursor;
+}
+
+int houselinux_parse_number (char **cursor, long long *value) {
+
+    const char *p = *cursor;
+    while (houselinux_parse_space (*p)) p += 1;
+
+    int negative = (*p == '-');
+    if (negative) p += 1;
+    if ((unsigned int)(*p - '0') > 9) {
+        *cursor = (char *)p - negative;
+        return 0;
+    }
+
+    unsigned long long result = 0;
+
+#ifdef HOUSE_PARSE_SWAR
+    for (;;) {
+        uint64_t chunk;
+        memcpy (&chunk, p, sizeof(chunk));
+        int count = houselinux_parse_digits (chunk);
+        if (count == 8) {
+            result = (result * 100000000) + houselinux_parse_eight (chunk);
+            p += 8;
+            continue;
+        }
+        if (count > 0) {
+            // Move the digits to the end of the chunk, zeroes first.
+            chunk <<= (8 - count) * 8;
+            static const unsigned long long Scale[8] =
+                {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000};
+            result = (result * Scale[count]) + houselinux_parse_eight (chunk);
+            p += count;
+        }
+        break;
+    }
+#else
+    unsigned int digit = (unsigned int)(*p - '0');
+    do {
+        result = (result * 10) + digit;
+        digit = (unsigned int)(*(++p) - '0');
+    } while (digit <= 9);
+#endif
+
+    *value = negative ? -(long long)result : (long long)result;
+    *cursor = houselinux_parse_skip ((char *)p);
+    return 1;
+}
+
+int houselinux_parse_numbers (char **cursor, long long *values, int count) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (!houselinux_parse_number (cursor, values + i)) break;
+    }
+    return i;
+}
@@ -0,0 +1,328 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_perf.c - Collect kernel software event counters.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_perf_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. This collector is only enabled when
+ *    the -metrics-perf option is present.
+ *
+ * void houselinux_perf_background (time_t now);
+ *
+ *    The periodic function that manages the collect of metrics.
+ *
+ * int houselinux_perf_summary (char *buffer, int size);
+ *
+ *    A function that populates a short summary of the counters in JSON.
+ *
+ * int houselinux_perf_status (char *buffer, int size);
+ *
+ *    A function that populates a status overview of the counters in JSON.
+ *
+ * int houselinux_perf_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    A function that populates a full detail report of the counters in JSON.
+ *
+ * void houselinux_perf_export (void);
+ *
+ *    List the recent history of the scheduler events for /metrics/export.
+ *
+ * The counters are kernel software events (no hardware PMU is needed, so
+ * this works in a VM): context switches, CPU migrations and major page
+ * faults. One group of counters is opened per CPU, system wide, and each
+ * group is read using a single read() call. If a group cannot be read,
+ * the sample is skipped and the previous counters are kept, so that the
+ * next sample covers both periods. A group that fails 3 times in a row
+ * (e.g. its CPU went offline) is closed, and a new baseline is taken.
+ *
+ * System wide counters require either root privileges, CAP_PERFMON, or
+ * a permissive kernel.perf_event_paranoid setting (0 or less). If access
+ * is denied, this collector disables itself.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_export.h"
+#include "houselinux_perf.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_PERF_PERIOD    5 // Sample the counters every 5 seconds.
+#define HOUSE_PERF_SPAN     60 // MUST KEEP A 5 MINUTES HISTORY.
+#define HOUSE_PERF_FAILURES  3 // Consecutive read failures before closing.
+
+// The events in each group. The first one is the group leader.
+//
+static const struct {
+    int config;
+    const char *name;
+} HousePerfEvents[] = {
+    {PERF_COUNT_SW_CONTEXT_SWITCHES, "cswitch"},
+    {PERF_COUNT_SW_CPU_MIGRATIONS,   "migration"},
+    {PERF_COUNT_SW_PAGE_FAULTS_MAJ,  "majflt"}
+};
+#define HOUSE_PERF_EVENTS (sizeof(HousePerfEvents)/sizeof(HousePerfEvents[0]))
+
+struct HousePerfGroup {
+    int fd[HOUSE_PERF_EVENTS];
+    int failures;
+};
+
+static struct HousePerfGroup *HousePerfGroups = 0;
+static int HousePerfGroupsCount = 0;
+
+static long long HousePerfPrevious[HOUSE_PERF_EVENTS];
+static struct timespec HousePerfPreviousTime = {0, 0};
+
+static time_t HousePerfTimestamps[HOUSE_PERF_SPAN];
+static long long HousePerfRates[HOUSE_PERF_EVENTS][HOUSE_PERF_SPAN];
+
+
+static int houselinux_perf_open (int config, int cpu, int group) {
+
+    struct perf_event_attr attr;
+    memset (&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = (group < 0); // Only the leader: the group starts at once.
+
+    return syscall (__NR_perf_event_open, &attr, -1, cpu, group,
+                    PERF_FLAG_FD_CLOEXEC);
+}
+
+static void houselinux_perf_close (struct HousePerfGroup *group) {
+    int e;
+    for (e = HOUSE_PERF_EVENTS - 1; e >= 0; --e) {
+        if (group->fd[e] >= 0) close (group->fd[e]);
+        group->fd[e] = -1;
+    }
+}
+
+// Open the group of counters for the specified CPU. Return 0 on success,
+// or the errno value on failure.
+//
+static int houselinux_perf_group (struct HousePerfGroup *group, int cpu) {
+
+    int e;
+    for (e = 0; e < HOUSE_PERF_EVENTS; ++e) group->fd[e] = -1;
+
+    for (e = 0; e < HOUSE_PERF_EVENTS; ++e) {
+        group->fd[e] = houselinux_perf_open (HousePerfEvents[e].config,
+                                             cpu, group->fd[0]);
+        if (group->fd[e] < 0) {
+            int error = errno;
+            houselinux_perf_close (group);
+            return error;
+        }
+    }
+    ioctl (group->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+}
+
+static int houselinux_perf_paranoid (void) {
+    int level = 2; // Default on most distributions.
+    FILE *f = fopen ("/proc/sys/kernel/perf_event_paranoid", "r");
+    if (f) {
+        if (fscanf (f, "%d", &level) != 1) level = 2;
+        fclose (f);
+    }
+    return level;
+}
+
+void houselinux_perf_initialize (int argc, const char **argv) {
+
+    int i;
+    int enabled = 0;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-metrics-perf", argv[i])) enabled = 1;
+    }
+    if (!enabled) return;
+
+    int cpus = sysconf (_SC_NPROCESSORS_CONF);
+    if (cpus <= 0) return;
+    HousePerfGroups = calloc (cpus, sizeof(struct HousePerfGroup));
+
+    int cpu;
+    for (cpu = 0; cpu < cpus; ++cpu) {
+        int error = houselinux_perf_group (HousePerfGroups + HousePerfGroupsCount, cpu);
+        if (!error) {
+            HousePerfGroupsCount += 1;
+            continue;
+        }
+        if (error == ENODEV) continue; // This CPU is offline.
+
+        // Any other error is considered permanent: disable everything.
+        if ((error == EACCES) || (error == EPERM)) {
+            houselog_trace (HOUSE_WARNING, "perf",
+                            "access denied (perf_event_paranoid is %d)",
+                            houselinux_perf_paranoid());
+        } else {
+            houselog_trace (HOUSE_WARNING, "perf",
+                            "not available: %s", strerror(error));
+        }
+        while (HousePerfGroupsCount > 0)
+            houselinux_perf_close (HousePerfGroups + (--HousePerfGroupsCount));
+        free (HousePerfGroups);
+        HousePerfGroups = 0;
+        return;
+    }
+    DEBUG ("perf counters enabled on %d CPUs\n", HousePerfGroupsCount);
+}
+
+static int houselinux_perf_report (char *buffer, int size,
+                                   time_t now, time_t since) {
+
+    if (HousePerfGroupsCount <= 0) return 0;
+
+    int cursor = snprintf (buffer, size, ",\"perf\":");
+    if (cursor >= size) return 0;
+    int start = cursor;
+
+    int e;
+    for (e = 0; e < HOUSE_PERF_EVENTS; ++e) {
+        if (now) {
+            cursor += houselinux_reduce_details_json
+                          (buffer+cursor, size-cursor, since,
+                           HousePerfEvents[e].name, "/s", now,
+                           HOUSE_PERF_PERIOD, HOUSE_PERF_SPAN,
+                           HousePerfTimestamps, HousePerfRates[e]);
+        } else {
+            cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                     HousePerfEvents[e].name,
+                                                     HousePerfTimestamps,
+                                                     HousePerfRates[e],
+                                                     HOUSE_PERF_SPAN, "/s");
+        }
+        if (cursor >= size) return 0;
+    }
+    if (cursor == start) return 0; // No data to report.
+    buffer[start] = '{'; // Overwrite the ','.
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+int houselinux_perf_status (char *buffer, int size) {
+    return houselinux_perf_report (buffer, size, 0, 0);
+}
+
+int houselinux_perf_summary (char *buffer, int size) {
+    return houselinux_perf_status (buffer, size); // Already the shortest.
+}
+
+int houselinux_perf_details (char *buffer, int size,
+                             time_t now, time_t since) {
+    return houselinux_perf_report (buffer, size, now, since);
+}
+
+void houselinux_perf_export (void) {
+
+    if (HousePerfGroupsCount <= 0) return;
+
+    int e;
+    for (e = 0; e < HOUSE_PERF_EVENTS; ++e) {
+        char name[64];
+        snprintf (name, sizeof(name), "perf.%s", HousePerfEvents[e].name);
+        houselinux_export_series (name, "/s", HOUSE_PERF_SPAN,
+                                  HousePerfTimestamps, HousePerfRates[e]);
+    }
+}
+
+void houselinux_perf_background (time_t now) {
+
+    static time_t NextPerfCollect = 0;
+
+    if (HousePerfGroupsCount <= 0) return;
+
+    if (now < NextPerfCollect) return;
+    NextPerfCollect = now + HOUSE_PERF_PERIOD;
+
+    long long total[HOUSE_PERF_EVENTS];
+    memset (total, 0, sizeof(total));
+
+    int failed = 0;
+    int i;
+    for (i = HousePerfGroupsCount - 1; i >= 0; --i) {
+        struct HousePerfGroup *group = HousePerfGroups + i;
+        struct {
+            unsigned long long nr;
+            unsigned long long values[HOUSE_PERF_EVENTS];
+        } data;
+        int length = read (group->fd[0], &data, sizeof(data));
+        if ((length != sizeof(data)) || (data.nr != HOUSE_PERF_EVENTS)) {
+            failed = 1;
+            if (++(group->failures) < HOUSE_PERF_FAILURES) continue;
+
+            // This group is gone: the totals must restart from scratch.
+            DEBUG ("perf group %d cannot be read, closed\n", i);
+            houselinux_perf_close (group);
+            *group = HousePerfGroups[--HousePerfGroupsCount];
+            HousePerfPreviousTime.tv_sec = 0;
+            continue;
+        }
+        group->failures = 0;
+        int e;
+        for (e = 0; e < HOUSE_PERF_EVENTS; ++e) total[e] += data.values[e];
+    }
+    // An incomplete total would show as a drop, then as a spike: skip it.
+    if (failed) return;
+
+    // Use the actual elapsed time, as the background calls may be late.
+    struct timespec current;
+    clock_gettime (CLOCK_MONOTONIC, &current);
+    long long elapsed =
+        (current.tv_sec - HousePerfPreviousTime.tv_sec) * 1000LL
+            + (current.tv_nsec - HousePerfPreviousTime.tv_nsec) / 1000000;
+
+    int index = (now / HOUSE_PERF_PERIOD) % HOUSE_PERF_SPAN;
+    if (HousePerfPreviousTime.tv_sec && (elapsed > 0)) {
+        int e;
+        for (e = 0; e < HOUSE_PERF_EVENTS; ++e) {
+            long long delta = total[e] - HousePerfPrevious[e];
+            if (delta < 0) delta = 0; // A CPU went offline?
+            HousePerfRates[e][index] = (delta * 1000 + elapsed / 2) / elapsed;
+
+            char name[64];
+            snprintf (name, sizeof(name), "perf.%s", HousePerfEvents[e].name);
+            houselinux_sample (name, HousePerfRates[e][index], "/s", now);
+        }
+        HousePerfTimestamps[index] = now;
+    }
+    memcpy (HousePerfPrevious, total, sizeof(total));
+    HousePerfPreviousTime = current;
+}
+
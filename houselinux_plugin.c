@@ -0,0 +1,199 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_plugin.c - Load collectors from shared libraries.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_plugin_initialize (int argc, const char **argv);
+ *
+ *    Load all the plugins found in the plugins directory, and initialize
+ *    them. The plugins directory can be changed using the option
+ *    -metrics-plugins=PATH.
+ *
+ * void houselinux_plugin_background (time_t now);
+ *
+ *    Call the background function of each plugin, according to its period.
+ *
+ * int houselinux_plugin_summary (char *buffer, int size);
+ *
+ *    Append the summary of each plugin, in JSON.
+ *
+ * int houselinux_plugin_status (char *buffer, int size);
+ *
+ *    Append the status overview of each plugin, in JSON.
+ *
+ * int houselinux_plugin_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    Append the detailed report of each plugin, in JSON.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <unistd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_plugin.h"
+#include "houselinux_plugin_loader.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_PLUGIN_MAX 16
+
+struct HousePluginInstance {
+    void *handle;
+    const struct HouseLinuxPlugin *plugin;
+    time_t next;
+};
+
+static struct HousePluginInstance HousePlugins[HOUSE_PLUGIN_MAX];
+static int HousePluginsCount = 0;
+
+static const char *HousePluginsPath = "/usr/local/lib/houselinux";
+
+
+static int houselinux_plugin_filter (const struct dirent *entry) {
+    int length = strlen (entry->d_name);
+    if (length <= 3) return 0;
+    return !strcmp (entry->d_name + length - 3, ".so");
+}
+
+static void houselinux_plugin_load (const char *path,
+                                    int argc, const char **argv) {
+
+    if (HousePluginsCount >= HOUSE_PLUGIN_MAX) {
+        houselog_trace (HOUSE_FAILURE, path, "too many plugins");
+        return;
+    }
+
+    void *handle = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        houselog_trace (HOUSE_FAILURE, path, "%s", dlerror());
+        return;
+    }
+    HouseLinuxPluginEntry *entry =
+        (HouseLinuxPluginEntry *) dlsym (handle, HOUSELINUX_PLUGIN_ENTRY);
+    if (!entry) {
+        houselog_trace (HOUSE_FAILURE, path, "no %s entry point",
+                        HOUSELINUX_PLUGIN_ENTRY);
+        dlclose (handle);
+        return;
+    }
+    const struct HouseLinuxPlugin *plugin = entry ();
+    if ((!plugin) || (plugin->abi != HOUSELINUX_PLUGIN_ABI) || (!plugin->name)) {
+        houselog_trace (HOUSE_FAILURE, path, "incompatible plugin (ABI %d)",
+                        plugin ? plugin->abi : 0);
+        dlclose (handle);
+        return;
+    }
+    DEBUG ("Loaded plugin %s from %s\n", plugin->name, path);
+
+    if (plugin->initialize) plugin->initialize (argc, argv);
+
+    HousePlugins[HousePluginsCount].handle = handle;
+    HousePlugins[HousePluginsCount].plugin = plugin;
+    HousePlugins[HousePluginsCount].next = 0;
+    HousePluginsCount += 1;
+
+    houselog_event ("PLUGIN", plugin->name, "LOADED", "FROM %s", path);
+}
+
+void houselinux_plugin_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-metrics-plugins=", argv[i], &HousePluginsPath);
+    }
+
+    // Load the plugins in alphabetical order, so that the order of
+    // the plugins in the reports does not change from one run to the next.
+    //
+    struct dirent **entries;
+    int count = scandir (HousePluginsPath, &entries,
+                         houselinux_plugin_filter, alphasort);
+    if (count < 0) return; // No plugin directory, no plugin.
+
+    for (i = 0; i < count; ++i) {
+        char path[1024];
+        snprintf (path, sizeof(path),
+                  "%s/%s", HousePluginsPath, entries[i]->d_name);
+        houselinux_plugin_load (path, argc, argv);
+        free (entries[i]);
+    }
+    free (entries);
+}
+
+void houselinux_plugin_background (time_t now) {
+
+    int i;
+    for (i = 0; i < HousePluginsCount; ++i) {
+        struct HousePluginInstance *instance = HousePlugins + i;
+        if (!instance->plugin->background) continue;
+        if (instance->plugin->period > 0) {
+            if (now < instance->next) continue;
+            instance->next = now + instance->plugin->period;
+        }
+        instance->plugin->background (now);
+    }
+}
+
+int houselinux_plugin_summary (char *buffer, int size) {
+
+    int i;
+    int cursor = 0;
+    for (i = 0; i < HousePluginsCount; ++i) {
+        if (!HousePlugins[i].plugin->summary) continue;
+        cursor += HousePlugins[i].plugin->summary (buffer+cursor, size-cursor);
+        if (cursor >= size) return 0;
+    }
+    return cursor;
+}
+
+int houselinux_plugin_status (char *buffer, int size) {
+
+    int i;
+    int cursor = 0;
+    for (i = 0; i < HousePluginsCount; ++i) {
+        if (!HousePlugins[i].plugin->status) continue;
+        cursor += HousePlugins[i].plugin->status (buffer+cursor, size-cursor);
+        if (cursor >= size) return 0;
+    }
+    return cursor;
+}
+
+int houselinux_plugin_details (char *buffer, int size,
+                               time_t now, time_t since) {
+
+    int i;
+    int cursor = 0;
+    for (i = 0; i < HousePluginsCount; ++i) {
+        if (!HousePlugins[i].plugin->details) continue;
+        cursor += HousePlugins[i].plugin->details (buffer+cursor, size-cursor,
+                                                   now, since);
+        if (cursor >= size) return 0;
+    }
+    return cursor;
+}
+
@@ -0,0 +1,62 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_plugin.h - The interface between HouseLinux and its plugins.
+ *
+ * This header is installed for plugin authors: it only defines the plugin
+ * ABI. The functions that load and run the plugins are internal to
+ * HouseLinux (see houselinux_plugin_loader.h).
+ *
+ * A plugin is a shared library that exports one function named
+ * houselinux_plugin (see HOUSELINUX_PLUGIN_ENTRY), which returns a
+ * pointer to a static HouseLinuxPlugin structure. The structure's
+ * callbacks have the same semantics as the built-in collectors: the
+ * summary, status and details callbacks populate a JSON fragment that
+ * starts with a ',' and return its length, or 0 if there is nothing
+ * to report.
+ *
+ * If period is not 0, the background callback is only called once every
+ * period seconds. Otherwise it is called on every houselinux cycle.
+ * Any callback may be null.
+ *
+ * A plugin may use the houselinux_reduce functions, which are exported
+ * by the houselinux executable.
+ */
+#ifndef HOUSELINUX_PLUGIN_H
+#define HOUSELINUX_PLUGIN_H
+
+#include <time.h>
+
+#define HOUSELINUX_PLUGIN_ABI   1
+#define HOUSELINUX_PLUGIN_ENTRY "houselinux_plugin"
+
+struct HouseLinuxPlugin {
+    int abi;          // Must be HOUSELINUX_PLUGIN_ABI.
+    const char *name;
+    int period;
+    void (*initialize) (int argc, const char **argv);
+    void (*background) (time_t now);
+    int  (*summary) (char *buffer, int size);
+    int  (*status) (char *buffer, int size);
+    int  (*details) (char *buffer, int size, time_t now, time_t since);
+};
+
+typedef const struct HouseLinuxPlugin *HouseLinuxPluginEntry (void);
+
+#endif // HOUSELINUX_PLUGIN_H
@@ -0,0 +1,367 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_power.c - Collect metrics on batteries and AC power.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_power_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void houselinux_power_background (time_t now);
+ *
+ *    The periodic function that manages the collect of metrics.
+ *
+ * int houselinux_power_throttle (time_t now);
+ *
+ *    Return 1 if the other collectors should skip this cycle, to save
+ *    battery power. This only happens when the -metrics-battery-saver
+ *    option is present and the system runs on battery: the collectors
+ *    then run once per minute only. The throttle is based on the wall
+ *    clock, i.e. the same time as the collectors' own periods: a
+ *    collector runs on the first of its periods that falls after the
+ *    minute has elapsed. The slots of the collectors' history that were
+ *    skipped are left with their old timestamps, and are ignored by the
+ *    5 minutes reports (see houselinux_reduce_recent_json()).
+ *
+ * int houselinux_power_summary (char *buffer, int size);
+ *
+ *    A function that populates a short summary of the power supplies in JSON.
+ *
+ * int houselinux_power_status (char *buffer, int size);
+ *
+ *    A function that populates a status overview of the power supplies in JSON.
+ *
+ * int houselinux_power_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    A function that populates a full detail report of the power supplies in JSON.
+ *
+ * void houselinux_power_export (void);
+ *
+ *    List the recent history of the batteries for /metrics/export.
+ *
+ * The power supplies are listed in /sys/class/power_supply. All the
+ * attributes of a power supply are read at once from its uevent file,
+ * which is kept open. An event is recorded when the AC power is lost
+ * or restored.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <dirent.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_source.h"
+#include "houselinux_export.h"
+#include "houselinux_power.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_POWER_PERIOD 10 // Sample power metrics every 10 seconds.
+#define HOUSE_POWER_SPAN   30 // MUST KEEP A 5 MINUTES HISTORY.
+#define HOUSE_POWER_MAX     8
+
+#define HOUSE_POWER_SAVING 60 // Collect period when on battery.
+
+struct HousePowerBattery {
+    char name[32];
+    int source;
+    char status[32];
+    long long cycles;
+    time_t timestamps[HOUSE_POWER_SPAN];
+    long long charge[HOUSE_POWER_SPAN];
+    long long draw[HOUSE_POWER_SPAN];
+};
+
+static struct HousePowerBattery HousePowerBatteries[HOUSE_POWER_MAX];
+static int HousePowerBatteriesCount = 0;
+
+static int HousePowerMains[HOUSE_POWER_MAX]; // Sources.
+static int HousePowerMainsCount = 0;
+
+static int HousePowerOnAc = 1;
+static int HousePowerSaver = 0;
+
+
+void houselinux_power_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-metrics-battery-saver", argv[i]))
+            HousePowerSaver = 1;
+    }
+
+    DIR *dir = opendir ("/sys/class/power_supply");
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir (dir))) {
+        if (entry->d_name[0] == '.') continue;
+
+        char path[512];
+        snprintf (path, sizeof(path),
+                  "/sys/class/power_supply/%s/type", entry->d_name);
+        FILE *f = fopen (path, "r");
+        if (!f) continue;
+        char type[32] = {0};
+        if (!fgets (type, sizeof(type), f)) type[0] = 0;
+        fclose (f);
+
+        snprintf (path, sizeof(path),
+                  "/sys/class/power_supply/%s/uevent", entry->d_name);
+
+        if (!strncmp (type, "Battery", 7)) {
+            if (HousePowerBatteriesCount >= HOUSE_POWER_MAX) continue;
+            if (strlen (entry->d_name) >= sizeof(HousePowerBatteries[0].name))
+                continue;
+            int source = houselinux_source_register (path, HOUSE_POWER_PERIOD);
+            if (source < 0) continue;
+            struct HousePowerBattery *battery =
+                HousePowerBatteries + HousePowerBatteriesCount++;
+            strcpy (battery->name, entry->d_name);
+            battery->source = source;
+            battery->cycles = -1;
+            DEBUG ("Battery %s detected\n", battery->name);
+
+        } else if (!strncmp (type, "Mains", 5) || !strncmp (type, "USB", 3)) {
+            if (HousePowerMainsCount >= HOUSE_POWER_MAX) continue;
+            int source = houselinux_source_register (path, HOUSE_POWER_PERIOD);
+            if (source < 0) continue;
+            HousePowerMains[HousePowerMainsCount++] = source;
+            DEBUG ("AC power supply %s detected\n", entry->d_name);
+        }
+    }
+    closedir (dir);
+}
+
+static int houselinux_power_report (char *buffer, int size,
+                                    time_t now, time_t since, int full) {
+
+    if (HousePowerBatteriesCount <= 0) return 0;
+
+    int cursor = snprintf (buffer, size, ",\"power\":{\"ac\":%s",
+                           HousePowerOnAc ? "true" : "false");
+    if (cursor >= size) return 0;
+
+    int i;
+    for (i = 0; i < HousePowerBatteriesCount; ++i) {
+        struct HousePowerBattery *battery = HousePowerBatteries + i;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            ",\"%s\":{\"status\":\"%s\"",
+                            battery->name, battery->status);
+        if (cursor >= size) return 0;
+
+        if (now) {
+            cursor += houselinux_reduce_details_json
+                          (buffer+cursor, size-cursor, since,
+                           "charge", "%", now,
+                           HOUSE_POWER_PERIOD, HOUSE_POWER_SPAN,
+                           battery->timestamps, battery->charge);
+            if (cursor >= size) return 0;
+            cursor += houselinux_reduce_details_json
+                          (buffer+cursor, size-cursor, since,
+                           "draw", "mW", now,
+                           HOUSE_POWER_PERIOD, HOUSE_POWER_SPAN,
+                           battery->timestamps, battery->draw);
+        } else {
+            cursor += houselinux_reduce_recent_json
+                          (buffer+cursor, size-cursor, "charge",
+                           battery->timestamps, battery->charge,
+                           HOUSE_POWER_SPAN, "%");
+            if (cursor >= size) return 0;
+            if (full) {
+                cursor += houselinux_reduce_recent_json
+                              (buffer+cursor, size-cursor, "draw",
+                               battery->timestamps, battery->draw,
+                               HOUSE_POWER_SPAN, "mW");
+            }
+        }
+        if (cursor >= size) return 0;
+
+        if (full && (battery->cycles >= 0)) {
+            cursor += snprintf (buffer+cursor, size-cursor,
+                                ",\"cycles\":%lld", battery->cycles);
+            if (cursor >= size) return 0;
+        }
+        cursor += snprintf (buffer+cursor, size-cursor, "}");
+        if (cursor >= size) return 0;
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+int houselinux_power_summary (char *buffer, int size) {
+    return houselinux_power_report (buffer, size, 0, 0, 0);
+}
+
+int houselinux_power_status (char *buffer, int size) {
+    return houselinux_power_report (buffer, size, 0, 0, 1);
+}
+
+int houselinux_power_details (char *buffer, int size,
+                              time_t now, time_t since) {
+    return houselinux_power_report (buffer, size, now, since, 1);
+}
+
+void houselinux_power_export (void) {
+
+    int i;
+    for (i = 0; i < HousePowerBatteriesCount; ++i) {
+        struct HousePowerBattery *battery = HousePowerBatteries + i;
+        char name[64];
+        snprintf (name, sizeof(name), "power.%.31s.charge", battery->name);
+        houselinux_export_series (name, "%", HOUSE_POWER_SPAN,
+                                  battery->timestamps, battery->charge);
+        snprintf (name, sizeof(name), "power.%.31s.draw", battery->name);
+        houselinux_export_series (name, "mW", HOUSE_POWER_SPAN,
+                                  battery->timestamps, battery->draw);
+    }
+}
+
+// Split the next "POWER_SUPPLY_NAME=VALUE" line of the uevent content.
+// Return the name, or 0 when there is no line left.
+//
+static const char *houselinux_power_field (char **cursor, const char **value) {
+
+    char *line;
+    while ((line = houselinux_source_line (cursor))) {
+        if (strncmp (line, "POWER_SUPPLY_", 13)) continue;
+        char *sep = strchr (line + 13, '=');
+        if (!sep) continue;
+        *sep = 0;
+        *value = sep + 1;
+        return line + 13;
+    }
+    return 0;
+}
+
+static void houselinux_power_battery (struct HousePowerBattery *battery,
+                                      time_t now, int index) {
+
+    battery->charge[index] = 0;
+    battery->draw[index] = 0;
+
+    char *data = houselinux_source_get (battery->source, now);
+    if (!data) return;
+
+    long long power = -1;   // µW
+    long long current = -1; // µA
+    long long voltage = -1; // µV
+    const char *status = "Unknown";
+
+    const char *name;
+    const char *value;
+    while ((name = houselinux_power_field (&data, &value))) {
+        if (!strcmp (name, "CAPACITY")) battery->charge[index] = atoll (value);
+        else if (!strcmp (name, "POWER_NOW")) power = atoll (value);
+        else if (!strcmp (name, "CURRENT_NOW")) current = atoll (value);
+        else if (!strcmp (name, "VOLTAGE_NOW")) voltage = atoll (value);
+        else if (!strcmp (name, "CYCLE_COUNT")) battery->cycles = atoll (value);
+        else if (!strcmp (name, "STATUS")) status = value;
+    }
+
+    // Some batteries only report current and voltage.
+    if ((power < 0) && (current >= 0) && (voltage >= 0))
+        power = (current / 1000) * (voltage / 1000);
+    if (power > 0) battery->draw[index] = power / 1000;
+
+    snprintf (battery->status, sizeof(battery->status), "%s", status);
+    battery->timestamps[index] = now;
+
+    char series[64];
+    snprintf (series, sizeof(series), "power.%.31s.charge", battery->name);
+    houselinux_sample (series, battery->charge[index], "%", now);
+    snprintf (series, sizeof(series), "power.%.31s.draw", battery->name);
+    houselinux_sample (series, battery->draw[index], "mW", now);
+}
+
+// AC power is present if any AC power supply is online. If there is
+// none, it is present unless a battery is discharging.
+//
+static int houselinux_power_ac (time_t now) {
+
+    int i;
+    if (HousePowerMainsCount > 0) {
+        for (i = 0; i < HousePowerMainsCount; ++i) {
+            char *data = houselinux_source_get (HousePowerMains[i], now);
+            if (!data) continue;
+            const char *name;
+            const char *value;
+            while ((name = houselinux_power_field (&data, &value))) {
+                if (!strcmp (name, "ONLINE") && (atoi (value) > 0)) return 1;
+            }
+        }
+        return 0;
+    }
+    for (i = 0; i < HousePowerBatteriesCount; ++i) {
+        if (!strcmp (HousePowerBatteries[i].status, "Discharging")) return 0;
+    }
+    return 1;
+}
+
+int houselinux_power_throttle (time_t now) {
+
+    static time_t NextCollect = 0;
+
+    if (!HousePowerSaver || HousePowerOnAc) {
+        NextCollect = 0;
+        return 0;
+    }
+    // Do not stall the collectors if the clock was set backward.
+    if ((now < NextCollect) && (NextCollect <= now + HOUSE_POWER_SAVING))
+        return 1;
+    NextCollect = now + HOUSE_POWER_SAVING;
+    return 0;
+}
+
+void houselinux_power_background (time_t now) {
+
+    static time_t NextPowerCollect = 0;
+
+    if (HousePowerBatteriesCount <= 0) return; // Not a battery operated system.
+
+    if (now < NextPowerCollect) return;
+    NextPowerCollect = now + HOUSE_POWER_PERIOD;
+
+    int index = (now / HOUSE_POWER_PERIOD) % HOUSE_POWER_SPAN;
+
+    int i;
+    for (i = 0; i < HousePowerBatteriesCount; ++i)
+        houselinux_power_battery (HousePowerBatteries + i, now, index);
+
+    int onac = houselinux_power_ac (now);
+    if (onac != HousePowerOnAc) {
+        long long charge = HousePowerBatteries[0].charge[index];
+        if (onac)
+            houselog_event ("POWER", "AC", "RESTORED",
+                            "BATTERY AT %lld%%", charge);
+        else
+            houselog_event ("POWER", "AC", "LOST",
+                            "BATTERY AT %lld%%", charge);
+        HousePowerOnAc = onac;
+    }
+}
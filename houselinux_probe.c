@@ -0,0 +1,739 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_probe.c - Measure the responsiveness of local services.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_probe_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Each -metrics-probe=TARGET option declares
+ *    one service to probe, either as HOST:PORT (TCP connect only) or as
+ *    http://HOST[:PORT]/PATH (TCP connect and HTTP GET). The
+ *    -metrics-peers[=SECONDS] option enables probing the peers.
+ *
+ * void houselinux_probe_background (time_t now);
+ *
+ *    The periodic function that starts the probes and detects timeouts.
+ *
+ * int houselinux_probe_summary (char *buffer, int size);
+ *
+ *    A function that populates a short summary of the probes in JSON.
+ *
+ * int houselinux_probe_status (char *buffer, int size);
+ *
+ *    A function that populates a status overview of the probes in JSON.
+ *
+ * int houselinux_probe_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    A function that populates a full detail report of the probes in JSON.
+ *
+ * void houselinux_probe_export (void);
+ *
+ *    List the recent history of the probes for /metrics/export.
+ *
+ * The probes are non blocking and run from the echttp loop: a probe
+ * starts a connect, and the socket is then listened to until the
+ * connection is established and, for HTTP, until the first byte of
+ * the response is received. Each target is probed once per period, and
+ * the probes are spread over the period to avoid bursts. A failed probe
+ * is only counted as a failure: it has no latency.
+ *
+ * The host names are resolved asynchronously (getaddrinfo_a), so that a
+ * slow resolver never blocks the echttp loop: a probe is skipped until
+ * its first resolution completes. A name that cannot be resolved counts
+ * as a failure and is tried again on the next period. The address is
+ * resolved again every 5 minutes, and after a connection error, so that
+ * a host that moved is followed. The previous address is used while the
+ * new resolution is in progress.
+ *
+ * The peers are the other HouseLinux instances, as found using
+ * housediscover. The round trip time to each peer is measured as the
+ * time to establish a TCP connection to its web server (one round trip),
+ * at a low rate (every minute by default). A failed connection counts as
+ * a loss, and is not included in the round trip times. The peers are
+ * reported in a separate "peers" section, so that all hosts together
+ * provide a network latency matrix. A peer with the same short name
+ * (before the first '.') as the local host is this host itself.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <echttp.h>
+
+#include "housediscover.h"
+#include "houselog.h"
+#include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_export.h"
+#include "houselinux_probe.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_PROBE_PERIOD  10 // Probe each target every 10 seconds.
+#define HOUSE_PROBE_SPAN    30 // MUST KEEP A 5 MINUTES HISTORY.
+#define HOUSE_PROBE_MAX     16
+#define HOUSE_PROBE_TIMEOUT  5 // Seconds.
+#define HOUSE_PROBE_RESOLVE 300 // Resolve the names again every 5 minutes.
+
+#define HOUSE_PROBE_PEERS   32
+#define HOUSE_PROBE_PEER_PERIOD 60 // Default, can be changed by option.
+
+// A pending name resolution owns a copy of the name, since the target
+// may be gone before the resolution completes.
+//
+struct HouseProbeResolver {
+    struct gaicb request;
+    struct addrinfo hints;
+    char *host;
+    char *port;
+};
+
+struct HouseProbeTarget {
+    char *name;
+    int peer;
+    int period;
+    int seen;          // Peers only: still discovered.
+    char *host;
+    char *port;
+    char *path;        // 0 if this is a TCP connect probe only.
+    struct sockaddr_storage address;
+    socklen_t addrlen;
+    time_t resolved;   // 0 when the address must be resolved again.
+    int unknown;       // The last resolution failed.
+    struct HouseProbeResolver *resolver; // 0 if no resolution in progress.
+    int fd;            // -1 when no probe is in progress.
+    int waiting;       // 2 while connecting, 1 while waiting for a response.
+    long long start;   // µs, CLOCK_MONOTONIC.
+    time_t started;
+    time_t next;
+    int failing;
+    long long failures;
+    time_t timestamps[HOUSE_PROBE_SPAN]; // All the probes.
+    time_t measured[HOUSE_PROBE_SPAN];   // Successful probes only, else 0.
+    long long connect[HOUSE_PROBE_SPAN];
+    long long response[HOUSE_PROBE_SPAN];
+    long long lost[HOUSE_PROBE_SPAN];
+    int index;
+};
+
+// The configured targets come first, followed by the peers.
+static struct HouseProbeTarget HouseProbeTargets[HOUSE_PROBE_MAX+HOUSE_PROBE_PEERS];
+static int HouseProbeTargetsCount = 0;
+static int HouseProbeConfigured = 0;
+
+static int HouseProbePeerPeriod = 0; // 0 means no peer probe.
+static char HouseProbeLocalHost[256] = {0}; // Short name.
+
+// The resolutions that could not be canceled when their target was removed.
+static struct HouseProbeResolver *HouseProbeOrphans[HOUSE_PROBE_PEERS];
+static int HouseProbeOrphansCount = 0;
+
+
+static long long houselinux_probe_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static int houselinux_probe_parse (struct HouseProbeTarget *target,
+                                   const char *text) {
+
+    // The name is copied as is to JSON: reject anything suspicious.
+    if (strpbrk (text, "\"\\ ")) return 0;
+
+    memset (target, 0, sizeof(*target));
+    target->name = strdup (text);
+    target->period = HOUSE_PROBE_PERIOD;
+    target->fd = -1;
+
+    const char *host = text;
+    const char *defaultport = 0;
+    if (!strncmp (text, "http://", 7)) {
+        host = text + 7;
+        defaultport = "80";
+    }
+    const char *path = strchr (host, '/');
+    if (defaultport) {
+        target->path = strdup (path ? path : "/");
+    } else if (path) {
+        return 0; // A path requires http://.
+    }
+    int length = path ? path - host : strlen (host);
+
+    char buffer[256];
+    if (length <= 0 || length >= sizeof(buffer)) return 0;
+    memcpy (buffer, host, length);
+    buffer[length] = 0;
+
+    char *port = strrchr (buffer, ':');
+    if (port) {
+        *(port++) = 0;
+    } else if (defaultport) {
+        port = (char *)defaultport;
+    } else {
+        return 0; // A TCP probe requires a port.
+    }
+    if (!buffer[0] || !port[0]) return 0;
+    target->host = strdup (buffer);
+    target->port = strdup (port);
+    return 1;
+}
+
+static void houselinux_probe_release (struct HouseProbeResolver *resolver) {
+    if (resolver->request.ar_result) freeaddrinfo (resolver->request.ar_result);
+    free (resolver->host);
+    free (resolver->port);
+    free (resolver);
+}
+
+// Start resolving the target's host name, unless already in progress.
+//
+static void houselinux_probe_lookup (struct HouseProbeTarget *target) {
+
+    if (target->resolver) return;
+
+    struct HouseProbeResolver *resolver = calloc (1, sizeof(*resolver));
+    resolver->host = strdup (target->host);
+    resolver->port = strdup (target->port);
+    resolver->hints.ai_family = AF_UNSPEC;
+    resolver->hints.ai_socktype = SOCK_STREAM;
+    resolver->request.ar_name = resolver->host;
+    resolver->request.ar_service = resolver->port;
+    resolver->request.ar_request = &(resolver->hints);
+
+    struct gaicb *list[1] = {&(resolver->request)};
+    int status = getaddrinfo_a (GAI_NOWAIT, list, 1, 0);
+    if (status) {
+        houselog_trace (HOUSE_FAILURE, target->name,
+                        "cannot resolve: %s", gai_strerror (status));
+        houselinux_probe_release (resolver);
+        return;
+    }
+    target->resolver = resolver;
+}
+
+// Stop a resolution that is no longer needed. If it cannot be canceled,
+// it is kept until it completes.
+//
+static void houselinux_probe_abandon (struct HouseProbeTarget *target) {
+
+    struct HouseProbeResolver *resolver = target->resolver;
+    if (!resolver) return;
+    target->resolver = 0;
+
+    if (gai_cancel (&(resolver->request)) == EAI_NOTCANCELED) {
+        if (HouseProbeOrphansCount < HOUSE_PROBE_PEERS) {
+            HouseProbeOrphans[HouseProbeOrphansCount++] = resolver;
+        }
+        return; // Otherwise leaked: this should never happen.
+    }
+    houselinux_probe_release (resolver);
+}
+
+static void houselinux_probe_orphans (void) {
+    int i;
+    for (i = HouseProbeOrphansCount - 1; i >= 0; --i) {
+        struct HouseProbeResolver *resolver = HouseProbeOrphans[i];
+        if (gai_error (&(resolver->request)) == EAI_INPROGRESS) continue;
+        houselinux_probe_release (resolver);
+        HouseProbeOrphans[i] = HouseProbeOrphans[--HouseProbeOrphansCount];
+    }
+}
+
+// Return 1 if the target has an address, 0 if the name could not be
+// resolved, -1 if the first resolution is still in progress.
+// (After a failure, the resolution is retried on each probe.)
+//
+static int houselinux_probe_resolve (struct HouseProbeTarget *target,
+                                     time_t now) {
+
+    if (now >= target->resolved + HOUSE_PROBE_RESOLVE) target->resolved = 0;
+
+    struct HouseProbeResolver *resolver = target->resolver;
+    if (resolver) {
+        int status = gai_error (&(resolver->request));
+        if (status == EAI_INPROGRESS) {
+            if (target->addrlen > 0) return 1;
+            return target->unknown ? 0 : -1;
+        }
+
+        struct addrinfo *result = resolver->request.ar_result;
+        if ((!status) && result) {
+            memcpy (&(target->address), result->ai_addr, result->ai_addrlen);
+            target->addrlen = result->ai_addrlen;
+            target->resolved = now;
+            target->unknown = 0;
+        } else {
+            DEBUG ("Cannot resolve %s: %s\n",
+                   target->host, gai_strerror (status));
+            target->addrlen = 0;
+            target->unknown = 1;
+        }
+        target->resolver = 0;
+        houselinux_probe_release (resolver);
+        return (target->addrlen > 0);
+    }
+    if (!target->resolved) {
+        houselinux_probe_lookup (target);
+        if (target->addrlen <= 0) {
+            return (target->resolver && !target->unknown) ? -1 : 0;
+        }
+    }
+    return (target->addrlen > 0);
+}
+
+// A connection error may be caused by an obsolete address.
+//
+static void houselinux_probe_expire (struct HouseProbeTarget *target) {
+    target->resolved = 0;
+}
+
+void houselinux_probe_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        const char *text = 0;
+        if (echttp_option_present ("-metrics-peers", argv[i])) {
+            HouseProbePeerPeriod = HOUSE_PROBE_PEER_PERIOD;
+            continue;
+        }
+        if (echttp_option_match ("-metrics-peers=", argv[i], &text)) {
+            HouseProbePeerPeriod = atoi (text);
+            if (HouseProbePeerPeriod < HOUSE_PROBE_PERIOD)
+                HouseProbePeerPeriod = HOUSE_PROBE_PERIOD;
+            continue;
+        }
+        if (!echttp_option_match ("-metrics-probe=", argv[i], &text)) continue;
+
+        if (HouseProbeTargetsCount >= HOUSE_PROBE_MAX) {
+            houselog_trace (HOUSE_FAILURE, text, "too many probes");
+            continue;
+        }
+        if (!houselinux_probe_parse (HouseProbeTargets + HouseProbeTargetsCount,
+                                     text)) {
+            houselog_trace (HOUSE_FAILURE, text, "invalid probe target");
+            continue;
+        }
+        houselinux_probe_lookup (HouseProbeTargets + HouseProbeTargetsCount);
+        HouseProbeTargetsCount += 1;
+    }
+    HouseProbeConfigured = HouseProbeTargetsCount;
+    gethostname (HouseProbeLocalHost, sizeof(HouseProbeLocalHost));
+    HouseProbeLocalHost[strcspn (HouseProbeLocalHost, ".")] = 0;
+}
+
+static int houselinux_probe_series (char *buffer, int size,
+                                    time_t now, time_t since,
+                                    struct HouseProbeTarget *target,
+                                    const char *name, long long *values) {
+    // A lost probe has no latency: its slot is skipped.
+    if (now) {
+        return houselinux_reduce_details_json
+                   (buffer, size, since, name, "us", now,
+                    target->period, HOUSE_PROBE_SPAN,
+                    target->measured, values);
+    }
+    return houselinux_reduce_recent_json (buffer, size, name,
+                                          target->measured, values,
+                                          HOUSE_PROBE_SPAN, "us");
+}
+
+// The loss rate is calculated over the probes that were recorded, lost or
+// not, while the round trip time only uses the probes that succeeded.
+//
+static long long houselinux_probe_loss (const struct HouseProbeTarget *target) {
+    int i;
+    int count = 0;
+    int lost = 0;
+    for (i = 0; i < HOUSE_PROBE_SPAN; ++i) {
+        if (!target->timestamps[i]) continue;
+        count += 1;
+        lost += target->lost[i];
+    }
+    return count ? (100 * lost) / count : 0;
+}
+
+static int houselinux_probe_report (char *buffer, int size,
+                                    time_t now, time_t since, int full) {
+
+    int cursor = 0;
+    int i;
+    const char *sep = "";
+
+    if (HouseProbeConfigured > 0) {
+        cursor = snprintf (buffer, size, ",\"probe\":{");
+        if (cursor >= size) return 0;
+
+        for (i = 0; i < HouseProbeConfigured; ++i) {
+            struct HouseProbeTarget *target = HouseProbeTargets + i;
+
+            cursor += snprintf (buffer+cursor, size-cursor,
+                                "%s\"%s\":{\"failures\":[%lld,\"count\"]",
+                                sep, target->name, target->failures);
+            if (cursor >= size) return 0;
+
+            cursor += houselinux_probe_series (buffer+cursor, size-cursor,
+                                               now, since, target,
+                                               "connect", target->connect);
+            if (cursor >= size) return 0;
+
+            if (full && target->path) {
+                cursor += houselinux_probe_series (buffer+cursor, size-cursor,
+                                                   now, since, target,
+                                                   "response", target->response);
+                if (cursor >= size) return 0;
+            }
+            cursor += snprintf (buffer+cursor, size-cursor, "}");
+            if (cursor >= size) return 0;
+            sep = ",";
+        }
+        cursor += snprintf (buffer+cursor, size-cursor, "}");
+        if (cursor >= size) return 0;
+    }
+
+    if (HouseProbeTargetsCount > HouseProbeConfigured) {
+        cursor += snprintf (buffer+cursor, size-cursor, ",\"peers\":{");
+        if (cursor >= size) return 0;
+
+        sep = "";
+        for (i = HouseProbeConfigured; i < HouseProbeTargetsCount; ++i) {
+            struct HouseProbeTarget *target = HouseProbeTargets + i;
+
+            cursor += snprintf (buffer+cursor, size-cursor,
+                                "%s\"%s\":{\"loss\":[%lld,\"%%\"]",
+                                sep, target->name,
+                                houselinux_probe_loss (target));
+            if (cursor >= size) return 0;
+
+            cursor += houselinux_probe_series (buffer+cursor, size-cursor,
+                                               now, since, target,
+                                               "rtt", target->connect);
+            if (cursor >= size) return 0;
+
+            cursor += snprintf (buffer+cursor, size-cursor, "}");
+            if (cursor >= size) return 0;
+            sep = ",";
+        }
+        cursor += snprintf (buffer+cursor, size-cursor, "}");
+        if (cursor >= size) return 0;
+    }
+    return cursor;
+}
+
+int houselinux_probe_summary (char *buffer, int size) {
+    return houselinux_probe_report (buffer, size, 0, 0, 0);
+}
+
+int houselinux_probe_status (char *buffer, int size) {
+    return houselinux_probe_report (buffer, size, 0, 0, 1);
+}
+
+int houselinux_probe_details (char *buffer, int size,
+                              time_t now, time_t since) {
+    return houselinux_probe_report (buffer, size, now, since, 1);
+}
+
+void houselinux_probe_export (void) {
+
+    char name[256];
+    int i;
+    for (i = 0; i < HouseProbeTargetsCount; ++i) {
+        struct HouseProbeTarget *target = HouseProbeTargets + i;
+
+        // A lost probe has no latency: only the successful probes are used.
+        if (target->peer) {
+            snprintf (name, sizeof(name), "peers.%s.rtt", target->name);
+            houselinux_export_series (name, "us", HOUSE_PROBE_SPAN,
+                                      target->measured, target->connect);
+            continue;
+        }
+        snprintf (name, sizeof(name), "probe.%s.connect", target->name);
+        houselinux_export_series (name, "us", HOUSE_PROBE_SPAN,
+                                  target->measured, target->connect);
+        if (target->path) {
+            snprintf (name, sizeof(name), "probe.%s.response", target->name);
+            houselinux_export_series (name, "us", HOUSE_PROBE_SPAN,
+                                      target->measured, target->response);
+        }
+    }
+}
+
+static void houselinux_probe_close (struct HouseProbeTarget *target) {
+    if (target->fd < 0) return;
+    echttp_forget (target->fd);
+    close (target->fd);
+    target->fd = -1;
+    target->waiting = 0;
+}
+
+static void houselinux_probe_failed (struct HouseProbeTarget *target,
+                                     const char *reason) {
+
+    houselinux_probe_close (target);
+    target->lost[target->index] = 1;
+    target->timestamps[target->index] = target->started;
+    target->measured[target->index] = 0;
+    target->failures += 1;
+    if (target->peer) return; // Reported as a loss rate only.
+    if (!target->failing) {
+        houselog_event ("PROBE", target->name, "FAILED", "%s", reason);
+        target->failing = 1;
+    }
+}
+
+static void houselinux_probe_succeeded (struct HouseProbeTarget *target) {
+
+    houselinux_probe_close (target);
+    target->lost[target->index] = 0;
+    target->timestamps[target->index] = target->started;
+    target->measured[target->index] = target->started;
+
+    char name[256];
+    if (target->peer) {
+        snprintf (name, sizeof(name), "peers.%s.rtt", target->name);
+        houselinux_sample (name, target->connect[target->index], "us",
+                           target->started);
+        return;
+    }
+    snprintf (name, sizeof(name), "probe.%s.connect", target->name);
+    houselinux_sample (name, target->connect[target->index], "us",
+                       target->started);
+    if (target->path) {
+        snprintf (name, sizeof(name), "probe.%s.response", target->name);
+        houselinux_sample (name, target->response[target->index], "us",
+                           target->started);
+    }
+    if (target->failing) {
+        houselog_event ("PROBE", target->name, "RECOVERED", "");
+        target->failing = 0;
+    }
+}
+
+static struct HouseProbeTarget *houselinux_probe_search (int fd) {
+    int i;
+    for (i = 0; i < HouseProbeTargetsCount; ++i) {
+        if (HouseProbeTargets[i].fd == fd) return HouseProbeTargets + i;
+    }
+    return 0;
+}
+
+static void houselinux_probe_ready (int fd, int mode) {
+
+    struct HouseProbeTarget *target = houselinux_probe_search (fd);
+    if (!target) {
+        echttp_forget (fd);
+        return;
+    }
+    long long elapsed = houselinux_probe_clock () - target->start;
+
+    if (target->waiting == 2) { // Connecting.
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+            error = errno;
+        if (error) {
+            houselinux_probe_expire (target);
+            houselinux_probe_failed (target, strerror (error));
+            return;
+        }
+        target->connect[target->index] = elapsed;
+        if (!target->path) {
+            houselinux_probe_succeeded (target);
+            return;
+        }
+        char request[512];
+        int size = snprintf (request, sizeof(request),
+                             "GET %s HTTP/1.0\r\nHost: %s\r\n"
+                             "Connection: close\r\n\r\n",
+                             target->path, target->host);
+        if (size >= sizeof(request) || write (fd, request, size) != size) {
+            houselinux_probe_expire (target);
+            houselinux_probe_failed (target, "cannot send request");
+            return;
+        }
+        echttp_forget (fd);
+        echttp_listen (fd, 1, houselinux_probe_ready, 0);
+        target->waiting = 1;
+        return;
+    }
+
+    // Waiting for the response: only the first byte matters.
+    char data[256];
+    if (read (fd, data, sizeof(data)) <= 0) {
+        houselinux_probe_failed (target, "no response");
+        return;
+    }
+    target->response[target->index] = elapsed;
+    houselinux_probe_succeeded (target);
+}
+
+static void houselinux_probe_start (struct HouseProbeTarget *target,
+                                    time_t now) {
+
+    int resolved = houselinux_probe_resolve (target, now);
+    if (resolved < 0) return; // Not known yet: skip this probe.
+
+    target->index = (now / target->period) % HOUSE_PROBE_SPAN;
+    target->started = now;
+
+    if (!resolved) {
+        houselinux_probe_failed (target, "unknown host");
+        return;
+    }
+    target->fd = socket (target->address.ss_family,
+                         SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (target->fd < 0) {
+        houselinux_probe_failed (target, strerror (errno));
+        return;
+    }
+    target->start = houselinux_probe_clock ();
+    if (connect (target->fd,
+                 (struct sockaddr *)&(target->address), target->addrlen)) {
+        if (errno != EINPROGRESS) {
+            houselinux_probe_expire (target);
+            houselinux_probe_failed (target, strerror (errno));
+            return;
+        }
+    }
+    // Even if already connected, let the event loop report it.
+    target->waiting = 2;
+    echttp_listen (target->fd, 2, houselinux_probe_ready, 0);
+}
+
+// Add or refresh a peer found by housediscover. The URL of the
+// metrics service gives the peer's host name and web server port.
+//
+static void houselinux_probe_discovered (const char *service,
+                                         void *context, const char *url) {
+
+    if (strncmp (url, "http://", 7)) return;
+    const char *host = url + 7;
+    const char *end = strchr (host, '/');
+    int length = end ? end - host : strlen (host);
+
+    char buffer[256];
+    if ((length <= 0) || (length >= sizeof(buffer))) return;
+    memcpy (buffer, host, length);
+    buffer[length] = 0;
+    if (strpbrk (buffer, "\"\\")) return;
+
+    char *port = strrchr (buffer, ':');
+    if (port) *(port++) = 0;
+    else port = "80";
+
+    // The URL may use the full or short name: compare the short names.
+    int shortlength = strcspn (buffer, ".");
+    if ((shortlength == strlen (HouseProbeLocalHost))
+        && (!strncmp (buffer, HouseProbeLocalHost, shortlength))) return;
+
+    int i;
+    for (i = HouseProbeConfigured; i < HouseProbeTargetsCount; ++i) {
+        struct HouseProbeTarget *target = HouseProbeTargets + i;
+        if (strcmp (target->host, buffer) || strcmp (target->port, port))
+            continue;
+        target->seen = 1;
+        return;
+    }
+    if (HouseProbeTargetsCount >= HOUSE_PROBE_MAX + HOUSE_PROBE_PEERS) return;
+
+    struct HouseProbeTarget *target = HouseProbeTargets + HouseProbeTargetsCount++;
+    memset (target, 0, sizeof(*target));
+    target->name = strdup (buffer);
+    target->host = strdup (buffer);
+    target->port = strdup (port);
+    target->peer = 1;
+    target->period = HouseProbePeerPeriod;
+    target->seen = 1;
+    target->fd = -1;
+    houselinux_probe_lookup (target);
+    DEBUG ("New peer %s (port %s)\n", target->host, target->port);
+}
+
+static void houselinux_probe_peers (time_t now) {
+
+    static time_t LastDiscovery = 0;
+
+    if (!HouseProbePeerPeriod) return;
+    if (!housediscover_changed ("metrics", LastDiscovery)) return;
+    LastDiscovery = now;
+
+    int i;
+    for (i = HouseProbeConfigured; i < HouseProbeTargetsCount; ++i)
+        HouseProbeTargets[i].seen = 0;
+
+    housediscovered ("metrics", 0, houselinux_probe_discovered);
+
+    // Forget the peers that are gone. The list is kept contiguous by
+    // moving the last peer into the free slot.
+    for (i = HouseProbeTargetsCount - 1; i >= HouseProbeConfigured; --i) {
+        struct HouseProbeTarget *target = HouseProbeTargets + i;
+        if (target->seen) continue;
+        DEBUG ("Peer %s is gone\n", target->name);
+        houselinux_probe_close (target);
+        houselinux_probe_abandon (target);
+        free (target->name);
+        free (target->host);
+        free (target->port);
+        if (i < --HouseProbeTargetsCount)
+            *target = HouseProbeTargets[HouseProbeTargetsCount];
+    }
+}
+
+void houselinux_probe_background (time_t now) {
+
+    houselinux_probe_peers (now);
+    houselinux_probe_orphans ();
+
+    int i;
+    for (i = 0; i < HouseProbeTargetsCount; ++i) {
+        struct HouseProbeTarget *target = HouseProbeTargets + i;
+
+        if (target->fd >= 0) {
+            if (now < target->started + HOUSE_PROBE_TIMEOUT) continue;
+            houselinux_probe_failed (target, "timeout");
+        }
+
+        int period = target->period;
+        if (!target->next) {
+            // Spread the targets over the period.
+            int offset = (i * period) / HouseProbeTargetsCount;
+            target->next = now - (now % period) + offset;
+            if (target->next <= now) target->next += period;
+        }
+        if (now < target->next) continue;
+        target->next += period;
+        if (target->next <= now) // We were delayed: resynchronize.
+            target->next = now - (now % period) + period
+                         + (i * period) / HouseProbeTargetsCount;
+
+        houselinux_probe_start (target, now);
+    }
+}
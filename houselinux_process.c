@@ -0,0 +1,539 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_process.c - Collect metrics on specific processes.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_process_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Each -metrics-process=NAME option declares
+ *    one service to watch (see below).
+ *
+ * void houselinux_process_background (time_t now);
+ *
+ *    The periodic function that manages the collect of metrics.
+ *
+ * int houselinux_process_summary (char *buffer, int size);
+ *
+ *    A function that populates a short summary of the processes in JSON.
+ *
+ * int houselinux_process_status (char *buffer, int size);
+ *
+ *    A function that populates a status overview of the processes in JSON.
+ *
+ * int houselinux_process_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    A function that populates a full detail report of the processes in JSON.
+ *
+ * void houselinux_process_export (void);
+ *
+ *    List the recent history of the service processes for /metrics/export.
+ *
+ * A service is declared either as a process name (-metrics-process=NAME),
+ * which must match the content of /proc/PID/comm, or as a label and
+ * a command line pattern (-metrics-process=LABEL:PATTERN), where the
+ * pattern uses the shell wildcard syntax and is matched against the
+ * process command line. All the processes that match are accounted
+ * together.
+ *
+ * The list of processes is only resolved once a minute, or when one of
+ * the watched processes has terminated. Each process's /proc directory
+ * is kept open, so that a recycled PID is never mistaken for the
+ * original process.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_export.h"
+#include "houselinux_process.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_PROCESS_MAX      16 // Services.
+#define HOUSE_PROCESS_PIDS     16 // Processes per service.
+#define HOUSE_PROCESS_PERIOD    5 // Sample process metrics every 5 seconds.
+#define HOUSE_PROCESS_SPAN     60 // MUST KEEP A 5 MINUTES HISTORY.
+#define HOUSE_PROCESS_RESOLVE  60 // Search for new processes every minute.
+
+struct HouseProcessThread {
+    pid_t tid;
+    long long ticks;
+};
+
+struct HouseProcessInstance {
+    pid_t pid;
+    int dirfd;
+    long long ticks;
+    int threadcount;
+    int threadsize;
+    struct HouseProcessThread *threads;
+};
+
+struct HouseProcessMetrics {
+    const char *label;
+    const char *pattern; // Null if matching the process name.
+    int count;
+    struct HouseProcessInstance instances[HOUSE_PROCESS_PIDS];
+    time_t timestamps[HOUSE_PROCESS_SPAN];
+    long long cpu[HOUSE_PROCESS_SPAN];
+    long long thread[HOUSE_PROCESS_SPAN];
+    long long rss[HOUSE_PROCESS_SPAN];
+    long long threads[HOUSE_PROCESS_SPAN];
+    long long fds[HOUSE_PROCESS_SPAN];
+};
+
+static struct HouseProcessMetrics HouseProcessLatest[HOUSE_PROCESS_MAX];
+static int                        HouseProcessLatestCount = 0;
+
+static time_t HouseProcessResolve = 0;
+static time_t HouseProcessPrevious = 0;
+
+static long HouseProcessTicks = 100;
+static long HouseProcessPageSize = 4096;
+
+
+// The label is copied as is to JSON and to the series names: reject
+// anything suspicious.
+//
+static int houselinux_process_valid (const char *label, int length) {
+    if (length <= 0) return 0;
+    int i;
+    for (i = 0; i < length; ++i) {
+        unsigned char c = label[i];
+        if ((c < ' ') || (c == 0x7f) || (c == '"') || (c == '\\')) return 0;
+    }
+    return 1;
+}
+
+void houselinux_process_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        const char *name = 0;
+        if (!echttp_option_match ("-metrics-process=", argv[i], &name)) continue;
+
+        const char *sep = strchr (name, ':');
+        int length = sep ? sep - name : strlen (name);
+        if (!houselinux_process_valid (name, length)) {
+            houselog_trace (HOUSE_FAILURE, name, "invalid process label");
+            continue;
+        }
+        if (HouseProcessLatestCount >= HOUSE_PROCESS_MAX) {
+            houselog_trace (HOUSE_FAILURE, name, "too many processes");
+            continue;
+        }
+        struct HouseProcessMetrics *metrics =
+            HouseProcessLatest + HouseProcessLatestCount++;
+
+        if (sep) {
+            metrics->label = strndup (name, sep - name);
+            metrics->pattern = sep + 1;
+        } else {
+            metrics->label = name;
+            metrics->pattern = 0;
+        }
+    }
+    HouseProcessTicks = sysconf (_SC_CLK_TCK);
+    HouseProcessPageSize = sysconf (_SC_PAGESIZE);
+}
+
+static int houselinux_process_read (int dirfd, const char *name,
+                                    char *buffer, int size) {
+
+    int fd = openat (dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int length = read (fd, buffer, size - 1);
+    close (fd);
+    if (length < 0) return -1;
+    buffer[length] = 0;
+    return length;
+}
+
+// Decode the CPU time (user + system) and the number of threads from
+// a /proc stat file. The process name is skipped by searching for the
+// last ')', since the name itself may contain spaces or parenthesis.
+//
+static int houselinux_process_stat (int dirfd, const char *name,
+                                    long long *ticks, long long *threads) {
+
+    char buffer[1024];
+    if (houselinux_process_read (dirfd, name, buffer, sizeof(buffer)) <= 0)
+        return -1;
+
+    char *cursor = strrchr (buffer, ')');
+    if (!cursor) return -1;
+
+    int field;
+    long long utime = 0;
+    long long stime = 0;
+    for (cursor += 2, field = 3; *cursor && (field <= 20); ++field) {
+        switch (field) {
+            case 14: utime = atoll (cursor); break;
+            case 15: stime = atoll (cursor); break;
+            case 20: if (threads) *threads = atoll (cursor); break;
+        }
+        while (*cursor > ' ') cursor += 1;
+        while (*cursor == ' ') cursor += 1;
+    }
+    *ticks = utime + stime;
+    return 0;
+}
+
+static int houselinux_process_fds (int dirfd) {
+
+    int fd = openat (dirfd, "fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0; // Not accessible: no data.
+    DIR *dir = fdopendir (fd);
+    if (!dir) {
+        close (fd);
+        return 0;
+    }
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir (dir))) {
+        if (entry->d_name[0] != '.') count += 1;
+    }
+    closedir (dir);
+    return count;
+}
+
+// Return the highest thread CPU usage (in ticks) since the last call.
+// This only matters for multi-threaded processes, where one thread
+// might be saturated while the process as a whole is not.
+//
+static long long houselinux_process_threads (struct HouseProcessInstance *p) {
+
+    int fd = openat (p->dirfd, "task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    DIR *dir = fdopendir (fd);
+    if (!dir) {
+        close (fd);
+        return 0;
+    }
+
+    struct HouseProcessThread *previous = p->threads;
+    int previouscount = p->threadcount;
+
+    p->threads = 0;
+    p->threadcount = p->threadsize = 0;
+
+    long long busiest = 0;
+    struct dirent *entry;
+    while ((entry = readdir (dir))) {
+        if (!isdigit (entry->d_name[0])) continue;
+
+        char path[300];
+        long long ticks;
+        snprintf (path, sizeof(path), "task/%s/stat", entry->d_name);
+        if (houselinux_process_stat (p->dirfd, path, &ticks, 0)) continue;
+
+        if (p->threadcount >= p->threadsize) {
+            p->threadsize += 16;
+            p->threads = realloc (p->threads,
+                                  p->threadsize * sizeof(*(p->threads)));
+        }
+        pid_t tid = atoi (entry->d_name);
+        p->threads[p->threadcount].tid = tid;
+        p->threads[p->threadcount].ticks = ticks;
+        p->threadcount += 1;
+
+        int i;
+        for (i = 0; i < previouscount; ++i) {
+            if (previous[i].tid == tid) {
+                long long delta = ticks - previous[i].ticks;
+                if (delta > busiest) busiest = delta;
+                break;
+            }
+        }
+    }
+    closedir (dir);
+    if (previous) free (previous);
+    return busiest;
+}
+
+static void houselinux_process_forget (struct HouseProcessMetrics *metrics,
+                                       int index) {
+
+    struct HouseProcessInstance *p = metrics->instances + index;
+    DEBUG ("Process %s: forget pid %d\n", metrics->label, p->pid);
+    close (p->dirfd);
+    if (p->threads) free (p->threads);
+
+    metrics->count -= 1;
+    if (index < metrics->count) *p = metrics->instances[metrics->count];
+}
+
+static int houselinux_process_match (struct HouseProcessMetrics *metrics,
+                                     int dirfd) {
+
+    char buffer[1024];
+    if (metrics->pattern) {
+        int length =
+            houselinux_process_read (dirfd, "cmdline", buffer, sizeof(buffer));
+        if (length <= 0) return 0; // Kernel thread or zombie.
+        int i;
+        for (i = length - 2; i >= 0; --i) if (!buffer[i]) buffer[i] = ' ';
+        return !fnmatch (metrics->pattern, buffer, 0);
+    }
+    int length = houselinux_process_read (dirfd, "comm", buffer, sizeof(buffer));
+    if (length <= 0) return 0;
+    if (buffer[length-1] == '\n') buffer[length-1] = 0;
+    return !strcmp (metrics->label, buffer);
+}
+
+static void houselinux_process_resolve (time_t now) {
+
+    HouseProcessResolve = now + HOUSE_PROCESS_RESOLVE;
+
+    DIR *proc = opendir ("/proc");
+    if (!proc) return;
+
+    struct dirent *entry;
+    while ((entry = readdir (proc))) {
+        if (!isdigit (entry->d_name[0])) continue;
+        pid_t pid = atoi (entry->d_name);
+
+        int i, j;
+        int fd = -1;
+        for (i = 0; i < HouseProcessLatestCount; ++i) {
+            struct HouseProcessMetrics *metrics = HouseProcessLatest + i;
+            for (j = metrics->count - 1; j >= 0; --j) {
+                if (metrics->instances[j].pid == pid) break;
+            }
+            if (j >= 0) break; // Already known.
+        }
+        if (i < HouseProcessLatestCount) continue;
+
+        for (i = 0; i < HouseProcessLatestCount; ++i) {
+            struct HouseProcessMetrics *metrics = HouseProcessLatest + i;
+            if (metrics->count >= HOUSE_PROCESS_PIDS) continue;
+            if (fd < 0) {
+                fd = openat (dirfd(proc), entry->d_name,
+                                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd < 0) break;
+            }
+            if (!houselinux_process_match (metrics, fd)) continue;
+
+            struct HouseProcessInstance *p = metrics->instances + metrics->count;
+            memset (p, 0, sizeof(*p));
+            p->pid = pid;
+            p->dirfd = fd;
+            p->ticks = -1; // No baseline yet.
+            metrics->count += 1;
+            DEBUG ("Process %s: found pid %d\n", metrics->label, pid);
+            fd = -1; // Now owned by this instance.
+            break;
+        }
+        if (fd >= 0) close (fd);
+    }
+    closedir (proc);
+}
+
+static void houselinux_process_sample (struct HouseProcessMetrics *metrics,
+                                       int index, int elapsed) {
+
+    long long cpu = 0;
+    long long thread = 0;
+    long long rss = 0;
+    long long threads = 0;
+    long long fds = 0;
+
+    int i;
+    for (i = metrics->count - 1; i >= 0; --i) {
+        struct HouseProcessInstance *p = metrics->instances + i;
+
+        long long ticks;
+        long long count = 0;
+        if (houselinux_process_stat (p->dirfd, "stat", &ticks, &count)) {
+            // The process is gone: look for its replacement now.
+            houselinux_process_forget (metrics, i);
+            HouseProcessResolve = 0;
+            continue;
+        }
+
+        if ((p->ticks >= 0) && (elapsed > 0)) {
+            cpu += ticks - p->ticks;
+        }
+        p->ticks = ticks;
+        threads += count;
+
+        if (count > 1) {
+            long long busiest = houselinux_process_threads (p);
+            if (busiest > thread) thread = busiest;
+        }
+
+        char buffer[256];
+        if (houselinux_process_read (p->dirfd, "statm",
+                                     buffer, sizeof(buffer)) > 0) {
+            char *resident = strchr (buffer, ' ');
+            if (resident) rss += atoll (resident) * HouseProcessPageSize;
+        }
+        fds += houselinux_process_fds (p->dirfd);
+    }
+
+    if (elapsed > 0) {
+        long long scale = HouseProcessTicks * elapsed;
+        metrics->cpu[index] = (100 * cpu) / scale;
+        metrics->thread[index] = (100 * thread) / scale;
+    } else {
+        metrics->cpu[index] = metrics->thread[index] = 0;
+    }
+    metrics->rss[index] = rss / (1024 * 1024);
+    metrics->threads[index] = threads;
+    metrics->fds[index] = fds;
+}
+
+static void houselinux_process_publish (struct HouseProcessMetrics *metrics,
+                                        int index, time_t now) {
+    char name[128];
+    snprintf (name, sizeof(name), "process.%s.cpu", metrics->label);
+    houselinux_sample (name, metrics->cpu[index], "%", now);
+    snprintf (name, sizeof(name), "process.%s.rss", metrics->label);
+    houselinux_sample (name, metrics->rss[index], "MB", now);
+}
+
+static int houselinux_process_report (char *buffer, int size,
+                                      time_t now, time_t since) {
+    int i;
+    int cursor = 0;
+    int start = 0;
+    int startproc = 0;
+    const char *sep = "";
+
+    cursor = snprintf (buffer, size, ",\"process\":{");
+    if (cursor >= size) return 0;
+    start = cursor;
+
+    for (i = 0; i < HouseProcessLatestCount; ++i) {
+        struct HouseProcessMetrics *metrics = HouseProcessLatest + i;
+        startproc = cursor;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s\"%s\":", sep, metrics->label);
+        if (cursor >= size) break;
+        int startmetrics = cursor;
+
+        static const char *names[] = {"cpu", "thread", "rss", "threads", "fds"};
+        static const char *units[] = {"%", "%", "MB", "", ""};
+        long long *values[] = {metrics->cpu, metrics->thread, metrics->rss,
+                               metrics->threads, metrics->fds};
+        int m;
+        for (m = 0; m < 5; ++m) {
+            if (now) {
+                cursor += houselinux_reduce_details_json
+                              (buffer+cursor, size-cursor, since,
+                               names[m], units[m], now,
+                               HOUSE_PROCESS_PERIOD, HOUSE_PROCESS_SPAN,
+                               metrics->timestamps, values[m]);
+            } else {
+                cursor += houselinux_reduce_recent_json
+                              (buffer+cursor, size-cursor, names[m],
+                               metrics->timestamps, values[m],
+                               HOUSE_PROCESS_SPAN, units[m]);
+            }
+            if (cursor >= size) break;
+        }
+        if (cursor >= size) break;
+
+        if (cursor == startmetrics) {
+            cursor = startproc; // No data to report for this service.
+            continue;
+        }
+        buffer[startmetrics] = '{'; // Overwrite the ','.
+        cursor += snprintf (buffer+cursor, size-cursor, "}");
+        sep = ",";
+    }
+    if (cursor == start) return 0; // No data to report for any service.
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+int houselinux_process_status (char *buffer, int size) {
+    return houselinux_process_report (buffer, size, 0, 0);
+}
+
+int houselinux_process_summary (char *buffer, int size) {
+    return houselinux_process_status (buffer, size); // Already the shortest.
+}
+
+int houselinux_process_details (char *buffer, int size,
+                                time_t now, time_t since) {
+    return houselinux_process_report (buffer, size, now, since);
+}
+
+void houselinux_process_export (void) {
+
+    static const char *names[] = {"cpu", "thread", "rss", "threads", "fds"};
+    static const char *units[] = {"%", "%", "MB", "", ""};
+
+    int i;
+    for (i = 0; i < HouseProcessLatestCount; ++i) {
+        struct HouseProcessMetrics *metrics = HouseProcessLatest + i;
+        long long *values[] = {metrics->cpu, metrics->thread, metrics->rss,
+                               metrics->threads, metrics->fds};
+        int m;
+        for (m = 0; m < 5; ++m) {
+            char name[128];
+            snprintf (name, sizeof(name),
+                      "process.%s.%s", metrics->label, names[m]);
+            houselinux_export_series (name, units[m], HOUSE_PROCESS_SPAN,
+                                      metrics->timestamps, values[m]);
+        }
+    }
+}
+
+void houselinux_process_background (time_t now) {
+
+    static time_t NextProcessCollect = 0;
+
+    if (HouseProcessLatestCount <= 0) return;
+
+    if (now < NextProcessCollect) return;
+    NextProcessCollect = now + HOUSE_PROCESS_PERIOD;
+
+    if (now >= HouseProcessResolve) houselinux_process_resolve (now);
+
+    int elapsed = HouseProcessPrevious ? (int)(now - HouseProcessPrevious) : 0;
+    HouseProcessPrevious = now;
+
+    int index = (now / HOUSE_PROCESS_PERIOD) % HOUSE_PROCESS_SPAN;
+    int i;
+    for (i = 0; i < HouseProcessLatestCount; ++i) {
+        houselinux_process_sample (HouseProcessLatest + i, index, elapsed);
+        HouseProcessLatest[i].timestamps[index] = now;
+        houselinux_process_publish (HouseProcessLatest + i, index, now);
+    }
+}
+
@@ -0,0 +1,617 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_recorder.c - Keep the recent raw content of the sources.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_recorder_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. The recorder is only enabled when the
+ *    -metrics-recorder=MINUTES option is present. The -metrics-replay=FILE
+ *    option loads a capture file instead (see below).
+ *
+ * void houselinux_recorder_record (int source, const char *path,
+ *                                  time_t now, long long clock,
+ *                                  const char *data, int length);
+ *
+ *    Record the content of a source file, as just read. This is called
+ *    by the source module.
+ *
+ * const char *houselinux_recorder_capture (const char *reason);
+ *
+ *    Write all the recorded content to a new capture file. Return the
+ *    name of the file, or null if the capture failed.
+ *
+ * const char *houselinux_recorder_trigger (const char *reason, time_t now);
+ *
+ *    Write a capture file following an incident or a request. Only one
+ *    capture is triggered per recording window, as it already covers the
+ *    whole window. Return the name of the file, or null if no capture
+ *    was written.
+ *
+ * int houselinux_recorder_enabled (void);
+ * int houselinux_recorder_ready (time_t now);
+ *
+ *    Return 1 if the recorder is enabled, or if a capture can be triggered
+ *    now, respectively. Return 0 otherwise.
+ *
+ * int houselinux_recorder_report (char *buffer, int size);
+ *
+ *    Populate the state of the recorder in JSON.
+ *
+ * int houselinux_recorder_replaying (void);
+ * time_t houselinux_recorder_replay_next (void);
+ * const char *houselinux_recorder_replay_get (const char *path,
+ *                                             long long *clock);
+ *
+ *    Replay a capture file: houselinux_recorder_replay_next() moves to
+ *    the next sample time and returns it, or 0 at the end of the capture.
+ *    houselinux_recorder_replay_get() returns the content of the specified
+ *    source at the current sample time, or null if the capture does not
+ *    have this source. The first sample time is loaded on initialization.
+ *
+ * The recorder is a FIFO of records, one per source read. The records
+ * older than the recording window are discarded, and so are the oldest
+ * records when the memory limit is reached.
+ *
+ * The content is delta-compressed: each line identical to the line at
+ * the same position in the previous content of the same source is
+ * omitted, and each run of such lines is replaced with a "\001COUNT"
+ * line. Most /proc files have a fixed layout where only a few values
+ * change, so this is effective. A full copy (keyframe) is recorded
+ * periodically, so that the records that remain can always be decoded
+ * once the oldest ones have been discarded.
+ *
+ * Only the most recent capture files of this host are kept: the oldest
+ * ones are deleted after each capture (default: 10 files, changed using
+ * the -metrics-recorder-keep=N option).
+ *
+ * A capture file is formatted as follows:
+ *
+ *    HOUSELINUX-CAPTURE 1 <host> <reason>
+ *    S <source> <path>                       (for each source)
+ *    R <source> <time> <clock> <K|D> <length>  (for each record)
+ *    <length bytes of content>
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <glob.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_recorder.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_RECORDER_KEYFRAME      12 // A full copy every 12 records.
+#define HOUSE_RECORDER_MEMORY (16*1024*1024) // Maximum content kept.
+#define HOUSE_RECORDER_RUN       '\001'
+#define HOUSE_RECORDER_KEEP          10 // Capture files kept, by default.
+
+struct HouseRecord {
+    int source;
+    time_t time;
+    long long clock;
+    char keyframe;
+    int length;
+    char data[];
+};
+
+// The FIFO of records, oldest first.
+static struct HouseRecord **HouseRecords = 0;
+static int HouseRecordsSize = 0;
+static int HouseRecordsHead = 0;
+static int HouseRecordsCount = 0;
+static long HouseRecordsMemory = 0;
+
+// The previous content of each source, reference for the delta.
+struct HouseRecorderSource {
+    char *path;
+    char *previous;
+    int length;
+    int sincekey;
+};
+
+static struct HouseRecorderSource *HouseRecorderSources = 0;
+static int HouseRecorderSourcesCount = 0;
+
+static int HouseRecorderWindow = 0; // Seconds, 0 if not enabled.
+static const char *HouseRecorderDirectory = "/var/lib/house/metrics";
+static char HouseRecorderLastCapture[512];
+static time_t HouseRecorderLastTrigger = 0;
+static int HouseRecorderKeep = HOUSE_RECORDER_KEEP;
+
+static char *HouseRecorderEncoded = 0;
+static int HouseRecorderEncodedSize = 0;
+
+// The replay state: all records are decoded on load.
+struct HouseReplaySource {
+    char *path;
+    const char *content;
+    long long clock;
+};
+
+static struct HouseReplaySource *HouseReplaySources = 0;
+static int HouseReplaySourcesCount = 0;
+static int HouseReplayCursor = 0;
+static int HouseReplayEnabled = 0;
+
+static void houselinux_recorder_load (const char *filename);
+
+
+void houselinux_recorder_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *replay = 0;
+    for (i = 1; i < argc; ++i) {
+        const char *value;
+        if (echttp_option_match ("-metrics-recorder=", argv[i], &value)) {
+            HouseRecorderWindow = atoi (value) * 60;
+            if (HouseRecorderWindow < 0) HouseRecorderWindow = 0;
+        } else if (echttp_option_match ("-metrics-recorder-dir=", argv[i], &value)) {
+            HouseRecorderDirectory = value;
+        } else if (echttp_option_match ("-metrics-recorder-keep=", argv[i], &value)) {
+            HouseRecorderKeep = atoi (value);
+            if (HouseRecorderKeep < 1) HouseRecorderKeep = 1;
+        } else if (echttp_option_match ("-metrics-replay=", argv[i], &replay)) {
+            // Processed later.
+        }
+    }
+    if (replay) {
+        HouseRecorderWindow = 0; // Don't record what is replayed.
+        houselinux_recorder_load (replay);
+    }
+}
+
+// Encode the content as a delta from the previous content of the same
+// source. The lines are compared one to one, based on their position.
+// Return the length of the encoded content, or -1 if not smaller.
+//
+static int houselinux_recorder_encode (const char *previous, int prevlength,
+                                       const char *data, int length) {
+
+    if (HouseRecorderEncodedSize < length + 1) {
+        HouseRecorderEncodedSize = length + 1024;
+        HouseRecorderEncoded =
+            realloc (HouseRecorderEncoded, HouseRecorderEncodedSize);
+    }
+    const char *p = previous;
+    const char *pend = previous + prevlength;
+    const char *d = data;
+    const char *dend = data + length;
+    int cursor = 0;
+    int run = 0;
+
+    while (d < dend) {
+        const char *eol = memchr (d, '\n', dend - d);
+        int linelength = eol ? eol - d + 1 : dend - d;
+
+        int same = 0;
+        const char *peol = 0;
+        if (p < pend) {
+            peol = memchr (p, '\n', pend - p);
+            int plength = peol ? peol - p + 1 : pend - p;
+            same = (plength == linelength) && (!memcmp (p, d, linelength));
+            p += plength;
+        }
+        if (same) {
+            run += 1;
+        } else {
+            if (run) {
+                cursor += snprintf (HouseRecorderEncoded + cursor,
+                                    HouseRecorderEncodedSize - cursor,
+                                    "%c%d\n", HOUSE_RECORDER_RUN, run);
+                run = 0;
+            }
+            if (cursor + linelength >= length) return -1;
+            memcpy (HouseRecorderEncoded + cursor, d, linelength);
+            cursor += linelength;
+        }
+        if (cursor >= length) return -1;
+        d += linelength;
+    }
+    if (run) {
+        if (cursor + 16 >= length) return -1;
+        cursor += snprintf (HouseRecorderEncoded + cursor,
+                            HouseRecorderEncodedSize - cursor,
+                            "%c%d\n", HOUSE_RECORDER_RUN, run);
+    }
+    return cursor;
+}
+
+// Decode a delta record, using the previous content of the same source.
+// Return a new allocated string.
+//
+static char *houselinux_recorder_decode (const char *previous,
+                                         const char *data, int length) {
+
+    int size = length + (previous ? strlen (previous) : 0) + 1;
+    char *result = malloc (size);
+    int cursor = 0;
+
+    const char *p = previous;
+    const char *d = data;
+    const char *dend = data + length;
+
+    while (d < dend) {
+        const char *eol = memchr (d, '\n', dend - d);
+        int linelength = eol ? eol - d + 1 : dend - d;
+
+        if (*d == HOUSE_RECORDER_RUN) {
+            int run = atoi (d + 1);
+            while ((run-- > 0) && p && *p) {
+                const char *peol = strchr (p, '\n');
+                int plength = peol ? peol - p + 1 : strlen (p);
+                if (cursor + plength >= size) {
+                    size = cursor + plength + 1024;
+                    result = realloc (result, size);
+                }
+                memcpy (result + cursor, p, plength);
+                cursor += plength;
+                p += plength;
+            }
+        } else {
+            if (cursor + linelength >= size) {
+                size = cursor + linelength + 1024;
+                result = realloc (result, size);
+            }
+            memcpy (result + cursor, d, linelength);
+            cursor += linelength;
+            if (p && *p) { // Skip the line that was replaced.
+                const char *peol = strchr (p, '\n');
+                p = peol ? peol + 1 : p + strlen (p);
+            }
+        }
+        d += linelength;
+    }
+    result[cursor] = 0;
+    return result;
+}
+
+static void houselinux_recorder_drop (void) {
+    struct HouseRecord *oldest = HouseRecords[HouseRecordsHead];
+    HouseRecordsMemory -= oldest->length;
+    free (oldest);
+    HouseRecords[HouseRecordsHead] = 0;
+    HouseRecordsHead = (HouseRecordsHead + 1) % HouseRecordsSize;
+    HouseRecordsCount -= 1;
+}
+
+static void houselinux_recorder_append (struct HouseRecord *record) {
+
+    if (HouseRecordsCount >= HouseRecordsSize) {
+        // Grow the FIFO, moving the records to keep them in order.
+        int size = HouseRecordsSize ? HouseRecordsSize * 2 : 256;
+        struct HouseRecord **records = calloc (size, sizeof(*records));
+        int i;
+        for (i = 0; i < HouseRecordsCount; ++i)
+            records[i] = HouseRecords[(HouseRecordsHead + i) % HouseRecordsSize];
+        free (HouseRecords);
+        HouseRecords = records;
+        HouseRecordsSize = size;
+        HouseRecordsHead = 0;
+    }
+    int tail = (HouseRecordsHead + HouseRecordsCount) % HouseRecordsSize;
+    HouseRecords[tail] = record;
+    HouseRecordsCount += 1;
+    HouseRecordsMemory += record->length;
+}
+
+void houselinux_recorder_record (int source, const char *path,
+                                 time_t now, long long clock,
+                                 const char *data, int length) {
+
+    if (!HouseRecorderWindow) return;
+    if ((source < 0) || (length < 0)) return;
+
+    if (source >= HouseRecorderSourcesCount) {
+        int count = source + 16;
+        HouseRecorderSources =
+            realloc (HouseRecorderSources, count * sizeof(*HouseRecorderSources));
+        memset (HouseRecorderSources + HouseRecorderSourcesCount, 0,
+                (count - HouseRecorderSourcesCount) * sizeof(*HouseRecorderSources));
+        HouseRecorderSourcesCount = count;
+    }
+    struct HouseRecorderSource *s = HouseRecorderSources + source;
+    if (!s->path) s->path = strdup (path);
+
+    int keyframe = (!s->previous) || (s->sincekey >= HOUSE_RECORDER_KEYFRAME);
+    int encoded = -1;
+    if (!keyframe)
+        encoded = houselinux_recorder_encode (s->previous, s->length,
+                                              data, length);
+    if (encoded < 0) keyframe = 1;
+
+    const char *content = keyframe ? data : HouseRecorderEncoded;
+    int contentlength = keyframe ? length : encoded;
+
+    struct HouseRecord *record = malloc (sizeof(*record) + contentlength);
+    record->source = source;
+    record->time = now;
+    record->clock = clock;
+    record->keyframe = keyframe;
+    record->length = contentlength;
+    memcpy (record->data, content, contentlength);
+    houselinux_recorder_append (record);
+
+    s->sincekey = keyframe ? 1 : s->sincekey + 1;
+    if (s->length < length + 1) s->previous = realloc (s->previous, length + 1);
+    memcpy (s->previous, data, length);
+    s->previous[length] = 0;
+    s->length = length;
+
+    // Forget what is too old, or too much.
+    while (HouseRecordsCount > 1) {
+        struct HouseRecord *oldest = HouseRecords[HouseRecordsHead];
+        if ((oldest->time > now - HouseRecorderWindow) &&
+            (HouseRecordsMemory <= HOUSE_RECORDER_MEMORY)) break;
+        houselinux_recorder_drop ();
+    }
+}
+
+// Delete the oldest capture files of this host. The names include the
+// time of the capture, so the alphabetical order is the time order.
+//
+static void houselinux_recorder_prune (const char *host) {
+
+    char pattern[512];
+    snprintf (pattern, sizeof(pattern), "%s/capture-%s-*.rec",
+              HouseRecorderDirectory, host);
+
+    glob_t found;
+    if (glob (pattern, 0, 0, &found)) return;
+
+    int i;
+    for (i = 0; i + HouseRecorderKeep < found.gl_pathc; ++i) {
+        if (unlink (found.gl_pathv[i])) {
+            houselog_trace (HOUSE_FAILURE, found.gl_pathv[i],
+                            "cannot delete: %s", strerror(errno));
+        }
+    }
+    globfree (&found);
+}
+
+const char *houselinux_recorder_capture (const char *reason) {
+
+    if (!HouseRecorderWindow) return 0;
+
+    char host[128];
+    gethostname (host, sizeof(host));
+
+    char timestamp[32];
+    time_t now = time(0);
+    strftime (timestamp, sizeof(timestamp),
+              "%Y%m%d-%H%M%S", localtime (&now));
+
+    char filename[512];
+    snprintf (filename, sizeof(filename), "%s/capture-%s-%s.rec",
+              HouseRecorderDirectory, host, timestamp);
+
+    FILE *f = fopen (filename, "w");
+    if (!f) {
+        houselog_trace (HOUSE_FAILURE, filename,
+                        "cannot create: %s", strerror(errno));
+        return 0;
+    }
+    fprintf (f, "HOUSELINUX-CAPTURE 1 %s %s\n", host, reason);
+
+    int i;
+    for (i = 0; i < HouseRecorderSourcesCount; ++i) {
+        if (!HouseRecorderSources[i].path) continue;
+        fprintf (f, "S %d %s\n", i, HouseRecorderSources[i].path);
+    }
+
+    for (i = 0; i < HouseRecordsCount; ++i) {
+        struct HouseRecord *record =
+            HouseRecords[(HouseRecordsHead + i) % HouseRecordsSize];
+        fprintf (f, "R %d %lld %lld %c %d\n",
+                 record->source, (long long)(record->time), record->clock,
+                 record->keyframe ? 'K' : 'D', record->length);
+        fwrite (record->data, 1, record->length, f);
+    }
+    if (fclose (f)) {
+        houselog_trace (HOUSE_FAILURE, filename,
+                        "write error: %s", strerror(errno));
+        return 0;
+    }
+    snprintf (HouseRecorderLastCapture, sizeof(HouseRecorderLastCapture),
+              "%s", filename);
+    houselog_event ("RECORDER", "metrics", "CAPTURE",
+                    "%s (%d RECORDS, %s)", filename, HouseRecordsCount, reason);
+    houselinux_recorder_prune (host);
+    return HouseRecorderLastCapture;
+}
+
+const char *houselinux_recorder_trigger (const char *reason, time_t now) {
+
+    if (!houselinux_recorder_ready (now)) return 0;
+    HouseRecorderLastTrigger = now;
+    return houselinux_recorder_capture (reason);
+}
+
+int houselinux_recorder_enabled (void) {
+    return HouseRecorderWindow > 0;
+}
+
+int houselinux_recorder_ready (time_t now) {
+    if (!HouseRecorderWindow) return 0;
+    return now >= HouseRecorderLastTrigger + HouseRecorderWindow;
+}
+
+int houselinux_recorder_report (char *buffer, int size) {
+
+    int cursor = snprintf (buffer, size,
+                           "\"recorder\":{\"enabled\":%s,\"window\":%d,"
+                               "\"records\":%d,\"memory\":%ld",
+                           HouseRecorderWindow ? "true" : "false",
+                           HouseRecorderWindow,
+                           HouseRecordsCount, HouseRecordsMemory);
+    if (cursor >= size) return 0;
+
+    if (HouseRecorderLastCapture[0]) {
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            ",\"capture\":\"%s\"", HouseRecorderLastCapture);
+        if (cursor >= size) return 0;
+    }
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+// The replay of a capture file. --------------------------------------
+
+struct HouseReplayRecord {
+    int source;
+    time_t time;
+    long long clock;
+    char *content;
+};
+
+static struct HouseReplayRecord *HouseReplayRecords = 0;
+static int HouseReplayRecordsCount = 0;
+
+static void houselinux_recorder_load (const char *filename) {
+
+    FILE *f = fopen (filename, "r");
+    if (!f) {
+        houselog_trace (HOUSE_FAILURE, filename,
+                        "cannot open: %s", strerror(errno));
+        return;
+    }
+    char line[1024];
+    if ((!fgets (line, sizeof(line), f)) ||
+        strncmp (line, "HOUSELINUX-CAPTURE 1 ", 21)) {
+        houselog_trace (HOUSE_FAILURE, filename, "not a capture file");
+        fclose (f);
+        return;
+    }
+
+    int recordssize = 0;
+    char **previous = 0; // Per source, last decoded content.
+
+    while (fgets (line, sizeof(line), f)) {
+        if (line[0] == 'S') {
+            int source;
+            char path[512];
+            if (sscanf (line, "S %d %511s", &source, path) != 2) break;
+            if (source < 0) break;
+            if (source >= HouseReplaySourcesCount) {
+                int count = source + 1;
+                HouseReplaySources =
+                    realloc (HouseReplaySources, count * sizeof(*HouseReplaySources));
+                previous = realloc (previous, count * sizeof(*previous));
+                int i;
+                for (i = HouseReplaySourcesCount; i < count; ++i) {
+                    memset (HouseReplaySources + i, 0, sizeof(*HouseReplaySources));
+                    previous[i] = 0;
+                }
+                HouseReplaySourcesCount = count;
+            }
+            HouseReplaySources[source].path = strdup (path);
+
+        } else if (line[0] == 'R') {
+            int source, length;
+            long long timestamp, clock;
+            char type;
+            if (sscanf (line, "R %d %lld %lld %c %d",
+                        &source, &timestamp, &clock, &type, &length) != 5) break;
+            if ((source < 0) || (source >= HouseReplaySourcesCount)) break;
+            if (length < 0) break;
+
+            char *data = malloc (length + 1);
+            if (fread (data, 1, length, f) != length) {
+                free (data);
+                break;
+            }
+            data[length] = 0;
+
+            char *content = 0;
+            if (type == 'K') {
+                content = data;
+            } else {
+                // A delta without its reference (the oldest keyframe was
+                // discarded) cannot be decoded: skip it.
+                if (previous[source])
+                    content = houselinux_recorder_decode (previous[source],
+                                                          data, length);
+                free (data);
+            }
+            if (!content) continue;
+            previous[source] = content;
+
+            if (HouseReplayRecordsCount >= recordssize) {
+                recordssize = recordssize ? recordssize * 2 : 1024;
+                HouseReplayRecords =
+                    realloc (HouseReplayRecords,
+                             recordssize * sizeof(*HouseReplayRecords));
+            }
+            struct HouseReplayRecord *r =
+                HouseReplayRecords + HouseReplayRecordsCount++;
+            r->source = source;
+            r->time = (time_t)timestamp;
+            r->clock = clock;
+            r->content = content;
+        }
+    }
+    fclose (f);
+    free (previous); // The contents are referenced by the records.
+
+    DEBUG ("Loaded %d records from %s\n", HouseReplayRecordsCount, filename);
+    HouseReplayEnabled = 1;
+    houselinux_recorder_replay_next (); // Make the first sample available.
+}
+
+int houselinux_recorder_replaying (void) {
+    return HouseReplayEnabled;
+}
+
+time_t houselinux_recorder_replay_next (void) {
+
+    if (HouseReplayCursor >= HouseReplayRecordsCount) return 0;
+
+    // Apply all the records for the next sample time.
+    time_t now = HouseReplayRecords[HouseReplayCursor].time;
+    while (HouseReplayCursor < HouseReplayRecordsCount) {
+        struct HouseReplayRecord *r = HouseReplayRecords + HouseReplayCursor;
+        if (r->time != now) break;
+        HouseReplaySources[r->source].content = r->content;
+        HouseReplaySources[r->source].clock = r->clock;
+        HouseReplayCursor += 1;
+    }
+    return now;
+}
+
+const char *houselinux_recorder_replay_get (const char *path,
+                                            long long *clock) {
+    int i;
+    for (i = 0; i < HouseReplaySourcesCount; ++i) {
+        struct HouseReplaySource *s = HouseReplaySources + i;
+        if ((!s->path) || strcmp (s->path, path)) continue;
+        if (clock) *clock = s->clock;
+        return s->content;
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_recorder.h - Keep the recent raw content of the sources.
+ */
+void houselinux_recorder_initialize (int argc, const char **argv);
+
+void houselinux_recorder_record (int source, const char *path,
+                                 time_t now, long long clock,
+                                 const char *data, int length);
+
+const char *houselinux_recorder_capture (const char *reason);
+const char *houselinux_recorder_trigger (const char *reason, time_t now);
+int houselinux_recorder_enabled (void);
+int houselinux_recorder_ready (time_t now);
+
+int houselinux_recorder_report (char *buffer, int size);
+
+int houselinux_recorder_replaying (void);
+time_t houselinux_recorder_replay_next (void);
+const char *houselinux_recorder_replay_get (const char *path,
+                                            long long *clock);
@@ -41,13 +41,26 @@
  *
  *    This returns the number of characters stored in buffer.
  *
+ * int houselinux_reduce_recent_json (char *buffer, int size,
+ *                                    const char *name,
+ *                                    time_t *timestamps, long long *values,
+ *                                    int count, const char *unit);
+ *
+ *    Same as houselinux_reduce_json(), except that only the values sampled
+ *    during the 5 minutes before the most recent sample are used. A value
+ *    with a 0 timestamp is never used. This is for the series where some
+ *    slots may be left over from an older cycle, e.g. when the collection
+ *    was slowed down or a sample was lost.
+ *
  * int houselinux_reduce_details_json (char *buffer, int size, time_t since,
  *                                     const char *name, const char *unit,
  *                                     time_t now, int step, int count,
  *                                     time_t *timestamps, long long *values);
  *
  *    Formats to JSON the elements of series that are more recent than since,
- *    ended with the unit. If since is 0, all the data is returned.
+ *    ended with the unit. If since is 0, all the data from the series'
+ *    period (count * step seconds) is returned: older slots, which were
+ *    not overwritten in the latest cycle, are ignored.
  *    This returns the number of characters stored in buffer.
  */
 
@@ -61,6 +74,8 @@
 
 #include "houselinux_reduce.h"
 
+#define HOUSE_REDUCE_WINDOW 300 // The period of the reports.
+
 static long long *SortedMetrics = 0;
 static int SortedMetricsSize = 0;
 
@@ -78,20 +93,21 @@ void houselinux_reduce_percentage (long long reference, int count,
     }
 }
 
-int houselinux_reduce_json (char *buffer, int size,
-                            const char *name,
-                            long long *values, int count, const char *unit) {
-
-    int last = count - 1;
-    int cursor;
-
-    // Make a copy to avoid corrupting the current metrics.
+// Make a copy to avoid corrupting the current metrics.
+//
+static void houselinux_reduce_prepare (int count) {
     if (count > SortedMetricsSize) {
         SortedMetrics = realloc (SortedMetrics, sizeof(long long) * count);
         SortedMetricsSize = count;
     }
-    int i;
-    for (i = last; i >= 0; --i) SortedMetrics[i] = values[i];
+}
+
+static int houselinux_reduce_sorted (char *buffer, int size,
+                                     const char *name,
+                                     int count, const char *unit) {
+
+    int last = count - 1;
+    int cursor;
 
     qsort (SortedMetrics, count, sizeof(long long), houselinux_reduce_compare);
 
@@ -134,6 +150,39 @@ int houselinux_reduce_json (char *buffer, int size,
     return cursor;
 }
 
+int houselinux_reduce_json (char *buffer, int size,
+                            const char *name,
+                            long long *values, int count, const char *unit) {
+
+    houselinux_reduce_prepare (count);
+    int i;
+    for (i = count - 1; i >= 0; --i) SortedMetrics[i] = values[i];
+
+    return houselinux_reduce_sorted (buffer, size, name, count, unit);
+}
+
+int houselinux_reduce_recent_json (char *buffer, int size,
+                                   const char *name,
+                                   time_t *timestamps, long long *values,
+                                   int count, const char *unit) {
+
+    time_t latest = 0;
+    int i;
+    for (i = count - 1; i >= 0; --i) {
+        if (timestamps[i] > latest) latest = timestamps[i];
+    }
+    if (!latest) return 0; // No data to report.
+    time_t oldest = latest - HOUSE_REDUCE_WINDOW;
+    if (oldest < 0) oldest = 0;
+
+    houselinux_reduce_prepare (count);
+    int recent = 0;
+    for (i = count - 1; i >= 0; --i) {
+        if (timestamps[i] > oldest) SortedMetrics[recent++] = values[i];
+    }
+    return houselinux_reduce_sorted (buffer, size, name, recent, unit);
+}
+
 int houselinux_reduce_details_json (char *buffer, int size, time_t since,
                                     const char *name, const char *unit,
                                     time_t now, int step, int count,
@@ -142,6 +191,9 @@ int houselinux_reduce_details_json (char *buffer, int size, time_t since,
     int cursor = snprintf (buffer, size, ",\"%s\":[", name);
     if (cursor >= size) return 0;
 
+    time_t oldest = now - (step * count);
+    if (since < oldest) since = oldest;
+
     int i;
     for (i = count-1; i >= 0; --i) {
         if ((values[i] != 0) && (timestamps[i] > since)) break;
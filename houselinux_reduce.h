@@ -20,6 +20,8 @@
  * houselinux_reduce.h - Generate quantil representations of metrics series.
  */
 
+#include <time.h>
+
 void houselinux_reduce_percentage (long long reference, int count,
                                    long long *in, long long *out);
 
@@ -27,6 +29,11 @@ int houselinux_reduce_json (char *buffer, int size,
                             const char *name,
                             long long *values, int count, const char *unit);
 
+int houselinux_reduce_recent_json (char *buffer, int size,
+                                   const char *name,
+                                   time_t *timestamps, long long *values,
+                                   int count, const char *unit);
+
 int houselinux_reduce_details_json (char *buffer, int size, time_t since,
                                     const char *name, const char *unit,
                                     time_t now, int step, int count,
@@ -0,0 +1,128 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_sample.c - Dispatch every new metric sample to consumers.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_sample (const char *name, long long value,
+ *                         const char *unit, time_t now);
+ *
+ *    Called by the collectors each time a new value was sampled. The name
+ *    of the series is made of the collector's section and the metric's
+ *    name, separated by '.', e.g. "cpu.busy" or "disk.sda.rdrate".
+ *    The value is forwarded to all the modules that process live samples.
+ *
+ * const char *houselinux_sample_name (int series);
+ * const char *houselinux_sample_unit (int series);
+ *
+ *    Return the name or unit of a series, as identified when the
+ *    sample was forwarded.
+ *
+ * Each series is assigned a permanent identifier the first time a sample
+ * is received, so that the consumers can keep their own state in a simple
+ * array. The number of series is limited, and so is the memory used.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_anomaly.h"
+#include "houselinux_alert.h"
+#include "houselinux_sensor.h"
+#include "houselinux_sample.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_SAMPLE_MAX    512
+#define HOUSE_SAMPLE_HASH  1024 // Must be a power of 2 > HOUSE_SAMPLE_MAX.
+
+struct HouseSampleSeries {
+    char *name;
+    char *unit;
+};
+
+static struct HouseSampleSeries HouseSampleSeries[HOUSE_SAMPLE_MAX];
+static int HouseSampleSeriesCount = 0;
+
+static short HouseSampleHash[HOUSE_SAMPLE_HASH]; // Series + 1, 0 means empty.
+
+static unsigned int houselinux_sample_hash (const char *name) {
+    unsigned int hash = 2166136261u; // FNV-1a.
+    while (*name) {
+        hash ^= (unsigned char)(*name++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int houselinux_sample_find (const char *name, const char *unit) {
+
+    unsigned int slot = houselinux_sample_hash (name) & (HOUSE_SAMPLE_HASH - 1);
+
+    for (;;) {
+        int series = HouseSampleHash[slot] - 1;
+        if (series < 0) break;
+        if (!strcmp (HouseSampleSeries[series].name, name)) return series;
+        slot = (slot + 1) & (HOUSE_SAMPLE_HASH - 1);
+    }
+
+    // This is a new series.
+    if (HouseSampleSeriesCount >= HOUSE_SAMPLE_MAX) {
+        static int Reported = 0;
+        if (!Reported) {
+            houselog_trace (HOUSE_WARNING, name, "too many metrics series");
+            Reported = 1;
+        }
+        return -1;
+    }
+    int series = HouseSampleSeriesCount++;
+    HouseSampleSeries[series].name = strdup (name);
+    HouseSampleSeries[series].unit = strdup (unit ? unit : "");
+    HouseSampleHash[slot] = series + 1;
+    DEBUG ("New series %s (%d)\n", name, series);
+    return series;
+}
+
+void houselinux_sample (const char *name, long long value,
+                        const char *unit, time_t now) {
+
+    int series = houselinux_sample_find (name, unit);
+    if (series < 0) return;
+
+    houselinux_anomaly_sample (series, value, now);
+    houselinux_alert_sample (series, value, now);
+    houselinux_sensor_sample (series, value, now);
+}
+
+const char *houselinux_sample_name (int series) {
+    if ((series < 0) || (series >= HouseSampleSeriesCount)) return "";
+    return HouseSampleSeries[series].name;
+}
+
+const char *houselinux_sample_unit (int series) {
+    if ((series < 0) || (series >= HouseSampleSeriesCount)) return "";
+    return HouseSampleSeries[series].unit;
+}
+
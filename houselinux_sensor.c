@@ -0,0 +1,302 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_sensor.c - Export metrics series as sensor data.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_sensor_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. Each -metrics-sensor=EXPORT option declares
+ *    one export (see below).
+ *
+ * void houselinux_sensor_sample (int series, long long value, time_t now);
+ *
+ *    Accumulate a new sample for the exports that apply to this series.
+ *    This is called from houselinux_sample().
+ *
+ * void houselinux_sensor_background (time_t now);
+ *
+ *    Record the sensor data for all the exports that are due.
+ *
+ * An export is formatted as "SERIES [avg|min|max|last] [every DURATION]",
+ * for example "storage./home.free last every 1h" or "temp.gpu max".
+ * The series is either the full name of a series or a shell wildcard
+ * pattern. The default aggregation is avg and the default interval is
+ * 5 minutes (suffix s, m or h).
+ *
+ * Each matching series is recorded under its own name, with its own unit,
+ * at multiples of the export's interval. Temperatures are converted from
+ * millidegrees to degrees Celsius. All the data due at the same time is
+ * sent together.
+ *
+ * The CPU temperature is always exported as an average every 5 minutes,
+ * unless an export is declared for "temp.cpu".
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselog_sensor.h"
+#include "houselinux_sample.h"
+#include "houselinux_sensor.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_SENSOR_EXPORTS     16
+#define HOUSE_SENSOR_SERIES     512 // Same as the number of sample series.
+#define HOUSE_SENSOR_PER_SERIES   4 // Exports that may apply to the same series.
+#define HOUSE_SENSOR_INTERVAL   300 // Default export interval.
+
+#define HOUSE_SENSOR_AVG  0
+#define HOUSE_SENSOR_MIN  1
+#define HOUSE_SENSOR_MAX  2
+#define HOUSE_SENSOR_LAST 3
+
+static const char *HouseSensorAggregations[] = {"avg", "min", "max", "last"};
+
+struct HouseSensorExport {
+    const char *text;
+    char *pattern;
+    int aggregation;
+    int interval;
+    time_t next;
+};
+
+static struct HouseSensorExport HouseSensorExports[HOUSE_SENSOR_EXPORTS];
+static int HouseSensorExportsCount = 0;
+
+struct HouseSensorState {
+    int export;
+    int count;
+    long long total;
+    long long min;
+    long long max;
+    long long last;
+};
+
+struct HouseSensorSeries {
+    int resolved;
+    int count;
+    struct HouseSensorState states[HOUSE_SENSOR_PER_SERIES];
+};
+
+static struct HouseSensorSeries *HouseSensorSeries = 0;
+
+static char HouseSensorHost[256] = {0};
+
+
+static int houselinux_sensor_parse (struct HouseSensorExport *export,
+                                    const char *text) {
+
+    char buffer[256];
+    snprintf (buffer, sizeof(buffer), "%s", text);
+
+    char *tokens[8];
+    int count = 0;
+    char *token = strtok (buffer, " \t");
+    while (token && (count < 8)) {
+        tokens[count++] = token;
+        token = strtok (0, " \t");
+    }
+    if (count < 1) return 0;
+
+    memset (export, 0, sizeof(*export));
+    export->text = text;
+    export->aggregation = HOUSE_SENSOR_AVG;
+    export->interval = HOUSE_SENSOR_INTERVAL;
+
+    int i = 0;
+    export->pattern = strdup (tokens[i++]);
+
+    if (i < count) {
+        int a;
+        for (a = HOUSE_SENSOR_LAST; a >= 0; --a) {
+            if (!strcmp (tokens[i], HouseSensorAggregations[a])) break;
+        }
+        if (a >= 0) {
+            export->aggregation = a;
+            i += 1;
+        }
+    }
+
+    if (i < count) {
+        if (strcmp (tokens[i++], "every") || (i >= count)) return 0;
+        char *end;
+        export->interval = (int)strtol (tokens[i++], &end, 10);
+        switch (*end) {
+            case 'h': export->interval *= 3600; break;
+            case 'm': export->interval *= 60; break;
+        }
+        if (export->interval <= 0) return 0;
+    }
+    if (i < count) return 0; // Unexpected extra.
+    return 1;
+}
+
+static void houselinux_sensor_declare (const char *text) {
+
+    if (HouseSensorExportsCount >= HOUSE_SENSOR_EXPORTS) {
+        houselog_trace (HOUSE_FAILURE, text, "too many sensor exports");
+        return;
+    }
+    if (!houselinux_sensor_parse (HouseSensorExports + HouseSensorExportsCount,
+                                  text)) {
+        houselog_trace (HOUSE_FAILURE, text, "invalid sensor export");
+        return;
+    }
+    HouseSensorExportsCount += 1;
+}
+
+void houselinux_sensor_initialize (int argc, const char **argv) {
+
+    int cputemp = 0;
+    int i;
+    for (i = 1; i < argc; ++i) {
+        const char *text = 0;
+        if (!echttp_option_match ("-metrics-sensor=", argv[i], &text)) continue;
+        houselinux_sensor_declare (text);
+        if (!strncmp (text, "temp.cpu", 8) && ((text[8] == 0) || (text[8] == ' ')))
+            cputemp = 1;
+    }
+    if (!cputemp) houselinux_sensor_declare ("temp.cpu");
+
+    HouseSensorSeries = calloc (HOUSE_SENSOR_SERIES, sizeof(*HouseSensorSeries));
+}
+
+// Find which exports apply to this series. This is done once per series.
+//
+static void houselinux_sensor_resolve (int series,
+                                       struct HouseSensorSeries *s) {
+
+    const char *name = houselinux_sample_name (series);
+
+    s->resolved = 1;
+    int i;
+    for (i = 0; i < HouseSensorExportsCount; ++i) {
+        if (fnmatch (HouseSensorExports[i].pattern, name, 0)) continue;
+        if (s->count >= HOUSE_SENSOR_PER_SERIES) {
+            houselog_trace (HOUSE_WARNING, name, "too many sensor exports");
+            break;
+        }
+        struct HouseSensorState *state = s->states + s->count++;
+        memset (state, 0, sizeof(*state));
+        state->export = i;
+        DEBUG ("Sensor export \"%s\" applies to %s\n",
+               HouseSensorExports[i].text, name);
+    }
+}
+
+void houselinux_sensor_sample (int series, long long value, time_t now) {
+
+    if (!HouseSensorSeries) return;
+    if ((series < 0) || (series >= HOUSE_SENSOR_SERIES)) return;
+
+    struct HouseSensorSeries *s = HouseSensorSeries + series;
+    if (!s->resolved) houselinux_sensor_resolve (series, s);
+
+    int i;
+    for (i = 0; i < s->count; ++i) {
+        struct HouseSensorState *state = s->states + i;
+        if ((state->count == 0) || (value < state->min)) state->min = value;
+        if ((state->count == 0) || (value > state->max)) state->max = value;
+        state->total += value;
+        state->last = value;
+        state->count += 1;
+    }
+}
+
+static void houselinux_sensor_record (int series,
+                                      struct HouseSensorState *state,
+                                      const struct timeval *timestamp) {
+
+    long long value;
+    switch (HouseSensorExports[state->export].aggregation) {
+        case HOUSE_SENSOR_MIN:  value = state->min; break;
+        case HOUSE_SENSOR_MAX:  value = state->max; break;
+        case HOUSE_SENSOR_LAST: value = state->last; break;
+        default:                value = state->total / state->count;
+    }
+
+    const char *unit = houselinux_sample_unit (series);
+    if (!strcmp (unit, "mC")) {
+        value /= 1000;
+        unit = "°C";
+    }
+    houselog_sensor_numeric (timestamp, HouseSensorHost,
+                             houselinux_sample_name (series), value, unit);
+}
+
+void houselinux_sensor_background (time_t now) {
+
+    if (!HouseSensorSeries) return;
+
+    if (!HouseSensorHost[0]) {
+        houselog_sensor_initialize ("metrics", 0, 0);
+        gethostname (HouseSensorHost, sizeof(HouseSensorHost));
+    }
+
+    // Find which exports are due. Data is recorded at multiples of
+    // the export's interval.
+    int due[HOUSE_SENSOR_EXPORTS];
+    int anydue = 0;
+    int i;
+    for (i = 0; i < HouseSensorExportsCount; ++i) {
+        struct HouseSensorExport *export = HouseSensorExports + i;
+        due[i] = 0;
+        if (!export->next) {
+            export->next = now - (now % export->interval) + export->interval;
+        } else if (now >= export->next) {
+            export->next = now - (now % export->interval) + export->interval;
+            due[i] = anydue = 1;
+        }
+    }
+
+    if (anydue) {
+        struct timeval timestamp;
+        timestamp.tv_sec = now;
+        timestamp.tv_usec = 0;
+
+        int recorded = 0;
+        int series;
+        for (series = 0; series < HOUSE_SENSOR_SERIES; ++series) {
+            struct HouseSensorSeries *s = HouseSensorSeries + series;
+            if (!s->resolved) break; // Series are allocated in sequence.
+            for (i = 0; i < s->count; ++i) {
+                struct HouseSensorState *state = s->states + i;
+                if (!due[state->export]) continue;
+                if (state->count > 0) {
+                    houselinux_sensor_record (series, state, &timestamp);
+                    recorded += 1;
+                }
+                state->count = 0;
+                state->total = 0;
+            }
+        }
+        if (recorded) houselog_sensor_flush ();
+    }
+    houselog_sensor_background (now);
+}
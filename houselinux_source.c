@@ -0,0 +1,455 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_source.c - Read the /proc and /sys files in batches.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_source_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. The io_uring backend is enabled using
+ *    the -metrics-uring option.
+ *
+ * int houselinux_source_register (const char *path, int period);
+ *
+ *    Declare a file that is read every period seconds. The file is opened
+ *    once and kept open. Return a source handle, or -1 on failure.
+ *
+ * char *houselinux_source_get (int source, time_t now);
+ *
+ *    Return the content of the source file, as of time now. If this
+ *    source was not read yet at this time, all sources that are due
+ *    are read together, as one batch. Each call returns a new copy of
+ *    the content, which the caller may modify: it remains valid until
+ *    the next call for the same source. Return null if the file could
+ *    not be read.
+ *
+ * long long houselinux_source_clock (int source);
+ *
+ *    Return the time when the content of the source was last read, using
+ *    CLOCK_MONOTONIC in nanoseconds. This is the exact sample time, which
+ *    is more accurate than the background loop's time when computing rates.
+ *
+ * char *houselinux_source_line (char **cursor);
+ *
+ *    Extract the next line from the content of a source. The cursor
+ *    must initially point to the content returned by houselinux_source_get.
+ *    The line is null terminated (the end of line is replaced in the
+ *    content). Return null when there is no line left.
+ *
+ *    The content is followed by a few readable bytes, as required by the
+ *    houselinux_parse functions.
+ *
+ * Keeping the files open and reading them with pread() avoids the
+ * open() and close() system calls on every sample. When the io_uring
+ * backend is enabled, all the reads of a batch are submitted together,
+ * typically in two system calls (one to read, one to detect the end
+ * of files). If io_uring is not available, or fails, this module falls
+ * back to pread(). The tools/houselinux_bench_source program compares
+ * the cost of each method on the current host.
+ *
+ * Every content read is passed to the flight recorder. When a capture
+ * file is replayed, the content comes from that file instead.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_recorder.h"
+#include "houselinux_source.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_SOURCE_BUFFER 4096 // Initial size, grows as needed.
+#define HOUSE_SOURCE_URING    64 // Maximum number of reads per submission.
+#define HOUSE_SOURCE_PADDING   8 // Readable bytes past the end, for parsing.
+
+struct HouseSourceFile {
+    char *path;
+    int fd;
+    int period;
+    time_t read;
+    long long clock; // CLOCK_MONOTONIC time of the read, in nanoseconds.
+    int fresh;       // Read in the latest batch, not recorded yet.
+    int size;
+    int length;
+    char *buffer;
+    int copysize;
+    char *copy;      // What was returned to the caller.
+};
+
+static struct HouseSourceFile *HouseSources = 0;
+static int                     HouseSourcesSize = 0;
+static int                     HouseSourcesCount = 0;
+
+static int HouseSourceUringEnabled = 0;
+
+struct HouseSourceUring {
+    int fd;
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned *sqmask;
+    unsigned *sqarray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned *cqmask;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+};
+
+static struct HouseSourceUring HouseUring = {-1};
+
+
+static int houselinux_source_uring_setup (void) {
+
+    struct io_uring_params params;
+    memset (&params, 0, sizeof(params));
+
+    int fd = syscall (__NR_io_uring_setup, HOUSE_SOURCE_URING, &params);
+    if (fd < 0) {
+        houselog_trace (HOUSE_WARNING, "io_uring",
+                        "not available: %s", strerror(errno));
+        return 0;
+    }
+
+    size_t sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqsize =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && (cqsize > sqsize)) sqsize = cqsize;
+
+    char *sq = mmap (0, sqsize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) goto failure;
+
+    char *cq = sq;
+    if (!single) {
+        cq = mmap (0, cqsize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) goto failure;
+    }
+
+    HouseUring.sqes = mmap (0, params.sq_entries * sizeof(struct io_uring_sqe),
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (HouseUring.sqes == MAP_FAILED) goto failure;
+
+    HouseUring.sqhead = (unsigned *) (sq + params.sq_off.head);
+    HouseUring.sqtail = (unsigned *) (sq + params.sq_off.tail);
+    HouseUring.sqmask = (unsigned *) (sq + params.sq_off.ring_mask);
+    HouseUring.sqarray = (unsigned *) (sq + params.sq_off.array);
+    HouseUring.cqhead = (unsigned *) (cq + params.cq_off.head);
+    HouseUring.cqtail = (unsigned *) (cq + params.cq_off.tail);
+    HouseUring.cqmask = (unsigned *) (cq + params.cq_off.ring_mask);
+    HouseUring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    HouseUring.entries = params.sq_entries;
+    HouseUring.fd = fd;
+
+    DEBUG ("io_uring enabled with %d entries\n", params.sq_entries);
+    return 1;
+
+failure:
+    houselog_trace (HOUSE_WARNING, "io_uring", "mmap failed");
+    close (fd);
+    return 0;
+}
+
+void houselinux_source_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_present ("-metrics-uring", argv[i]))
+            HouseSourceUringEnabled = 1;
+    }
+    if (HouseSourceUringEnabled)
+        HouseSourceUringEnabled = houselinux_source_uring_setup ();
+}
+
+int houselinux_source_register (const char *path, int period) {
+
+    int fd = -1;
+    if (houselinux_recorder_replaying ()) {
+        // The content comes from the capture file, not from this host.
+        if (!houselinux_recorder_replay_get (path, 0)) return -1;
+    } else {
+        fd = open (path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+    }
+
+    if (HouseSourcesCount >= HouseSourcesSize) {
+        HouseSourcesSize += 16;
+        HouseSources = realloc (HouseSources,
+                                HouseSourcesSize * sizeof(struct HouseSourceFile));
+    }
+    struct HouseSourceFile *source = HouseSources + HouseSourcesCount;
+    source->path = strdup (path);
+    source->fd = fd;
+    source->period = period;
+    source->read = 0;
+    source->fresh = 0;
+    source->size = HOUSE_SOURCE_BUFFER;
+    source->length = -1;
+    source->buffer = malloc (source->size + HOUSE_SOURCE_PADDING);
+    source->copysize = HOUSE_SOURCE_BUFFER;
+    source->copy = malloc (source->copysize + HOUSE_SOURCE_PADDING);
+    return HouseSourcesCount++;
+}
+
+// Read the whole file, growing the buffer if needed.
+//
+static void houselinux_source_pread (struct HouseSourceFile *source,
+                                     int length) {
+
+    for (;;) {
+        if (length >= source->size - 1) {
+            source->size *= 2;
+            source->buffer = realloc (source->buffer,
+                                      source->size + HOUSE_SOURCE_PADDING);
+        }
+        int chunk = pread (source->fd, source->buffer + length,
+                           source->size - length - 1, length);
+        if (chunk < 0) {
+            source->length = -1;
+            return;
+        }
+        if (chunk == 0) break;
+        length += chunk;
+    }
+    source->buffer[length] = 0;
+    source->length = length;
+}
+
+static long long houselinux_source_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int houselinux_source_due (struct HouseSourceFile *source, time_t now) {
+    return (source->read != now) && (now >= source->read + source->period);
+}
+
+// Submit the reads for all the sources that are due, in as few system
+// calls as possible. A /proc file may be returned in several chunks
+// (typically one page each), so reading stops only when the kernel
+// returns 0 (end of file). Each round submits one read for every source
+// not complete yet: most of the time there are only two rounds.
+// If io_uring fails, the sources not complete yet are read using pread().
+//
+static void houselinux_source_uring (time_t now, int requested) {
+
+    int i;
+    int pending = 0;
+
+    for (i = 0; i < HouseSourcesCount; ++i) {
+        struct HouseSourceFile *source = HouseSources + i;
+        if ((i != requested) && !houselinux_source_due (source, now)) continue;
+        source->length = 0;
+        source->read = -1; // Pending.
+        source->fresh = 1;
+        pending += 1;
+    }
+    long long clock = houselinux_source_now ();
+
+    while (pending > 0) {
+
+        // Queue as many reads as the submission ring can hold.
+        //
+        int count = 0;
+        unsigned tail = *HouseUring.sqtail;
+        unsigned mask = *HouseUring.sqmask;
+        for (i = 0;
+             (i < HouseSourcesCount) && (count < HouseUring.entries); ++i) {
+
+            struct HouseSourceFile *source = HouseSources + i;
+            if (source->read != -1) continue;
+
+            if (source->length >= source->size - 1) {
+                source->size *= 2;
+                source->buffer = realloc (source->buffer,
+                                          source->size + HOUSE_SOURCE_PADDING);
+            }
+            unsigned index = tail & mask;
+            struct io_uring_sqe *sqe = HouseUring.sqes + index;
+            memset (sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = source->fd;
+            sqe->addr = (unsigned long) (source->buffer + source->length);
+            sqe->len = source->size - source->length - 1;
+            sqe->off = source->length;
+            sqe->user_data = i;
+            HouseUring.sqarray[index] = index;
+            tail += 1;
+            count += 1;
+        }
+        __atomic_store_n (HouseUring.sqtail, tail, __ATOMIC_RELEASE);
+
+        if (syscall (__NR_io_uring_enter, HouseUring.fd, count, count,
+                     IORING_ENTER_GETEVENTS, 0, 0) < 0) {
+            houselog_trace (HOUSE_FAILURE, "io_uring",
+                            "submit failed: %s", strerror(errno));
+            HouseSourceUringEnabled = 0;
+            break;
+        }
+
+        unsigned head = __atomic_load_n (HouseUring.cqhead, __ATOMIC_ACQUIRE);
+        while (head != __atomic_load_n (HouseUring.cqtail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe =
+                HouseUring.cqes + (head & *HouseUring.cqmask);
+            struct HouseSourceFile *source = HouseSources + cqe->user_data;
+            if (cqe->res < 0) {
+                if (cqe->res == -EINVAL) {
+                    houselog_trace (HOUSE_WARNING, "io_uring",
+                                    "read not supported");
+                    HouseSourceUringEnabled = 0;
+                }
+                houselinux_source_pread (source, 0);
+                source->read = now;
+                source->clock = clock;
+                pending -= 1;
+            } else if (cqe->res == 0) {
+                source->buffer[source->length] = 0;
+                source->read = now;
+                source->clock = clock;
+                pending -= 1;
+            } else {
+                source->length += cqe->res;
+            }
+            head += 1;
+        }
+        __atomic_store_n (HouseUring.cqhead, head, __ATOMIC_RELEASE);
+    }
+
+    // Whatever is left (io_uring failure) is read synchronously.
+    for (i = 0; i < HouseSourcesCount; ++i) {
+        struct HouseSourceFile *source = HouseSources + i;
+        if (source->read != -1) continue;
+        houselinux_source_pread (source, 0);
+        source->read = now;
+        source->clock = clock;
+    }
+}
+
+static void houselinux_source_record (time_t now) {
+
+    int i;
+    for (i = 0; i < HouseSourcesCount; ++i) {
+        struct HouseSourceFile *source = HouseSources + i;
+        if (!source->fresh) continue;
+        source->fresh = 0;
+        houselinux_recorder_record (i, source->path, now, source->clock,
+                                    source->buffer, source->length);
+    }
+}
+
+static void houselinux_source_batch (time_t now, int requested) {
+
+    if (HouseSourceUringEnabled) {
+        houselinux_source_uring (now, requested);
+    } else {
+        int i;
+        for (i = 0; i < HouseSourcesCount; ++i) {
+            struct HouseSourceFile *source = HouseSources + i;
+            if ((i != requested) && !houselinux_source_due (source, now))
+                continue;
+            source->clock = houselinux_source_now ();
+            houselinux_source_pread (source, 0);
+            source->read = now;
+            source->fresh = 1;
+        }
+    }
+    houselinux_source_record (now);
+}
+
+// Copy the content of the source from the capture being replayed.
+//
+static void houselinux_source_replay (struct HouseSourceFile *source) {
+
+    const char *content =
+        houselinux_recorder_replay_get (source->path, &(source->clock));
+    if (!content) {
+        source->length = -1;
+        return;
+    }
+    int length = strlen (content);
+    if (length >= source->size) {
+        source->size = length + 1;
+        source->buffer = realloc (source->buffer,
+                                  source->size + HOUSE_SOURCE_PADDING);
+    }
+    memcpy (source->buffer, content, length + 1);
+    source->length = length;
+}
+
+char *houselinux_source_get (int source, time_t now) {
+
+    if ((source < 0) || (source >= HouseSourcesCount)) return 0;
+
+    if (houselinux_recorder_replaying ()) {
+        houselinux_source_replay (HouseSources + source);
+    } else if (HouseSources[source].read != now) {
+        houselinux_source_batch (now, source);
+    }
+
+    // The caller modifies the content, e.g. when splitting it in lines,
+    // and the same content may be requested again in the same second:
+    // the original is never given out.
+    struct HouseSourceFile *file = HouseSources + source;
+    if (file->length < 0) return 0;
+    if (file->length >= file->copysize) {
+        file->copysize = file->size;
+        file->copy = realloc (file->copy,
+                              file->copysize + HOUSE_SOURCE_PADDING);
+    }
+    memcpy (file->copy, file->buffer, file->length + 1);
+    return file->copy;
+}
+
+long long houselinux_source_clock (int source) {
+    if ((source < 0) || (source >= HouseSourcesCount)) return 0;
+    return HouseSources[source].clock;
+}
+
+char *houselinux_source_line (char **cursor) {
+
+    char *line = *cursor;
+    if ((!line) || (*line == 0)) return 0;
+
+    char *eol = strchr (line, '\n');
+    if (eol) {
+        *eol = 0;
+        *cursor = eol + 1;
+    } else {
+        *cursor = line + strlen (line);
+    }
+    return line;
+}
+
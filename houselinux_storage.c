@@ -41,8 +41,34 @@
  * int houselinux_storage_details (char *buffer, int size, time_t now, time_t since);
  *
  *    A function that populates a detailed report of the storage in JSON.
+ *
+ * void houselinux_storage_export (void);
+ *
+ *    List the recent history of the storage usage for /metrics/export.
+ *
+ * Each volume is sampled by opening its root using O_PATH, calling
+ * fstatvfs() and closing the descriptor right away: no descriptor is kept
+ * between samples, since an open descriptor would prevent unmounting the
+ * volume ("target is busy"). The autofs mount points are ignored, so that
+ * sampling never triggers an automount (the file systems mounted by autofs
+ * are listed separately).
+ *
+ * A call to a network file system may block when the server is not
+ * reachable. Each call is timed: a volume that takes too long, or fails
+ * with a network error, is classified as unreachable and is not sampled
+ * again until a back-off delay has elapsed (10 minutes, doubling up to
+ * one hour). A volume that responds slowly is classified as slow.
+ *
+ * The health of each file system is checked on every sample: whether it
+ * is mounted read-only (from the options already listed in mountinfo),
+ * and the error counters maintained by ext4 (/sys/fs/ext4/DEVICE) and
+ * btrfs (/sys/fs/btrfs/FSID/devinfo/ID/error_stats). An event is recorded
+ * when a file system becomes read-only or read-write, and when new
+ * errors are counted.
  */
 
+#define _GNU_SOURCE // For O_PATH.
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -52,6 +78,9 @@
 #include <sys/types.h>
 #include <sys/statvfs.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include <echttp.h>
@@ -59,6 +88,9 @@
 
 #include "houselog.h"
 #include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_diskio.h"
+#include "houselinux_export.h"
 #include "houselinux_storage.h"
 
 #define DEBUG if (echttp_isdebug()) printf
@@ -67,6 +99,17 @@
 #define HOUSE_MOUNT_PERIOD 60 // Collect storage metrics every minute.
 #define HOUSE_MOUNT_SPAN    5 // Keep a 5 minutes history.
 
+#define HOUSE_MOUNT_SLOW     1000 // ms: a volume slower than this is slow.
+#define HOUSE_MOUNT_TIMEOUT  5000 // ms: a volume slower than this is unreachable.
+#define HOUSE_MOUNT_BACKOFF   600 // Initial delay before retrying, doubles.
+#define HOUSE_MOUNT_BACKOFF_MAX 3600
+
+#define HOUSE_MOUNT_OK          0
+#define HOUSE_MOUNT_SLOWSTATE   1
+#define HOUSE_MOUNT_UNREACHABLE 2
+
+static const char *HouseMountStates[] = {"ok", "slow", "unreachable"};
+
 
 struct HouseMountMetrics {
     time_t timestamps[HOUSE_MOUNT_SPAN];
@@ -74,18 +117,37 @@ struct HouseMountMetrics {
     long long free[HOUSE_MOUNT_SPAN];
 };
 
+struct HouseMountHealth {
+    int readonly;
+    char *path;      // The ext4 or btrfs sysfs directory, 0 if none.
+    long long errors;   // -1 if unknown.
+    long long written;  // MB written during the file system's life, or -1.
+};
+
 struct HouseMountPoint {
     time_t detected;
+    int id;          // The mount ID, changes when remounted.
+    int state;
+    int backoff;
+    time_t retry;    // When an unreachable volume is tried again.
     char *dev;
     char *mount;
     char *fs;
+    int diskio;      // -1 if not a block device.
+    char device[32]; // The block device (partition, volume, etc.)
+    char disk[32];   // The physical disk that holds that block device.
     struct HouseMountMetrics metrics;
+    struct HouseMountHealth health;
 };
 
 static struct HouseMountPoint HouseMountPoints[HOUSE_MOUNT_MAX];
 
 void houselinux_storage_initialize (int argc, const char **argv) {
-    // TBD
+    int i;
+    for (i = HOUSE_MOUNT_MAX - 1; i >= 0; --i) {
+        HouseMountPoints[i].health.errors = -1;
+        HouseMountPoints[i].health.written = -1;
+    }
 }
 
 // Calculate storage space information (total, free, %used).
@@ -106,6 +168,28 @@ static long long houselinux_storage_total (const struct statvfs *fs) {
     return (long long)(fs->f_blocks) * fs->f_frsize;
 }
 
+// Report which block device holds this volume, and its IO rates.
+// This links the volume to the disk section.
+//
+static int houselinux_storage_diskio (char *buffer, int size,
+                                      const struct HouseMountPoint *mount,
+                                      time_t now, time_t since) {
+
+    if (mount->diskio < 0) return 0;
+
+    int cursor = snprintf (buffer, size, ",\"device\":\"%s\"", mount->device);
+    if (cursor >= size) return 0;
+    if (strcmp (mount->device, mount->disk)) {
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            ",\"disk\":\"%s\"", mount->disk);
+        if (cursor >= size) return 0;
+    }
+    cursor += houselinux_diskio_report (buffer+cursor, size-cursor,
+                                        mount->diskio, now, since);
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
 int houselinux_storage_summary (char *buffer, int size) {
 
     int cursor;
@@ -135,9 +219,11 @@ int houselinux_storage_summary (char *buffer, int size) {
                                       metrics->free, percentage);
 
         int start = cursor;
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "free", percentage,
-                                          HOUSE_MOUNT_SPAN, "%");
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "free",
+                                                 metrics->timestamps,
+                                                 percentage,
+                                                 HOUSE_MOUNT_SPAN, "%");
         if (cursor > start)
             buffer[start] = '{'; // overwrite the initial ','.
         else
@@ -154,6 +240,40 @@ int houselinux_storage_summary (char *buffer, int size) {
     return saved;
 }
 
+static int houselinux_storage_state (char *buffer, int size,
+                                     const struct HouseMountPoint *mount) {
+
+    if (mount->state == HOUSE_MOUNT_OK) return 0;
+
+    int cursor = snprintf (buffer, size, ",\"state\":\"%s\"",
+                           HouseMountStates[mount->state]);
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+static int houselinux_storage_health (char *buffer, int size,
+                                      const struct HouseMountPoint *mount) {
+
+    const struct HouseMountHealth *health = &(mount->health);
+    int cursor = 0;
+
+    if (health->readonly) {
+        cursor += snprintf (buffer, size, ",\"readonly\":true");
+        if (cursor >= size) return 0;
+    }
+    if (health->errors >= 0) {
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            ",\"errors\":[%lld,\"errors\"]", health->errors);
+        if (cursor >= size) return 0;
+    }
+    if (health->written >= 0) {
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            ",\"written\":[%lld,\"MB\"]", health->written);
+        if (cursor >= size) return 0;
+    }
+    return cursor;
+}
+
 int houselinux_storage_status (char *buffer, int size) {
 
     int cursor;
@@ -178,10 +298,18 @@ int houselinux_storage_status (char *buffer, int size) {
                             sep, HouseMountPoints[v].mount, metrics->size);
         if (cursor >= size) break;
 
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "free",
-                                          metrics->free,
-                                          HOUSE_MOUNT_SPAN, "MB");
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "free",
+                                                 metrics->timestamps,
+                                                 metrics->free,
+                                                 HOUSE_MOUNT_SPAN, "MB");
+
+        cursor += houselinux_storage_diskio (buffer+cursor, size-cursor,
+                                             HouseMountPoints + v, 0, 0);
+        cursor += houselinux_storage_state (buffer+cursor, size-cursor,
+                                            HouseMountPoints + v);
+        cursor += houselinux_storage_health (buffer+cursor, size-cursor,
+                                             HouseMountPoints + v);
 
         cursor += snprintf (buffer+cursor, size-cursor, "}");
         if (cursor >= size) break;
@@ -226,6 +354,13 @@ int houselinux_storage_details (char *buffer, int size,
                       metrics->timestamps,
                       metrics->free);
 
+        cursor += houselinux_storage_diskio (buffer+cursor, size-cursor,
+                                             HouseMountPoints + v, now, since);
+        cursor += houselinux_storage_state (buffer+cursor, size-cursor,
+                                            HouseMountPoints + v);
+        cursor += houselinux_storage_health (buffer+cursor, size-cursor,
+                                             HouseMountPoints + v);
+
         cursor += snprintf (buffer+cursor, size-cursor, "}");
         if (cursor >= size) break;
         saved = cursor;
@@ -237,14 +372,302 @@ int houselinux_storage_details (char *buffer, int size,
     return saved;
 }
 
+void houselinux_storage_export (void) {
+
+    int v;
+    for (v = 0; v < HOUSE_MOUNT_MAX; ++v) {
+
+        if (! HouseMountPoints[v].detected) continue;
+
+        struct HouseMountMetrics *metrics = &(HouseMountPoints[v].metrics);
+        if (metrics->size == 0) continue; // Ignore pseudo FS without storage.
+
+        char name[128];
+        snprintf (name, sizeof(name),
+                  "storage.%s.free", HouseMountPoints[v].mount);
+        houselinux_export_series (name, "MB", HOUSE_MOUNT_SPAN,
+                                  metrics->timestamps, metrics->free);
+    }
+}
+
 static int houselinux_storage_path_match (const char *value, const char *ref) {
     while ((*(ref++) == *(value++)) && (*ref > 0)) ;
     if ((*ref != 0) || ((*value != 0) && (*value != '/'))) return 0;
     return 1;
 }
 
+static int houselinux_storage_basename (const char *path,
+                                       char *name, int size) {
+    char target[512];
+    int length = readlink (path, target, sizeof(target)-1);
+    if (length <= 0) return 0;
+    target[length] = 0;
+    char *base = strrchr (target, '/');
+    base = base ? base + 1 : target;
+    if (strlen(base) >= size) return 0;
+    strcpy (name, base);
+    return 1;
+}
+
+// Find the physical disk that holds the specified block device.
+// A partition's disk is its parent in /sys. A device mapper (LVM, crypt)
+// or RAID volume is resolved through the devices listed in its slaves
+// directory (only the first one is considered).
+//
+static void houselinux_storage_disk (const char *device,
+                                     char *disk, int size, int depth) {
+
+    char path[512];
+    snprintf (disk, size, "%s", device); // Default: a disk itself.
+    if (depth > 4) return; // Guardrail.
+
+    snprintf (path, sizeof(path), "/sys/class/block/%s/partition", device);
+    if (!access (path, F_OK)) {
+        char target[512];
+        snprintf (path, sizeof(path), "/sys/class/block/%s", device);
+        int length = readlink (path, target, sizeof(target)-1);
+        if (length <= 0) return;
+        target[length] = 0;
+        char *sep = strrchr (target, '/');
+        if (!sep) return;
+        *sep = 0; // Remove the partition's name.
+        sep = strrchr (target, '/');
+        snprintf (disk, size, "%s", sep ? sep + 1 : target);
+        return;
+    }
+
+    snprintf (path, sizeof(path), "/sys/class/block/%s/slaves", device);
+    DIR *dir = opendir (path);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir (dir))) {
+        if (entry->d_name[0] == '.') continue;
+        houselinux_storage_disk (entry->d_name, disk, size, depth + 1);
+        break;
+    }
+    closedir (dir);
+}
+
+// Resolve the block device that holds this mount point, so that
+// the IO rates for this volume can be reported. This is only done when
+// the mount point is detected or changed.
+//
+static void houselinux_storage_resolve (struct HouseMountPoint *mount,
+                                        int fd) {
+
+    mount->diskio = -1;
+    mount->device[0] = mount->disk[0] = 0;
+
+    struct stat fileinfo;
+    if (fd < 0) return;
+    if (fstat (fd, &fileinfo)) return;
+
+    int devmajor = major (fileinfo.st_dev);
+    int devminor = minor (fileinfo.st_dev);
+    if (devmajor == 0) return; // Not backed by a block device.
+
+    char path[128];
+    snprintf (path, sizeof(path), "/sys/dev/block/%d:%d", devmajor, devminor);
+    if (!houselinux_storage_basename (path,
+                                      mount->device, sizeof(mount->device)))
+        return;
+
+    houselinux_storage_disk (mount->device, mount->disk, sizeof(mount->disk), 0);
+    mount->diskio = houselinux_diskio_track (devmajor, devminor, mount->device);
+    DEBUG ("Volume %s is on device %s (%d:%d), disk %s\n",
+           mount->mount, mount->device, devmajor, devminor, mount->disk);
+}
+
+// Find where the file system's health counters are, if any. Only ext4
+// and btrfs are supported: both are identified by their block device.
+//
+static void houselinux_storage_health_resolve (struct HouseMountPoint *mount) {
+
+    struct HouseMountHealth *health = &(mount->health);
+    if (health->path) free (health->path);
+    health->path = 0;
+    health->errors = health->written = -1;
+
+    if (!mount->device[0]) return;
+
+    char path[512];
+    if (!strcmp (mount->fs, "ext4")) {
+        snprintf (path, sizeof(path), "/sys/fs/ext4/%s", mount->device);
+        if (!access (path, F_OK)) health->path = strdup (path);
+
+    } else if (!strcmp (mount->fs, "btrfs")) {
+        DIR *dir = opendir ("/sys/fs/btrfs");
+        if (!dir) return;
+        struct dirent *entry;
+        while ((entry = readdir (dir))) {
+            if (entry->d_name[0] == '.') continue;
+            snprintf (path, sizeof(path), "/sys/fs/btrfs/%s/devices/%s",
+                      entry->d_name, mount->device);
+            if (access (path, F_OK)) continue;
+            snprintf (path, sizeof(path), "/sys/fs/btrfs/%s", entry->d_name);
+            health->path = strdup (path);
+            break;
+        }
+        closedir (dir);
+    }
+    if (health->path)
+        DEBUG ("Volume %s health from %s\n", mount->mount, health->path);
+}
+
+static long long houselinux_storage_counter (const char *path) {
+    FILE *f = fopen (path, "r");
+    if (!f) return -1;
+    long long value = -1;
+    if (fscanf (f, "%lld", &value) != 1) value = -1;
+    fclose (f);
+    return value;
+}
+
+// Add all the error counters of all the devices of a btrfs file system.
+//
+static long long houselinux_storage_btrfs_errors (const char *base) {
+
+    char path[512];
+    snprintf (path, sizeof(path), "%s/devinfo", base);
+    DIR *dir = opendir (path);
+    if (!dir) return -1;
+
+    long long total = -1;
+    struct dirent *entry;
+    while ((entry = readdir (dir))) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf (path, sizeof(path),
+                  "%s/devinfo/%s/error_stats", base, entry->d_name);
+        FILE *f = fopen (path, "r");
+        if (!f) continue;
+        char name[64];
+        long long value;
+        while (fscanf (f, "%63s %lld", name, &value) == 2) {
+            if (total < 0) total = 0;
+            total += value;
+        }
+        fclose (f);
+    }
+    closedir (dir);
+    return total;
+}
+
+static void houselinux_storage_health_read (struct HouseMountPoint *mount) {
+
+    struct HouseMountHealth *health = &(mount->health);
+    if (!health->path) return;
+
+    char path[512];
+    long long errors;
+    if (!strcmp (mount->fs, "ext4")) {
+        snprintf (path, sizeof(path), "%s/errors_count", health->path);
+        errors = houselinux_storage_counter (path);
+        snprintf (path, sizeof(path), "%s/lifetime_write_kbytes", health->path);
+        long long written = houselinux_storage_counter (path);
+        health->written = (written < 0) ? -1 : written / 1024;
+    } else {
+        errors = houselinux_storage_btrfs_errors (health->path);
+    }
+
+    if ((health->errors >= 0) && (errors > health->errors)) {
+        houselog_event ("STORAGE", mount->mount, "ERRORS",
+                        "%s on %s: %lld NEW ERRORS (TOTAL %lld)",
+                        mount->fs, mount->device,
+                        errors - health->errors, errors);
+    }
+    health->errors = errors;
+}
+
+// Detect when a file system is remounted read-only (typically on
+// errors) or read-write. Only changes are reported.
+//
+static void houselinux_storage_readonly (struct HouseMountPoint *mount,
+                                         int readonly, int changed) {
+
+    if (!changed && (readonly != mount->health.readonly)) {
+        houselog_event ("STORAGE", mount->mount,
+                        readonly ? "READ-ONLY" : "READ-WRITE",
+                        "%s ON %s", mount->fs, mount->dev);
+    }
+    mount->health.readonly = readonly;
+}
+
+static int houselinux_storage_options_ro (const char *options) {
+    return (!strncmp (options, "ro", 2)) && ((options[2] == 0) || (options[2] == ','));
+}
+
+static long long houselinux_storage_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static int houselinux_storage_neterror (int error) {
+    switch (error) {
+        case EIO:
+        case ESTALE:
+        case ETIMEDOUT:
+        case ENOTCONN:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+            return 1;
+    }
+    return 0;
+}
+
+// Classify the volume based on the outcome of the latest access.
+//
+static void houselinux_storage_classify (struct HouseMountPoint *mount,
+                                         int error, long long elapsed,
+                                         time_t now) {
+
+    int state = HOUSE_MOUNT_OK;
+    if ((elapsed > HOUSE_MOUNT_TIMEOUT) || houselinux_storage_neterror (error))
+        state = HOUSE_MOUNT_UNREACHABLE;
+    else if (elapsed > HOUSE_MOUNT_SLOW)
+        state = HOUSE_MOUNT_SLOWSTATE;
+
+    if (state == HOUSE_MOUNT_UNREACHABLE) {
+        mount->backoff = mount->backoff ? mount->backoff * 2 : HOUSE_MOUNT_BACKOFF;
+        if (mount->backoff > HOUSE_MOUNT_BACKOFF_MAX)
+            mount->backoff = HOUSE_MOUNT_BACKOFF_MAX;
+        mount->retry = now + mount->backoff;
+    } else {
+        mount->backoff = 0;
+    }
+
+    if (state == mount->state) return;
+    if (state == HOUSE_MOUNT_UNREACHABLE) {
+        houselog_event ("STORAGE", mount->mount, "UNREACHABLE",
+                        "%s (%s after %lld ms)", mount->fs,
+                        error ? strerror(error) : "no response", elapsed);
+    } else if (mount->state == HOUSE_MOUNT_UNREACHABLE) {
+        houselog_event ("STORAGE", mount->mount, "RECOVERED",
+                        "%s (%lld ms)", mount->fs, elapsed);
+    }
+    mount->state = state;
+}
+
+// Open the root of the volume, for a short time only: the caller must
+// close the descriptor, or else the volume cannot be unmounted. Return -1
+// on failure, or if the volume must not be accessed.
+//
+static int houselinux_storage_open (struct HouseMountPoint *mount) {
+
+    if (!strcmp (mount->fs, "autofs")) return -1; // Never trigger an automount.
+
+    return open (mount->mount, O_PATH | O_NOFOLLOW | O_DIRECTORY | O_CLOEXEC);
+}
+
+static void houselinux_storage_reset (struct HouseMountPoint *mount) {
+    mount->state = HOUSE_MOUNT_OK;
+    mount->backoff = 0;
+    mount->retry = 0;
+}
+
 static void houselinux_storage_register_mount
-               (time_t now, const char *dev, const char *mount, const char *fs) {
+               (time_t now, int id, int readonly,
+                const char *dev, const char *mount, const char *fs) {
    int changed = 0;
 
    // We want to detect existing mount points and just update them.
@@ -256,6 +679,7 @@ static void houselinux_storage_register_mount
        else if (!strcmp (HouseMountPoints[i].mount, mount)) break;
    }
    if (i >= 0) { // Update the existing mount point.
+       if (HouseMountPoints[i].id != id) changed = 1; // Remounted.
        if (strcmp (HouseMountPoints[i].dev, dev)) {
            free (HouseMountPoints[i].dev);
            HouseMountPoints[i].dev = strdup(dev);
@@ -279,7 +703,14 @@ static void houselinux_storage_register_mount
        int j;
        for (j = HOUSE_MOUNT_SPAN-1; j >= 0; --j)
            HouseMountPoints[i].metrics.timestamps[j] = 0;
+       HouseMountPoints[i].id = id;
+       houselinux_storage_reset (HouseMountPoints + i);
+       int fd = houselinux_storage_open (HouseMountPoints + i);
+       houselinux_storage_resolve (HouseMountPoints + i, fd);
+       if (fd >= 0) close (fd);
+       houselinux_storage_health_resolve (HouseMountPoints + i);
    }
+   houselinux_storage_readonly (HouseMountPoints + i, readonly, changed);
 }
 
 static void houselinux_storage_prune_mount (time_t now) {
@@ -289,6 +720,7 @@ static void houselinux_storage_prune_mount (time_t now) {
         if (HouseMountPoints[i].detected <= 0) continue; // Unused.
         if (HouseMountPoints[i].detected < now) {
             HouseMountPoints[i].detected = 0;
+            houselinux_storage_reset (HouseMountPoints + i);
             if (HouseMountPoints[i].dev) {
                 free (HouseMountPoints[i].dev);
                 HouseMountPoints[i].dev = 0;
@@ -301,6 +733,10 @@ static void houselinux_storage_prune_mount (time_t now) {
                 free (HouseMountPoints[i].fs);
                 HouseMountPoints[i].fs = 0;
             }
+            if (HouseMountPoints[i].health.path) {
+                free (HouseMountPoints[i].health.path);
+                HouseMountPoints[i].health.path = 0;
+            }
         }
     }
 }
@@ -357,7 +793,14 @@ static void houselinux_storage_enumerate (time_t now) {
         char *fs = argv[i+1];
         char *dev = argv[i+2];
 
-        houselinux_storage_register_mount (now, dev, mount, fs);
+        // A file system remounted read-only on errors shows in its
+        // super block options, while the mount options may still be rw.
+        int readonly = houselinux_storage_options_ro (argv[5]);
+        if ((i < argc-3) && houselinux_storage_options_ro (argv[i+3]))
+            readonly = 1;
+
+        houselinux_storage_register_mount
+            (now, atoi(argv[0]), readonly, dev, mount, fs);
     }
     fclose(f);
     houselinux_storage_prune_mount (now);
@@ -377,15 +820,39 @@ void houselinux_storage_background (time_t now) {
     int i;
     for (i = HOUSE_MOUNT_MAX - 1; i >= 0; --i) {
 
-        if (HouseMountPoints[i].detected <= 0) continue;
+        struct HouseMountPoint *mount = HouseMountPoints + i;
+        if (mount->detected <= 0) continue;
+
+        houselinux_storage_health_read (mount);
 
+        if (!strcmp (mount->fs, "autofs")) continue;
+        if ((mount->state == HOUSE_MOUNT_UNREACHABLE) && (now < mount->retry))
+            continue;
+
+        // A failed open is retried on the next sample.
         struct statvfs storage;
-        if (statvfs (HouseMountPoints[i].mount, &storage)) continue ;
+        long long start = houselinux_storage_clock ();
+        int fd = houselinux_storage_open (mount);
+        int failed = (fd < 0) || fstatvfs (fd, &storage);
+        int error = failed ? errno : 0;
+        if (fd >= 0) close (fd);
+        houselinux_storage_classify (mount, error,
+                                     houselinux_storage_clock () - start, now);
+        if (failed) continue;
 
         struct HouseMountMetrics *metrics = &(HouseMountPoints[i].metrics);
         metrics->size = houselinux_storage_total (&storage) / (1024 * 1024);
         metrics->free[index] = houselinux_storage_free (&storage) / (1024 * 1024);
         metrics->timestamps[index] = now;
+
+        if (metrics->size > 0) {
+            char name[256];
+            snprintf (name, sizeof(name),
+                      "storage.%s.free", HouseMountPoints[i].mount);
+            houselinux_sample (name,
+                               (100 * metrics->free[index]) / metrics->size,
+                               "%", now);
+        }
     }
 }
 
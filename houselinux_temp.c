@@ -40,6 +40,10 @@
  * int houselinux_temp_details (char *buffer, int size, time_t now, time_t since);
  *
  *    A function that populates a detailed report of the temperatures in JSON.
+ *
+ * void houselinux_temp_export (void);
+ *
+ *    List the recent history of the temperatures for /metrics/export.
  */
 
 #include <string.h>
@@ -47,14 +51,14 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <time.h>
-#include <unistd.h>
 
 #include "houselog.h"
 #include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_source.h"
+#include "houselinux_export.h"
 #include "houselinux_temp.h"
 
-#include "houselog_sensor.h"
-
 #define HOUSE_TEMP_PERIOD  5 // Sample temperature metrics every 5 seconds.
 #define HOUSE_TEMP_SPAN   60 // MUST KEEP A 5 MINUTES HISTORY.
 
@@ -66,12 +70,15 @@ struct HouseTempMetrics {
 
 static struct HouseTempMetrics HouseTempLatest;
 
-static char HouseTempCpuPath[512] = {0};
-static char HouseTempGpuPath[512] = {0};
+static int HouseTempCpuSource = -1;
+static int HouseTempGpuSource = -1;
 
 void houselinux_temp_initialize (int argc, const char **argv) {
 
     // Find out which sensors represent the CPU and GPU (if any).
+    // If there are several, the last one is used.
+    char cpupath[512] = {0};
+    char gpupath[512] = {0};
     int i;
     for (i = 0; i < 32; ++i) {
         char path[512];
@@ -97,14 +104,20 @@ void houselinux_temp_initialize (int argc, const char **argv) {
             is_gpu = 1;
         }
         if (is_cpu) {
-            snprintf (HouseTempCpuPath, sizeof(HouseTempCpuPath),
+            snprintf (cpupath, sizeof(cpupath),
                       "/sys/class/hwmon/hwmon%d/temp1_input", i);
         } else if (is_gpu) {
-            snprintf (HouseTempGpuPath, sizeof(HouseTempGpuPath),
+            snprintf (gpupath, sizeof(gpupath),
                       "/sys/class/hwmon/hwmon%d/temp1_input", i);
         }
         fclose (f);
     }
+    if (cpupath[0])
+        HouseTempCpuSource =
+            houselinux_source_register (cpupath, HOUSE_TEMP_PERIOD);
+    if (gpupath[0])
+        HouseTempGpuSource =
+            houselinux_source_register (gpupath, HOUSE_TEMP_PERIOD);
 }
 
 int houselinux_temp_status (char *buffer, int size) {
@@ -115,19 +128,21 @@ int houselinux_temp_status (char *buffer, int size) {
     if (cursor >= size) return 0;
     int start = cursor;
 
-    if (HouseTempCpuPath[0]) {
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "cpu",
-                                          HouseTempLatest.cpu,
-                                          HOUSE_TEMP_SPAN, "mC");
+    if (HouseTempCpuSource >= 0) {
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "cpu",
+                                                 HouseTempLatest.timestamp,
+                                                 HouseTempLatest.cpu,
+                                                 HOUSE_TEMP_SPAN, "mC");
         if (cursor >= size) return 0;
     }
 
-    if (HouseTempGpuPath[0]) {
-        cursor += houselinux_reduce_json (buffer+cursor, size-cursor,
-                                          "gpu",
-                                          HouseTempLatest.gpu,
-                                          HOUSE_TEMP_SPAN, "mC");
+    if (HouseTempGpuSource >= 0) {
+        cursor += houselinux_reduce_recent_json (buffer+cursor, size-cursor,
+                                                 "gpu",
+                                                 HouseTempLatest.timestamp,
+                                                 HouseTempLatest.gpu,
+                                                 HOUSE_TEMP_SPAN, "mC");
         if (cursor >= size) return 0;
     }
 
@@ -153,7 +168,7 @@ int houselinux_temp_details (char *buffer, int size, time_t now, time_t since) {
 
     int start = cursor;
 
-    if (HouseTempCpuPath[0]) {
+    if (HouseTempCpuSource >= 0) {
         cursor += houselinux_reduce_details_json (buffer+cursor, size-cursor,
                                                   since, "cpu", "mC", now,
                                                   HOUSE_TEMP_PERIOD, HOUSE_TEMP_SPAN,
@@ -162,7 +177,7 @@ int houselinux_temp_details (char *buffer, int size, time_t now, time_t since) {
         if (cursor >= size) return 0;
     }
 
-    if (HouseTempGpuPath[0]) {
+    if (HouseTempGpuSource >= 0) {
         cursor += houselinux_reduce_details_json (buffer+cursor, size-cursor,
                                                   since, "gpu", "mC", now,
                                                   HOUSE_TEMP_PERIOD, HOUSE_TEMP_SPAN,
@@ -180,69 +195,43 @@ int houselinux_temp_details (char *buffer, int size, time_t now, time_t since) {
     return cursor;
 }
 
-static void houselinux_temp_read (const char *path, long long *item) {
+void houselinux_temp_export (void) {
+    if (HouseTempCpuSource >= 0)
+        houselinux_export_series ("temp.cpu", "mC", HOUSE_TEMP_SPAN,
+                                  HouseTempLatest.timestamp,
+                                  HouseTempLatest.cpu);
+    if (HouseTempGpuSource >= 0)
+        houselinux_export_series ("temp.gpu", "mC", HOUSE_TEMP_SPAN,
+                                  HouseTempLatest.timestamp,
+                                  HouseTempLatest.gpu);
+}
+
+static void houselinux_temp_read (int source, time_t now, long long *item) {
 
-    *item = 0;
-    FILE *f = fopen (path, "r");
-    if (!f) return;
-    char buffer[512];
-    char *line = fgets (buffer, sizeof(buffer), f);
-    fclose (f);
-    *item = atoll (line);
+    char *data = houselinux_source_get (source, now);
+    *item = data ? atoll (data) : 0;
 }
 
 void houselinux_temp_background (time_t now) {
 
     static time_t NextTempCollect = 0;
-    static time_t NextTempRecord = 0;
-    static char LocalHost[256] = {0};
 
     if (now >= NextTempCollect) {
 
         NextTempCollect = now + HOUSE_TEMP_PERIOD;
         int index = (now / HOUSE_TEMP_PERIOD) % HOUSE_TEMP_SPAN;
 
-        if (HouseTempCpuPath[0])
-            houselinux_temp_read (HouseTempCpuPath, HouseTempLatest.cpu + index);
-        if (HouseTempGpuPath[0])
-            houselinux_temp_read (HouseTempGpuPath, HouseTempLatest.gpu + index);
-        HouseTempLatest.timestamp[index] = now;
-    }
-
-    // Record the CPU temperature's average value as sensor data.
-    // This is to plug in with any application consoming sensor data.
-
-    if (!NextTempRecord) {
-        houselog_sensor_initialize ("metrics", 0, 0);
-        gethostname (LocalHost, sizeof(LocalHost));
-        int collectioninterval = HOUSE_TEMP_PERIOD * HOUSE_TEMP_SPAN;
-        NextTempRecord = now + collectioninterval;
-
-        // Record data at multiple of the collection interval.
-        if (NextTempRecord % collectioninterval) {
-           NextTempRecord -= NextTempRecord % collectioninterval;
-           NextTempRecord += collectioninterval;
+        if (HouseTempCpuSource >= 0) {
+            houselinux_temp_read (HouseTempCpuSource, now,
+                                  HouseTempLatest.cpu + index);
+            houselinux_sample ("temp.cpu", HouseTempLatest.cpu[index], "mC", now);
         }
+        if (HouseTempGpuSource >= 0) {
+            houselinux_temp_read (HouseTempGpuSource, now,
+                                  HouseTempLatest.gpu + index);
+            houselinux_sample ("temp.gpu", HouseTempLatest.gpu[index], "mC", now);
+        }
+        HouseTempLatest.timestamp[index] = now;
     }
-
-    if (now >= NextTempRecord) {
-
-        NextTempRecord = now + (HOUSE_TEMP_PERIOD * HOUSE_TEMP_SPAN);
-
-        struct timeval timestamp;
-        timestamp.tv_sec = now;
-        timestamp.tv_usec = 0;
-
-        int i;
-        long long total = 0;
-        for (i = HOUSE_TEMP_SPAN - 1; i >= 0; --i)
-            total += HouseTempLatest.cpu[i];
-        long long average = total / (1000 * HOUSE_TEMP_SPAN);
-
-        houselog_sensor_numeric
-            (&timestamp, LocalHost, "temp.cpu", average, "°C");
-        houselog_sensor_flush ();
-    }
-    houselog_sensor_background (now);
 }
 
@@ -25,4 +25,5 @@ void houselinux_temp_background (time_t now);
 int houselinux_temp_summary (char *buffer, int size);
 int houselinux_temp_status (char *buffer, int size);
 int houselinux_temp_details (char *buffer, int size, time_t now, time_t since);
+void houselinux_temp_export (void);
 
@@ -0,0 +1,475 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_vm.c - Collect per-VM metrics on a KVM host.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_vm_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module.
+ *
+ * void houselinux_vm_background (time_t now);
+ *
+ *    The periodic function that manages the collect of metrics.
+ *
+ * int houselinux_vm_summary (char *buffer, int size);
+ *
+ *    A function that populates a short summary of the VMs in JSON.
+ *
+ * int houselinux_vm_status (char *buffer, int size);
+ *
+ *    A function that populates a status overview of the VMs in JSON.
+ *
+ * int houselinux_vm_details (char *buffer, int size, time_t now, time_t since);
+ *
+ *    A function that populates a full detail report of the VMs in JSON.
+ *
+ * void houselinux_vm_export (void);
+ *
+ *    List the recent history of the virtual machines for /metrics/export.
+ *
+ * The VMs are found by listing the cgroups in machine.slice, where
+ * libvirt and systemd-machined place each VM (one scope per VM). Only
+ * cgroup v2 (unified hierarchy) is supported. The list of VMs is
+ * refreshed once a minute.
+ *
+ * The CPU usage, memory and I/O are read from the VM's cgroup files.
+ * The run queue wait is the time the vCPU threads were ready to run but
+ * waited for a host CPU, as reported in /proc/TID/schedstat. The vCPU
+ * threads are the threads of the VM's cgroup that QEMU named "CPU N/KVM".
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_reduce.h"
+#include "houselinux_sample.h"
+#include "houselinux_export.h"
+#include "houselinux_vm.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_VM_MAX       32
+#define HOUSE_VM_VCPUS     64 // vCPU threads per VM.
+#define HOUSE_VM_PERIOD     5 // Sample VM metrics every 5 seconds.
+#define HOUSE_VM_SPAN      60 // MUST KEEP A 5 MINUTES HISTORY.
+#define HOUSE_VM_RESOLVE   60 // Search for new VMs every minute.
+
+#define HOUSE_VM_SLICE "/sys/fs/cgroup/machine.slice"
+
+struct HouseVmMetrics {
+    char name[64];
+    char *scope;
+    int dirfd;
+    int present;  // Used when refreshing the list of VMs.
+    int baseline; // Are the previous values valid?
+    int vcpucount;
+    pid_t vcpus[HOUSE_VM_VCPUS];
+    long long usage;  // Microseconds.
+    long long wait;   // Nanoseconds.
+    long long rdbytes;
+    long long wrbytes;
+    time_t timestamps[HOUSE_VM_SPAN];
+    long long cpu[HOUSE_VM_SPAN];
+    long long runwait[HOUSE_VM_SPAN];
+    long long memory[HOUSE_VM_SPAN];
+    long long rdrate[HOUSE_VM_SPAN];
+    long long wrrate[HOUSE_VM_SPAN];
+};
+
+static struct HouseVmMetrics HouseVmLatest[HOUSE_VM_MAX];
+static int                   HouseVmLatestCount = 0;
+
+static time_t HouseVmResolve = 0;
+static struct timespec HouseVmPrevious = {0, 0};
+
+
+void houselinux_vm_initialize (int argc, const char **argv) {
+    // Nothing to initialize: the VMs are discovered at run time.
+}
+
+static int houselinux_vm_read (int dirfd, const char *name,
+                               char *buffer, int size) {
+
+    int fd = openat (dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int length = read (fd, buffer, size - 1);
+    close (fd);
+    if (length < 0) return -1;
+    buffer[length] = 0;
+    return length;
+}
+
+// Decode the VM name from the scope name. The scope name is escaped
+// the systemd way, e.g. "machine-qemu\x2d1\x2dubuntu.scope".
+// The libvirt "qemu-N-" prefix is removed, leaving "ubuntu".
+//
+static void houselinux_vm_name (struct HouseVmMetrics *vm, const char *scope) {
+
+    char decoded[256];
+    int length = 0;
+    const char *s = scope;
+    if (!strncmp (s, "machine-", 8)) s += 8;
+    while (*s && (length < sizeof(decoded) - 1)) {
+        if ((s[0] == '\\') && (s[1] == 'x')
+                && isxdigit (s[2]) && isxdigit (s[3])) {
+            char hex[3] = {s[2], s[3], 0};
+            decoded[length++] = (char) strtol (hex, 0, 16);
+            s += 4;
+        } else {
+            decoded[length++] = *(s++);
+        }
+    }
+    decoded[length] = 0;
+    char *suffix = strstr (decoded, ".scope");
+    if (suffix) *suffix = 0;
+
+    char *name = decoded;
+    if (!strncmp (name, "qemu-", 5) && isdigit (name[5])) {
+        char *sep = strchr (name + 5, '-');
+        if (sep) name = sep + 1;
+    }
+    int namelength = strlen (name);
+    if (namelength >= sizeof(vm->name)) namelength = sizeof(vm->name) - 1;
+    memcpy (vm->name, name, namelength);
+    vm->name[namelength] = 0;
+    char *c;
+    for (c = vm->name; *c; ++c) {
+        if ((*c == '"') || (*c == '\\') || (*c < ' ')) *c = '_';
+    }
+}
+
+static int houselinux_vm_isvcpu (pid_t tid) {
+
+    char path[64];
+    char comm[32];
+    snprintf (path, sizeof(path), "/proc/%d/comm", tid);
+    int length = houselinux_vm_read (AT_FDCWD, path, comm, sizeof(comm));
+    if (length <= 0) return 0;
+    return !strncmp (comm, "CPU ", 4);
+}
+
+// List the vCPU threads of this VM, by walking the VM's cgroup tree.
+// libvirt places the vCPU threads in threaded sub-cgroups, so all the
+// cgroup.threads files in the tree are considered.
+//
+static void houselinux_vm_threads (struct HouseVmMetrics *vm,
+                                   int dirfd, int depth) {
+
+    char buffer[4096];
+    if (houselinux_vm_read (dirfd, "cgroup.threads", buffer, sizeof(buffer)) > 0) {
+        char *cursor = buffer;
+        while (*cursor && (vm->vcpucount < HOUSE_VM_VCPUS)) {
+            pid_t tid = atoi (cursor);
+            if ((tid > 0) && houselinux_vm_isvcpu (tid))
+                vm->vcpus[vm->vcpucount++] = tid;
+            cursor = strchr (cursor, '\n');
+            if (!cursor) break;
+            cursor += 1;
+        }
+    }
+    if (depth >= 3) return; // Guardrail.
+
+    int fd = openat (dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    DIR *dir = fdopendir (fd);
+    if (!dir) {
+        close (fd);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir (dir))) {
+        if (entry->d_type != DT_DIR) continue;
+        if (entry->d_name[0] == '.') continue;
+        int subfd = openat (dirfd, entry->d_name,
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (subfd < 0) continue;
+        houselinux_vm_threads (vm, subfd, depth + 1);
+        close (subfd);
+    }
+    closedir (dir);
+}
+
+static void houselinux_vm_forget (int index) {
+
+    struct HouseVmMetrics *vm = HouseVmLatest + index;
+    DEBUG ("VM %s: forget\n", vm->name);
+    houselog_event ("VM", vm->name, "GONE", "");
+    close (vm->dirfd);
+    free (vm->scope);
+    HouseVmLatestCount -= 1;
+    if (index < HouseVmLatestCount)
+        *vm = HouseVmLatest[HouseVmLatestCount];
+}
+
+static void houselinux_vm_resolve (time_t now) {
+
+    HouseVmResolve = now + HOUSE_VM_RESOLVE;
+
+    DIR *slice = opendir (HOUSE_VM_SLICE);
+    if (!slice) return; // Not a KVM host (or not cgroup v2).
+
+    int i;
+    for (i = 0; i < HouseVmLatestCount; ++i) HouseVmLatest[i].present = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir (slice))) {
+        const char *suffix = strstr (entry->d_name, ".scope");
+        if ((!suffix) || suffix[6]) continue;
+
+        for (i = 0; i < HouseVmLatestCount; ++i) {
+            if (!strcmp (HouseVmLatest[i].scope, entry->d_name)) break;
+        }
+        if (i >= HouseVmLatestCount) {
+            if (HouseVmLatestCount >= HOUSE_VM_MAX) continue;
+            int fd = openat (dirfd(slice), entry->d_name,
+                             O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) continue;
+            struct HouseVmMetrics *vm = HouseVmLatest + HouseVmLatestCount++;
+            memset (vm, 0, sizeof(*vm));
+            vm->scope = strdup (entry->d_name);
+            vm->dirfd = fd;
+            houselinux_vm_name (vm, entry->d_name);
+            DEBUG ("VM %s: found %s\n", vm->name, vm->scope);
+            houselog_event ("VM", vm->name, "DETECTED", "");
+        }
+        struct HouseVmMetrics *vm = HouseVmLatest + i;
+        vm->present = 1;
+        vm->vcpucount = 0;
+        houselinux_vm_threads (vm, vm->dirfd, 0);
+    }
+    closedir (slice);
+
+    for (i = HouseVmLatestCount - 1; i >= 0; --i) {
+        if (!HouseVmLatest[i].present) houselinux_vm_forget (i);
+    }
+}
+
+static long long houselinux_vm_field (const char *buffer, const char *name) {
+    const char *field = strstr (buffer, name);
+    if (!field) return 0;
+    return atoll (field + strlen(name));
+}
+
+// Return the total run queue wait of the VM's vCPU threads (nanoseconds).
+// The second field of schedstat is the time spent waiting on a runqueue.
+//
+static long long houselinux_vm_wait (struct HouseVmMetrics *vm) {
+
+    long long wait = 0;
+    int i;
+    for (i = 0; i < vm->vcpucount; ++i) {
+        char path[64];
+        char buffer[128];
+        snprintf (path, sizeof(path), "/proc/%d/schedstat", vm->vcpus[i]);
+        if (houselinux_vm_read (AT_FDCWD, path, buffer, sizeof(buffer)) <= 0) {
+            HouseVmResolve = 0; // This vCPU thread is gone.
+            continue;
+        }
+        const char *field = strchr (buffer, ' ');
+        if (field) wait += atoll (field + 1);
+    }
+    return wait;
+}
+
+static void houselinux_vm_sample (struct HouseVmMetrics *vm,
+                                  int index, long long elapsed) {
+
+    char buffer[4096];
+
+    long long usage = 0;
+    if (houselinux_vm_read (vm->dirfd, "cpu.stat", buffer, sizeof(buffer)) > 0)
+        usage = houselinux_vm_field (buffer, "usage_usec ");
+
+    long long memory = 0;
+    if (houselinux_vm_read (vm->dirfd, "memory.current",
+                            buffer, sizeof(buffer)) > 0)
+        memory = atoll (buffer);
+
+    // io.stat has one line per device: sum all devices.
+    long long rdbytes = 0;
+    long long wrbytes = 0;
+    if (houselinux_vm_read (vm->dirfd, "io.stat", buffer, sizeof(buffer)) > 0) {
+        const char *cursor = buffer;
+        while ((cursor = strstr (cursor, "rbytes="))) {
+            rdbytes += atoll (cursor + 7);
+            cursor += 7;
+        }
+        cursor = buffer;
+        while ((cursor = strstr (cursor, "wbytes="))) {
+            wrbytes += atoll (cursor + 7);
+            cursor += 7;
+        }
+    }
+
+    long long wait = houselinux_vm_wait (vm);
+
+    if (vm->baseline && (elapsed > 0)) {
+        // Elapsed is in microseconds.
+        vm->cpu[index] = (100 * (usage - vm->usage)) / elapsed;
+        vm->runwait[index] = (wait - vm->wait) / (10 * elapsed);
+        vm->rdrate[index] =
+            ((rdbytes - vm->rdbytes) * 1000000) / (elapsed * 1024);
+        vm->wrrate[index] =
+            ((wrbytes - vm->wrbytes) * 1000000) / (elapsed * 1024);
+        if (vm->runwait[index] < 0) vm->runwait[index] = 0; // vCPU changes.
+        vm->memory[index] = memory / (1024 * 1024);
+    }
+    vm->usage = usage;
+    vm->wait = wait;
+    vm->rdbytes = rdbytes;
+    vm->wrbytes = wrbytes;
+}
+
+static int houselinux_vm_report (char *buffer, int size,
+                                 time_t now, time_t since) {
+    int i;
+    int cursor = 0;
+    int start = 0;
+    int startvm = 0;
+    const char *sep = "";
+
+    if (HouseVmLatestCount <= 0) return 0;
+
+    cursor = snprintf (buffer, size, ",\"vm\":{");
+    if (cursor >= size) return 0;
+    start = cursor;
+
+    for (i = 0; i < HouseVmLatestCount; ++i) {
+        struct HouseVmMetrics *vm = HouseVmLatest + i;
+        startvm = cursor;
+        cursor += snprintf (buffer+cursor, size-cursor,
+                            "%s\"%s\":", sep, vm->name);
+        if (cursor >= size) break;
+        int startmetrics = cursor;
+
+        static const char *names[] = {"cpu", "wait", "memory", "rdrate", "wrrate"};
+        static const char *units[] = {"%", "%", "MB", "KB/s", "KB/s"};
+        long long *values[] = {vm->cpu, vm->runwait, vm->memory,
+                               vm->rdrate, vm->wrrate};
+        int m;
+        for (m = 0; m < 5; ++m) {
+            if (now) {
+                cursor += houselinux_reduce_details_json
+                              (buffer+cursor, size-cursor, since,
+                               names[m], units[m], now,
+                               HOUSE_VM_PERIOD, HOUSE_VM_SPAN,
+                               vm->timestamps, values[m]);
+            } else {
+                cursor += houselinux_reduce_recent_json
+                              (buffer+cursor, size-cursor, names[m],
+                               vm->timestamps, values[m],
+                               HOUSE_VM_SPAN, units[m]);
+            }
+            if (cursor >= size) break;
+        }
+        if (cursor >= size) break;
+
+        if (cursor == startmetrics) {
+            cursor = startvm; // No data to report for this VM.
+            continue;
+        }
+        buffer[startmetrics] = '{'; // Overwrite the ','.
+        cursor += snprintf (buffer+cursor, size-cursor, "}");
+        sep = ",";
+    }
+    if (cursor == start) return 0; // No data to report for any VM.
+    cursor += snprintf (buffer+cursor, size-cursor, "}");
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+int houselinux_vm_status (char *buffer, int size) {
+    return houselinux_vm_report (buffer, size, 0, 0);
+}
+
+int houselinux_vm_summary (char *buffer, int size) {
+    return houselinux_vm_status (buffer, size); // Already the shortest.
+}
+
+int houselinux_vm_details (char *buffer, int size,
+                           time_t now, time_t since) {
+    return houselinux_vm_report (buffer, size, now, since);
+}
+
+void houselinux_vm_export (void) {
+
+    static const char *names[] = {"cpu", "wait", "memory", "rdrate", "wrrate"};
+    static const char *units[] = {"%", "%", "MB", "KB/s", "KB/s"};
+
+    int i;
+    for (i = 0; i < HouseVmLatestCount; ++i) {
+        struct HouseVmMetrics *vm = HouseVmLatest + i;
+        long long *values[] = {vm->cpu, vm->runwait, vm->memory,
+                               vm->rdrate, vm->wrrate};
+        int m;
+        for (m = 0; m < 5; ++m) {
+            char name[128];
+            snprintf (name, sizeof(name), "vm.%.64s.%s", vm->name, names[m]);
+            houselinux_export_series (name, units[m], HOUSE_VM_SPAN,
+                                      vm->timestamps, values[m]);
+        }
+    }
+}
+
+void houselinux_vm_background (time_t now) {
+
+    static time_t NextVmCollect = 0;
+
+    if (now < NextVmCollect) return;
+    NextVmCollect = now + HOUSE_VM_PERIOD;
+
+    if (now >= HouseVmResolve) houselinux_vm_resolve (now);
+    if (HouseVmLatestCount <= 0) return;
+
+    struct timespec current;
+    clock_gettime (CLOCK_MONOTONIC, &current);
+    long long elapsed = // Microseconds, as the cgroup CPU usage.
+        (current.tv_sec - HouseVmPrevious.tv_sec) * 1000000LL
+            + (current.tv_nsec - HouseVmPrevious.tv_nsec) / 1000;
+    HouseVmPrevious = current;
+
+    int index = (now / HOUSE_VM_PERIOD) % HOUSE_VM_SPAN;
+    int i;
+    for (i = 0; i < HouseVmLatestCount; ++i) {
+        struct HouseVmMetrics *vm = HouseVmLatest + i;
+        houselinux_vm_sample (vm, index, elapsed);
+        if (vm->baseline) {
+            vm->timestamps[index] = now;
+
+            char name[128];
+            snprintf (name, sizeof(name), "vm.%.64s.cpu", vm->name);
+            houselinux_sample (name, vm->cpu[index], "%", now);
+            snprintf (name, sizeof(name), "vm.%.64s.wait", vm->name);
+            houselinux_sample (name, vm->runwait[index], "%", now);
+        }
+        vm->baseline = 1;
+    }
+}
+
@@ -0,0 +1,248 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_wakeup.c - Measure the scheduling wakeup latency.
+ *
+ * SYNOPSYS:
+ *
+ * void houselinux_wakeup_initialize (int argc, const char **argv);
+ *
+ *    Initialize this module. The measurement is only enabled when the
+ *    -metrics-wakeup[=MS] option is present (default interval: 10 ms).
+ *
+ * void houselinux_wakeup_background (time_t now);
+ *
+ *    The periodic function that calculates the latency statistics.
+ *
+ * int houselinux_wakeup_report (char *buffer, int size);
+ *
+ *    Populate the latency statistics for the latest 5 minutes window,
+ *    in JSON. This is part of the cpu section.
+ *
+ * A thread wakes up at regular intervals, using clock_nanosleep() with
+ * absolute deadlines, and measures how late it woke up (in the style of
+ * cyclictest). Each overshoot is counted in a log2 histogram. The
+ * thread uses the normal time sharing policy, not a real-time one, so
+ * that it measures what ordinary services experience, and never
+ * preempts them.
+ *
+ * Every 5 minutes, the median, 99th percentile and maximum overshoot
+ * are calculated from the histogram, with the CPU time used by the
+ * thread itself.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houselinux_sample.h"
+#include "houselinux_wakeup.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define HOUSE_WAKEUP_WINDOW  300 // Seconds.
+#define HOUSE_WAKEUP_SLOTS    32 // Slot N counts [2^N, 2^(N+1)[ us.
+
+static long long HouseWakeupInterval = 0; // ns, 0 if disabled.
+
+// Shared with the thread: only accessed using atomic operations.
+static unsigned long long HouseWakeupCounts[HOUSE_WAKEUP_SLOTS];
+static unsigned long long HouseWakeupMax;
+
+static pthread_t HouseWakeupThread;
+static clockid_t HouseWakeupCpuClock;
+
+struct HouseWakeupWindow {
+    time_t timestamp;
+    long long p50;
+    long long p99;
+    long long max;
+    long long overhead; // Thread CPU time, in us per second.
+};
+
+static struct HouseWakeupWindow HouseWakeupLatest;
+
+static unsigned long long HouseWakeupPrevious[HOUSE_WAKEUP_SLOTS];
+static long long HouseWakeupPreviousCpu = 0;
+
+
+static long long houselinux_wakeup_ns (const struct timespec *t) {
+    return t->tv_sec * 1000000000LL + t->tv_nsec;
+}
+
+static int houselinux_wakeup_slot (unsigned long long value) {
+    int slot = 0;
+    while ((value > 1) && (slot < HOUSE_WAKEUP_SLOTS - 1)) {
+        value >>= 1;
+        slot += 1;
+    }
+    return slot;
+}
+
+static void *houselinux_wakeup_thread (void *context) {
+
+    struct timespec deadline;
+    clock_gettime (CLOCK_MONOTONIC, &deadline);
+
+    for (;;) {
+        long long next = houselinux_wakeup_ns (&deadline) + HouseWakeupInterval;
+        deadline.tv_sec = next / 1000000000LL;
+        deadline.tv_nsec = next % 1000000000LL;
+
+        while (clock_nanosleep (CLOCK_MONOTONIC,
+                                TIMER_ABSTIME, &deadline, 0) == EINTR) ;
+
+        struct timespec woken;
+        clock_gettime (CLOCK_MONOTONIC, &woken);
+        long long late = houselinux_wakeup_ns (&woken) - next;
+        if (late < 0) late = 0;
+        unsigned long long us = late / 1000;
+
+        __atomic_fetch_add (HouseWakeupCounts + houselinux_wakeup_slot (us),
+                            1, __ATOMIC_RELAXED);
+        unsigned long long max = __atomic_load_n (&HouseWakeupMax,
+                                                  __ATOMIC_RELAXED);
+        while ((us > max) &&
+               !__atomic_compare_exchange_n (&HouseWakeupMax, &max, us, 1,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED)) ;
+
+        // Skip the deadlines that were missed, instead of catching up.
+        if (late > HouseWakeupInterval) deadline = woken;
+    }
+    return 0;
+}
+
+void houselinux_wakeup_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        const char *text = 0;
+        if (echttp_option_present ("-metrics-wakeup", argv[i])) {
+            HouseWakeupInterval = 10;
+        } else if (echttp_option_match ("-metrics-wakeup=", argv[i], &text)) {
+            HouseWakeupInterval = atoll (text);
+            if (HouseWakeupInterval < 1) HouseWakeupInterval = 1;
+        }
+    }
+    if (!HouseWakeupInterval) return;
+    HouseWakeupInterval *= 1000000; // Milliseconds to nanoseconds.
+
+    // The signals must still be handled by the main thread only.
+    sigset_t all;
+    sigset_t previous;
+    sigfillset (&all);
+    pthread_sigmask (SIG_SETMASK, &all, &previous);
+    int failed =
+        pthread_create (&HouseWakeupThread, 0, houselinux_wakeup_thread, 0);
+    pthread_sigmask (SIG_SETMASK, &previous, 0);
+    if (failed) {
+        houselog_trace (HOUSE_FAILURE, "wakeup", "cannot create thread");
+        HouseWakeupInterval = 0;
+        return;
+    }
+    if (pthread_getcpuclockid (HouseWakeupThread, &HouseWakeupCpuClock))
+        HouseWakeupCpuClock = 0;
+    DEBUG ("Wakeup latency thread started (%lld ns interval)\n",
+           HouseWakeupInterval);
+}
+
+static long long houselinux_wakeup_percentile (const unsigned long long *count,
+                                               unsigned long long total,
+                                               int percentile) {
+    unsigned long long rank = (total * percentile + 99) / 100;
+    unsigned long long cumulated = 0;
+    int slot;
+    for (slot = 0; slot < HOUSE_WAKEUP_SLOTS - 1; ++slot) {
+        cumulated += count[slot];
+        if (cumulated >= rank) break;
+    }
+    return 1LL << (slot + 1); // The slot's upper bound.
+}
+
+int houselinux_wakeup_report (char *buffer, int size) {
+
+    if (!HouseWakeupLatest.timestamp) return 0;
+
+    int cursor = snprintf (buffer, size,
+                           ",\"wakeup50\":[%lld,\"us\"]"
+                           ",\"wakeup99\":[%lld,\"us\"]"
+                           ",\"wakeupmax\":[%lld,\"us\"]"
+                           ",\"wakeupcost\":[%lld,\"us/s\"]",
+                           HouseWakeupLatest.p50,
+                           HouseWakeupLatest.p99,
+                           HouseWakeupLatest.max,
+                           HouseWakeupLatest.overhead);
+    if (cursor >= size) return 0;
+    return cursor;
+}
+
+void houselinux_wakeup_background (time_t now) {
+
+    static time_t NextWakeupWindow = 0;
+    static time_t WindowStart = 0;
+
+    if (!HouseWakeupInterval) return;
+
+    if (now < NextWakeupWindow) return;
+    NextWakeupWindow = now - (now % HOUSE_WAKEUP_WINDOW) + HOUSE_WAKEUP_WINDOW;
+
+    unsigned long long current[HOUSE_WAKEUP_SLOTS];
+    unsigned long long delta[HOUSE_WAKEUP_SLOTS];
+    unsigned long long total = 0;
+    int slot;
+    for (slot = 0; slot < HOUSE_WAKEUP_SLOTS; ++slot) {
+        current[slot] = __atomic_load_n (HouseWakeupCounts + slot,
+                                         __ATOMIC_RELAXED);
+        delta[slot] = current[slot] - HouseWakeupPrevious[slot];
+        total += delta[slot];
+    }
+    memcpy (HouseWakeupPrevious, current, sizeof(HouseWakeupPrevious));
+    unsigned long long max = __atomic_exchange_n (&HouseWakeupMax, 0,
+                                                  __ATOMIC_RELAXED);
+
+    long long cpu = 0;
+    struct timespec cputime;
+    if (HouseWakeupCpuClock &&
+        !clock_gettime (HouseWakeupCpuClock, &cputime))
+        cpu = houselinux_wakeup_ns (&cputime);
+    long long cpudelta = cpu - HouseWakeupPreviousCpu;
+    HouseWakeupPreviousCpu = cpu;
+
+    // The first window is partial: only use it as a baseline.
+    time_t start = WindowStart;
+    WindowStart = now;
+    if (!start || (total == 0) || (now <= start)) return;
+
+    HouseWakeupLatest.timestamp = now;
+    HouseWakeupLatest.p50 = houselinux_wakeup_percentile (delta, total, 50);
+    HouseWakeupLatest.p99 = houselinux_wakeup_percentile (delta, total, 99);
+    HouseWakeupLatest.max = max;
+    HouseWakeupLatest.overhead = (cpudelta / 1000) / (now - start);
+
+    houselinux_sample ("cpu.wakeup99", HouseWakeupLatest.p99, "us", now);
+    houselinux_sample ("cpu.wakeupmax", HouseWakeupLatest.max, "us", now);
+}
@@ -0,0 +1,228 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_bench_parse.c - Compare the methods for decoding /proc files.
+ *
+ * SYNOPSYS:
+ *
+ * houselinux_bench_parse [-iterations=N] [-devices=N] [FILE]
+ *
+ *    Decode a /proc/diskstats content N times (default: 2000) using the
+ *    atoll() based loops that the collectors used before, then using the
+ *    houselinux_parse functions, and print the average time per decoding
+ *    of the whole content. The totals of all the values decoded are also
+ *    compared, to make sure that both methods return the same values.
+ *
+ *    If no file is specified, a fixture is generated with the specified
+ *    number of devices (default: 1000), each with the 17 counters of
+ *    the current kernels and values of various length.
+ *
+ * This program is built using "make bench" and is not installed.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <echttp.h>
+
+#include "houselinux_parse.h"
+
+#define HOUSE_BENCH_PADDING 8 // Same as HOUSE_SOURCE_PADDING.
+
+static char *HouseBenchFixture = 0;
+static int   HouseBenchFixtureLength = 0;
+
+static void houselinux_bench_generate (int devices) {
+
+    int size = devices * 256;
+    HouseBenchFixture = malloc (size + HOUSE_BENCH_PADDING);
+
+    unsigned long long seed = 12345;
+    int cursor = 0;
+    int i;
+    for (i = 0; i < devices; ++i) {
+        cursor += snprintf (HouseBenchFixture + cursor, size - cursor,
+                            " %4d %7d nvme%dn1", 259, i, i);
+        int j;
+        for (j = 0; j < 17; ++j) {
+            // Mix short (e.g. in progress) and long (e.g. sectors) counters.
+            seed = seed * 6364136223846793005ULL + 1;
+            unsigned long long value =
+                (seed >> 20) % ((j % 3) ? 100000000000ULL : 1000ULL);
+            cursor += snprintf (HouseBenchFixture + cursor, size - cursor,
+                                " %llu", value);
+        }
+        cursor += snprintf (HouseBenchFixture + cursor, size - cursor, "\n");
+    }
+    HouseBenchFixtureLength = cursor;
+}
+
+static int houselinux_bench_load (const char *path) {
+
+    FILE *f = fopen (path, "r");
+    if (!f) return 0;
+
+    int size = 0;
+    for (;;) {
+        size += 65536;
+        HouseBenchFixture = realloc (HouseBenchFixture,
+                                     size + HOUSE_BENCH_PADDING);
+        int length = fread (HouseBenchFixture + HouseBenchFixtureLength, 1,
+                            size - HouseBenchFixtureLength - 1, f);
+        if (length <= 0) break;
+        HouseBenchFixtureLength += length;
+    }
+    HouseBenchFixture[HouseBenchFixtureLength] = 0;
+    fclose (f);
+    return 1;
+}
+
+static double houselinux_bench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+// The decoding loop used before the houselinux_parse module existed.
+//
+static char *skipspace (char *line) {
+    while (*line == ' ') line += 1;
+    return line;
+}
+
+static char *skipvalue (char *line) {
+    while (*line > ' ') line += 1;
+    return skipspace (line);
+}
+
+static long long houselinux_bench_atoll (char *data) {
+
+    long long total = 0;
+    char *line = data;
+    while (*line) {
+        char *eol = strchr (line, '\n');
+        if (eol) *eol = 0;
+
+        line = skipspace (line);
+        total += atoi (line);
+        line = skipvalue (line);
+        total += atoi (line);
+        line = skipvalue (line); // ignore the device name.
+        int i;
+        for (i = 0; i < 17; ++i) {
+            line = skipvalue (line);
+            total += atoll (line);
+        }
+        if (!eol) break;
+        line = eol + 1;
+    }
+    return total;
+}
+
+static long long houselinux_bench_swar (char *data) {
+
+    long long total = 0;
+    char *line = data;
+    while (*line) {
+        char *eol = strchr (line, '\n');
+        if (eol) *eol = 0;
+
+        long long id[2];
+        long long value[17];
+        int count = houselinux_parse_numbers (&line, id, 2);
+        line = houselinux_parse_skip (line); // ignore the device name.
+        count += houselinux_parse_numbers (&line, value, 17);
+        int i;
+        for (i = 0; i < count; ++i) total += (i < 2) ? id[i] : value[i-2];
+
+        if (!eol) break;
+        line = eol + 1;
+    }
+    return total;
+}
+
+static double houselinux_bench_run (long long (*decode) (char *),
+                                    int iterations, long long *total) {
+
+    // The content is split in lines, so it must be copied every time.
+    char *data = malloc (HouseBenchFixtureLength + 1 + HOUSE_BENCH_PADDING);
+
+    double elapsed = 0;
+    int i;
+    for (i = 0; i < iterations; ++i) {
+        memcpy (data, HouseBenchFixture, HouseBenchFixtureLength + 1);
+        double start = houselinux_bench_now ();
+        *total = decode (data);
+        elapsed += houselinux_bench_now () - start;
+    }
+    free (data);
+    return elapsed / iterations;
+}
+
+int main (int argc, const char **argv) {
+
+    int iterations = 2000;
+    int devices = 1000;
+    const char *path = 0;
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        const char *value;
+        if (echttp_option_match ("-iterations=", argv[i], &value)) {
+            iterations = atoi (value);
+            if (iterations <= 0) iterations = 1;
+        } else if (echttp_option_match ("-devices=", argv[i], &value)) {
+            devices = atoi (value);
+            if (devices <= 0) devices = 1;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (path) {
+        if (!houselinux_bench_load (path)) {
+            printf ("cannot read %s\n", path);
+            return 1;
+        }
+        printf ("%s, %d bytes, %d iterations\n",
+                path, HouseBenchFixtureLength, iterations);
+    } else {
+        houselinux_bench_generate (devices);
+        printf ("%d devices, %d bytes, %d iterations\n",
+                devices, HouseBenchFixtureLength, iterations);
+    }
+
+    long long reference = 0;
+    long long total = 0;
+    double before = houselinux_bench_run (houselinux_bench_atoll,
+                                          iterations, &reference);
+    double after = houselinux_bench_run (houselinux_bench_swar,
+                                         iterations, &total);
+
+    printf ("atoll:            %8.1f us per file\n", before);
+    printf ("houselinux_parse: %8.1f us per file (%.2fx)\n",
+            after, before / after);
+    if (total != reference) {
+        printf ("the values decoded are different!\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_bench_source.c - Compare the methods for reading /proc files.
+ *
+ * SYNOPSYS:
+ *
+ * houselinux_bench_source [-ticks=N] [FILE ..]
+ *
+ *    Read the same set of files N times (default: 1000) using each of
+ *    the following methods, and print the average time per collection
+ *    cycle:
+ *    - open(), read() and close() for each file, as done before the
+ *      houselinux_source module existed;
+ *    - the houselinux_source module using pread();
+ *    - the houselinux_source module using io_uring (-metrics-uring).
+ *
+ *    If no file is listed, the files read by the HouseLinux collectors
+ *    on this host are used, including the cpuidle files of every core:
+ *    the difference between the methods grows with the number of cores.
+ *
+ *    This only measures time. The number of system calls per cycle can
+ *    be checked using "strace -c -f" on this program.
+ *
+ * This program is built using "make bench" and is not installed.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <echttp.h>
+
+#include "houselinux_source.h"
+
+#define HOUSE_BENCH_FILES 4096
+
+static const char *HouseBenchPatterns[] = {
+    "/proc/stat",
+    "/proc/loadavg",
+    "/proc/meminfo",
+    "/proc/diskstats",
+    "/proc/net/dev",
+    "/proc/interrupts",
+    "/proc/vmstat",
+    "/sys/class/hwmon/hwmon*/temp1_input",
+    "/sys/devices/system/cpu/cpu*/cpuidle/state*/time",
+    "/sys/devices/system/cpu/cpu*/cpuidle/state*/usage",
+    0
+};
+
+static const char *HouseBenchFiles[HOUSE_BENCH_FILES];
+static int HouseBenchFilesCount = 0;
+
+static void houselinux_bench_add (const char *pattern) {
+
+    glob_t found;
+    if (glob (pattern, 0, 0, &found)) return;
+
+    int i;
+    for (i = 0; i < found.gl_pathc; ++i) {
+        if (HouseBenchFilesCount >= HOUSE_BENCH_FILES) break;
+        HouseBenchFiles[HouseBenchFilesCount++] = strdup (found.gl_pathv[i]);
+    }
+    globfree (&found);
+}
+
+static double houselinux_bench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+static double houselinux_bench_open (int ticks) {
+
+    static char buffer[65536];
+    long long total = 0;
+
+    double start = houselinux_bench_now ();
+    int tick;
+    for (tick = 0; tick < ticks; ++tick) {
+        int i;
+        for (i = 0; i < HouseBenchFilesCount; ++i) {
+            int fd = open (HouseBenchFiles[i], O_RDONLY);
+            if (fd < 0) continue;
+            int length;
+            while ((length = read (fd, buffer, sizeof(buffer))) > 0)
+                total += length;
+            close (fd);
+        }
+    }
+    double elapsed = houselinux_bench_now () - start;
+    if (total <= 0) printf ("warning: nothing was read\n");
+    return elapsed / ticks;
+}
+
+static double houselinux_bench_source (int ticks, time_t first,
+                                       int *sources, int count) {
+
+    long long total = 0;
+
+    // Each cycle uses a new time, so that all the sources are due.
+    double start = houselinux_bench_now ();
+    time_t tick;
+    for (tick = first; tick < first + ticks; ++tick) {
+        int i;
+        for (i = 0; i < count; ++i) {
+            const char *data = houselinux_source_get (sources[i], tick);
+            if (data) total += strlen (data);
+        }
+    }
+    double elapsed = houselinux_bench_now () - start;
+    if (total <= 0) printf ("warning: nothing was read\n");
+    return elapsed / ticks;
+}
+
+int main (int argc, const char **argv) {
+
+    int ticks = 1000;
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        const char *value;
+        if (echttp_option_match ("-ticks=", argv[i], &value)) {
+            ticks = atoi (value);
+            if (ticks <= 0) ticks = 1;
+        } else {
+            houselinux_bench_add (argv[i]);
+        }
+    }
+    if (HouseBenchFilesCount <= 0) {
+        for (i = 0; HouseBenchPatterns[i]; ++i)
+            houselinux_bench_add (HouseBenchPatterns[i]);
+    }
+
+    // The same sources are used for both methods: only the backend changes.
+    static int sources[HOUSE_BENCH_FILES];
+    int count = 0;
+    for (i = 0; i < HouseBenchFilesCount; ++i) {
+        int source = houselinux_source_register (HouseBenchFiles[i], 1);
+        if (source >= 0) sources[count++] = source;
+    }
+    printf ("%d files, %d cycles\n", count, ticks);
+    if (count <= 0) return 1;
+
+    const char *pread_argv[] = {argv[0]};
+    houselinux_source_initialize (1, pread_argv);
+    printf ("open/read/close: %8.1f us per cycle\n",
+            houselinux_bench_open (ticks));
+    printf ("pread:           %8.1f us per cycle\n",
+            houselinux_bench_source (ticks, 1, sources, count));
+
+    const char *uring_argv[] = {argv[0], "-metrics-uring"};
+    houselinux_source_initialize (2, uring_argv);
+    printf ("io_uring:        %8.1f us per cycle\n",
+            houselinux_bench_source (ticks, ticks + 1, sources, count));
+    return 0;
+}
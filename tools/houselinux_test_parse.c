@@ -0,0 +1,243 @@
+/* Houselinux - a web server to collect Linux metrics.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houselinux_test_parse.c - Check the houselinux_parse functions.
+ *
+ * SYNOPSYS:
+ *
+ * houselinux_test_parse
+ *
+ *    Compare the result of houselinux_parse_number() with atoll():
+ *    - for every value from 0 to 9999999 (all numbers up to 7 digits);
+ *    - for the values around every power of 10, up to the largest
+ *      long long value, positive and negative;
+ *    - for 10 million random values of random length, with random
+ *      separators.
+ *
+ *    Every string is placed right before a guard page, with only the
+ *    padding of the source buffers readable past its end, and that
+ *    padding is filled with random bytes: this checks that the decoding
+ *    never reads past the padding and does not depend on its content.
+ *
+ *    It also checks that the fields that are not numbers are rejected,
+ *    and the decoding of a /proc/diskstats line.
+ *
+ *    Return 0 if all checks passed, 1 otherwise.
+ *
+ * This program is built and run using "make test", once with the SWAR
+ * decoder and once with the plain loop (-DHOUSE_PARSE_SCALAR).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "houselinux_parse.h"
+
+#define HOUSE_TEST_PADDING 8 // Same as HOUSE_SOURCE_PADDING.
+#define HOUSE_TEST_RANDOM  10000000
+
+static char *HouseTestPage = 0; // Followed by a guard page.
+static int HouseTestPageSize = 0;
+
+static long HouseTestCount = 0;
+static long HouseTestErrors = 0;
+
+static unsigned long long HouseTestSeed = 88172645463325252ULL;
+
+static unsigned long long houselinux_test_random (void) {
+    HouseTestSeed ^= HouseTestSeed << 13;
+    HouseTestSeed ^= HouseTestSeed >> 7;
+    HouseTestSeed ^= HouseTestSeed << 17;
+    return HouseTestSeed;
+}
+
+static void houselinux_test_setup (void) {
+
+    HouseTestPageSize = sysconf (_SC_PAGESIZE);
+    HouseTestPage = mmap (0, 2 * HouseTestPageSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (HouseTestPage == MAP_FAILED) {
+        perror ("mmap");
+        exit (1);
+    }
+    if (mprotect (HouseTestPage + HouseTestPageSize,
+                  HouseTestPageSize, PROT_NONE)) {
+        perror ("mprotect");
+        exit (1);
+    }
+}
+
+// Copy the text right before the guard page, followed by its null
+// terminator and the padding (random bytes).
+//
+static char *houselinux_test_place (const char *text) {
+
+    int length = strlen (text);
+    char *start =
+        HouseTestPage + HouseTestPageSize - HOUSE_TEST_PADDING - length - 1;
+    memcpy (start, text, length + 1);
+
+    int i;
+    for (i = 1; i <= HOUSE_TEST_PADDING; ++i)
+        start[length + i] = (char) houselinux_test_random ();
+    return start;
+}
+
+static void houselinux_test_failed (const char *text,
+                                    const char *reason, long long value) {
+    if (HouseTestErrors++ < 10)
+        printf ("FAILED: \"%s\": %s (%lld)\n", text, reason, value);
+}
+
+// Decode one number and check it against atoll(). The text must be
+// a number, possibly followed by separators and another field.
+//
+static void houselinux_test_number (const char *text, const char *next) {
+
+    char *cursor = houselinux_test_place (text);
+    long long value = 0;
+
+    HouseTestCount += 1;
+    if (!houselinux_parse_number (&cursor, &value)) {
+        houselinux_test_failed (text, "rejected", 0);
+        return;
+    }
+    if (value != atoll (text)) {
+        houselinux_test_failed (text, "wrong value", value);
+        return;
+    }
+    if (strcmp (cursor, next)) {
+        houselinux_test_failed (text, "wrong next field", value);
+    }
+}
+
+static void houselinux_test_exhaustive (void) {
+
+    char text[64];
+    long long value;
+    for (value = 0; value < 10000000; ++value) {
+        snprintf (text, sizeof(text), "%lld x", value);
+        houselinux_test_number (text, "x");
+        snprintf (text, sizeof(text), "%lld", value);
+        houselinux_test_number (text, "");
+    }
+}
+
+static void houselinux_test_limits (void) {
+
+    char text[64];
+    unsigned long long power = 1;
+    int digits;
+    for (digits = 1; digits <= 19; ++digits) {
+        unsigned long long around[] = {power - 1, power, power + 1,
+                                       power * 10 - 1, power * 9};
+        int i;
+        for (i = 0; i < 5; ++i) {
+            if (around[i] > LLONG_MAX) continue;
+            snprintf (text, sizeof(text), "%llu", around[i]);
+            houselinux_test_number (text, "");
+            snprintf (text, sizeof(text), "\t-%llu\t7", around[i]);
+            houselinux_test_number (text, "7");
+        }
+        if (digits < 19) power *= 10;
+    }
+    snprintf (text, sizeof(text), "%lld", LLONG_MAX);
+    houselinux_test_number (text, "");
+    snprintf (text, sizeof(text), "%lld", LLONG_MIN + 1);
+    houselinux_test_number (text, "");
+    houselinux_test_number ("000000000000000000123 4", "4");
+}
+
+static void houselinux_test_random_values (void) {
+
+    static const char *Separators[] = {" ", "\t", "  ", " \t "};
+    static const char *Endings[] = {"", " ", "\n", " y", "\tz", ":"};
+    static const char *Next[] = {"", "", "\n", "y", "z", ""}; // ':' is skipped.
+
+    char text[64];
+    int i;
+    for (i = 0; i < HOUSE_TEST_RANDOM; ++i) {
+        unsigned long long value =
+            houselinux_test_random () >> (houselinux_test_random () % 64);
+        if (value > LLONG_MAX) value >>= 1;
+        int ending = houselinux_test_random () % 6;
+        snprintf (text, sizeof(text), "%s%s%llu%s",
+                  Separators[houselinux_test_random () % 4],
+                  (houselinux_test_random () % 10) ? "" : "-",
+                  value, Endings[ending]);
+        houselinux_test_number (text, Next[ending]);
+    }
+}
+
+static void houselinux_test_invalid (void) {
+
+    // The cursor must be left on the field, after the leading spaces.
+    static const char *Invalid[] = {"", "abc", "  x12", "-", "- 1", ":", "\n"};
+    static const char *Field[] =   {"", "abc", "x12",   "-", "- 1", ":", "\n"};
+
+    int i;
+    for (i = 0; i < sizeof(Invalid) / sizeof(Invalid[0]); ++i) {
+        char *cursor = houselinux_test_place (Invalid[i]);
+        long long value = 0;
+        HouseTestCount += 1;
+        if (houselinux_parse_number (&cursor, &value))
+            houselinux_test_failed (Invalid[i], "accepted", value);
+        else if (strcmp (cursor, Field[i]))
+            houselinux_test_failed (Invalid[i], "cursor moved", 0);
+    }
+}
+
+static void houselinux_test_diskstats (void) {
+
+    char *cursor = houselinux_test_place
+        ("   8       0 sda 1224 34 56780 90 1 2 3 4 0 1010 2020 0 0 0 0 5 6");
+
+    long long id[2];
+    long long values[20];
+    HouseTestCount += 1;
+    if ((houselinux_parse_numbers (&cursor, id, 2) != 2) ||
+        (id[0] != 8) || (id[1] != 0) || strncmp (cursor, "sda ", 4)) {
+        houselinux_test_failed ("diskstats", "wrong device numbers", id[0]);
+        return;
+    }
+    cursor = houselinux_parse_skip (cursor);
+    if ((houselinux_parse_numbers (&cursor, values, 20) != 17) ||
+        (values[0] != 1224) || (values[2] != 56780) ||
+        (values[10] != 2020) || (values[16] != 6) || *cursor) {
+        houselinux_test_failed ("diskstats", "wrong counters", values[0]);
+    }
+}
+
+int main (int argc, const char **argv) {
+
+    houselinux_test_setup ();
+
+    houselinux_test_exhaustive ();
+    houselinux_test_limits ();
+    houselinux_test_random_values ();
+    houselinux_test_invalid ();
+    houselinux_test_diskstats ();
+
+    printf ("%ld checks, %ld failed\n", HouseTestCount, HouseTestErrors);
+    return HouseTestErrors ? 1 : 0;
+}